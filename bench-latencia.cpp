@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mensajes.h"
+
+#define SERVER_PORT				12345
+#define ARRANQUE_SERVIDOR_MS	500
+#define CALENTAMIENTO			200		// Posiciones iniciales que no cuentan
+#define ESPERA_FINAL_MS			2000
+
+using namespace std;
+
+/* Mide la latencia de reenvío del servidor: un emisor envía posiciones a ritmo fijo a un grupo y cada
+receptor anota cuánto tarda en llegarle cada una desde que se envió. Arranca ./servidor una vez en
+modo normal y otra con espera activa y compara los percentiles de las dos:
+
+	./bench-latencia [-n receptores] [-m posiciones] [-r hz] [-B "opciones espera activa"] [-- opciones]
+
+Lo que va detrás de -- se pasa al servidor en las dos ejecuciones */
+
+int receptores = 4;
+int posiciones = 5000;
+int hz = 1000;
+
+uint64_t reloj_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int conectar(grupoid_t grupo, clienteid_t *id)
+{
+	struct sockaddr_in direccion;
+	char buffer[tamano_frame(MENSAJE_CONEXION)];
+	char respuesta[tamano_frame(MENSAJE_CONEXION_SATISFACTORIA)];
+	struct mensaje_conexion conexion;
+	int socketfd = socket(AF_INET, SOCK_STREAM, 0), uno = 1, leido = 0;
+
+	direccion.sin_family = AF_INET;
+	direccion.sin_port = htons(SERVER_PORT);
+	inet_aton("127.0.0.1", &direccion.sin_addr);
+
+	if(connect(socketfd, (struct sockaddr *) &direccion, sizeof(direccion)) < 0)
+	{
+		perror("connect()");
+		exit(-1);
+	}
+
+	setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+
+	conexion.grupo = grupo;
+	conexion.capacidades = 0;
+	buffer[0] = MENSAJE_CONEXION;
+	memcpy(&buffer[1], &conexion, sizeof(conexion));
+	send(socketfd, buffer, sizeof(buffer), 0);
+
+	while(leido < (int) sizeof(respuesta))
+	{
+		int rc = recv(socketfd, respuesta + leido, sizeof(respuesta) - leido, 0);
+
+		if(rc <= 0)
+		{
+			perror("recv()");
+			exit(-1);
+		}
+		leido += rc;
+	}
+
+	memcpy(id, &respuesta[1], sizeof(clienteid_t));
+	return socketfd;
+}
+
+/* Lee de todos los receptores hasta haber recibido todas las posiciones o hasta que pasa
+ESPERA_FINAL_MS sin que llegue nada */
+void recibir(vector<int> sockets, const vector<uint64_t> *enviadas, vector<uint64_t> *latencias)
+{
+	vector<string> pendiente(sockets.size());
+	struct epoll_event eventos[64];
+	int epollfd = epoll_create1(0);
+	long esperadas = (long) sockets.size() * posiciones, recibidas = 0;
+
+	for(unsigned i = 0; i < sockets.size(); i++)
+	{
+		struct epoll_event evento;
+		evento.events = EPOLLIN;
+		evento.data.u32 = i;
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, sockets[i], &evento);
+	}
+
+	while(recibidas < esperadas)
+	{
+		int n = epoll_wait(epollfd, eventos, 64, ESPERA_FINAL_MS);
+
+		if(n <= 0)
+			break;
+
+		for(int e = 0; e < n; e++)
+		{
+			int i = eventos[e].data.u32;
+			char buffer[65536];
+			int rc = recv(sockets[i], buffer, sizeof(buffer), MSG_DONTWAIT);
+			uint64_t ahora = reloj_ns();
+
+			if(rc <= 0)
+				continue;
+
+			string &datos = pendiente[i];
+			size_t p = 0;
+
+			datos.append(buffer, rc);
+
+			while(p < datos.size())
+			{
+				int longitud = tamano_frame(datos[p]);
+
+				if(longitud == 0)
+				{
+					fprintf(stderr, "Mensaje inesperado: %d\n", datos[p]);
+					exit(-1);
+				}
+
+				if(p + longitud > datos.size())
+					break;
+
+				if(datos[p] == MENSAJE_POSICION)
+				{
+					struct mensaje_posicion posicion;
+					memcpy(&posicion, &datos[p + 1], sizeof(posicion));
+
+					if(posicion.numero_secuencia >= CALENTAMIENTO)
+						latencias->push_back(ahora - (*enviadas)[posicion.numero_secuencia]);
+
+					recibidas++;
+				}
+
+				p += longitud;
+			}
+
+			datos.erase(0, p);
+		}
+	}
+
+	close(epollfd);
+}
+
+pid_t arrancar_servidor(const vector<string> &opciones)
+{
+	pid_t pid = fork();
+
+	if(pid == 0)
+	{
+		vector<char *> argumentos;
+		int nulo = open("/dev/null", O_WRONLY);
+
+		dup2(nulo, STDOUT_FILENO);
+		dup2(nulo, STDERR_FILENO);
+
+		argumentos.push_back((char *) "./servidor");
+		for(unsigned i = 0; i < opciones.size(); i++)
+			argumentos.push_back((char *) opciones[i].c_str());
+		argumentos.push_back(NULL);
+
+		execv("./servidor", argumentos.data());
+		_exit(127);
+	}
+
+	usleep(ARRANQUE_SERVIDOR_MS * 1000);
+	return pid;
+}
+
+// Una ejecución completa contra un servidor recién arrancado; devuelve las latencias ordenadas en ns
+vector<uint64_t> medir(const vector<string> &opciones)
+{
+	pid_t servidor = arrancar_servidor(opciones);
+	vector<uint64_t> enviadas(posiciones, 0), latencias;
+	vector<int> sockets;
+	clienteid_t id;
+
+	int emisor = conectar(1, &id);
+
+	for(int i = 0; i < receptores; i++)
+	{
+		clienteid_t otro;
+		sockets.push_back(conectar(1, &otro));
+	}
+
+	usleep(100000);
+
+	thread lector(recibir, sockets, &enviadas, &latencias);
+	uint64_t periodo = 1000000000ULL / hz, siguiente = reloj_ns();
+
+	for(int i = 0; i < posiciones; i++)
+	{
+		char buffer[tamano_frame(MENSAJE_POSICION)];
+		struct mensaje_posicion posicion;
+
+		struct timespec espera = { (time_t) (siguiente / 1000000000ULL), (long) (siguiente % 1000000000ULL) };
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &espera, NULL);
+
+		posicion.cliente_id_origen = id;
+		posicion.posicion_x = i;
+		posicion.posicion_y = i;
+		posicion.posicion_z = i;
+		posicion.numero_secuencia = i;
+
+		buffer[0] = MENSAJE_POSICION;
+		memcpy(&buffer[1], &posicion, sizeof(posicion));
+
+		enviadas[i] = reloj_ns();
+		send(emisor, buffer, sizeof(buffer), 0);
+		siguiente += periodo;
+	}
+
+	lector.join();
+
+	close(emisor);
+	for(unsigned i = 0; i < sockets.size(); i++)
+		close(sockets[i]);
+
+	kill(servidor, SIGTERM);
+	waitpid(servidor, NULL, 0);
+
+	sort(latencias.begin(), latencias.end());
+	return latencias;
+}
+
+double percentil_us(const vector<uint64_t> &latencias, double p)
+{
+	if(latencias.empty())
+		return 0;
+
+	return latencias[min(latencias.size() - 1, (size_t) (latencias.size() * p))] / 1000.0;
+}
+
+void informar(const char *modo, const vector<uint64_t> &latencias)
+{
+	long esperadas = (long) receptores * (posiciones - CALENTAMIENTO);
+
+	printf("%-14s %9ld/%-9ld %9.1f %9.1f %9.1f %9.1f %9.1f\n", modo, (long) latencias.size(), esperadas,
+		   percentil_us(latencias, 0.5), percentil_us(latencias, 0.9), percentil_us(latencias, 0.99),
+		   percentil_us(latencias, 0.999), latencias.empty() ? 0 : latencias.back() / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	vector<string> comunes, activa;
+	string opciones_activa = "-b 200";
+	int opcion;
+
+	while((opcion = getopt(argc, argv, "n:m:r:B:")) != -1)
+	{
+		switch(opcion)
+		{
+			case 'n':
+				receptores = atoi(optarg);
+				break;
+			case 'm':
+				posiciones = atoi(optarg);
+				break;
+			case 'r':
+				hz = atoi(optarg);
+				break;
+			case 'B':
+				opciones_activa = optarg;
+				break;
+			default:
+				fprintf(stderr, "Uso: %s [-n receptores] [-m posiciones] [-r hz] [-B \"opciones espera activa\"] [-- opciones del servidor]\n", argv[0]);
+				return -1;
+		}
+	}
+
+	if(receptores <= 0 || posiciones <= CALENTAMIENTO || hz <= 0)
+	{
+		fprintf(stderr, "Hacen falta receptores, más de %d posiciones y un ritmo positivo.\n", CALENTAMIENTO);
+		return -1;
+	}
+
+	for(int i = optind; i < argc; i++)
+		comunes.push_back(argv[i]);
+
+	activa = comunes;
+
+	for(size_t inicio = 0, fin; inicio < opciones_activa.size(); inicio = fin + 1)
+	{
+		fin = opciones_activa.find(' ', inicio);
+		if(fin == string::npos)
+			fin = opciones_activa.size();
+		if(fin > inicio)
+			activa.push_back(opciones_activa.substr(inicio, fin - inicio));
+	}
+
+	printf("%d receptores, %d posiciones a %d Hz. Latencias en us.\n", receptores, posiciones, hz);
+	printf("%-14s %19s %9s %9s %9s %9s %9s\n", "modo", "recibidas", "p50", "p90", "p99", "p999", "max");
+
+	informar("normal", medir(comunes));
+	informar("espera activa", medir(activa));
+
+	return 0;
+}
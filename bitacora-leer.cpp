@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "bitacora.h"
+
+using namespace std;
+
+/* Convierte a texto un fichero binario de la bitácora del servidor (servidor -L ruta), con las mismas
+líneas que escribiría el servidor sin -L */
+int main(int argc, char *argv[])
+{
+	char magico[sizeof(BITACORA_MAGICO) - 1];
+	vector<string> formatos;
+	FILE *fichero;
+	int tipo;
+
+	if(argc != 2)
+	{
+		fprintf(stderr, "Uso: %s fichero\n", argv[0]);
+		return -1;
+	}
+
+	if((fichero = fopen(argv[1], "rb")) == NULL)
+	{
+		perror("fopen()");
+		return -1;
+	}
+
+	if(fread(magico, 1, sizeof(magico), fichero) != sizeof(magico) || memcmp(magico, BITACORA_MAGICO, sizeof(magico)) != 0)
+	{
+		fprintf(stderr, "%s no es un fichero de bitácora.\n", argv[1]);
+		return -1;
+	}
+
+	while((tipo = fgetc(fichero)) != EOF)
+	{
+		if(tipo == BITACORA_ENTRADA_FORMATO)
+		{
+			uint32_t id;
+			uint16_t longitud;
+
+			if(fread(&id, sizeof(id), 1, fichero) != 1 || fread(&longitud, sizeof(longitud), 1, fichero) != 1)
+				break;
+
+			string formato(longitud, '\0');
+
+			if(fread(&formato[0], 1, longitud, fichero) != longitud)
+				break;
+
+			if(id >= formatos.size())
+				formatos.resize(id + 1);
+
+			formatos[id] = formato;
+		}
+		else if(tipo == BITACORA_ENTRADA_REGISTRO)
+		{
+			struct registro_bitacora registro;
+			uint32_t id;
+			char linea[512];
+
+			if(fread(&id, sizeof(id), 1, fichero) != 1 || fread(&registro, sizeof(registro), 1, fichero) != 1)
+				break;
+
+			bitacora_formatear(linea, sizeof(linea), id < formatos.size() ? formatos[id].c_str() : "(formato desconocido)", &registro);
+			puts(linea);
+		}
+		else if(tipo == BITACORA_ENTRADA_PERDIDOS)
+		{
+			uint16_t hilo;
+			uint64_t perdidos;
+
+			if(fread(&hilo, sizeof(hilo), 1, fichero) != 1 || fread(&perdidos, sizeof(perdidos), 1, fichero) != 1)
+				break;
+
+			printf("Bitácora: perdidos %lu registros del hilo %u\n", (unsigned long) perdidos, hilo);
+		}
+		else
+		{
+			fprintf(stderr, "Entrada desconocida en la bitácora: %d\n", tipo);
+			return -1;
+		}
+	}
+
+	fclose(fichero);
+	return 0;
+}
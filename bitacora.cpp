@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <new>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "bitacora.h"
+
+
+using namespace std;
+
+static const char *nombres_nivel[] = { "ERROR", "AVISO", "INFO", "DEPURACION" };
+
+static mutex cerrojo_anillos;
+static struct anillo_bitacora *anillos[BITACORA_MAX_HILOS];
+static atomic<int> num_anillos(0);
+
+thread_local struct anillo_bitacora *bitacora_hilo = NULL;
+
+static struct anillo_bitacora * nuevo_anillo(int hilo)
+{
+    void *memoria;
+
+    if(posix_memalign(&memoria, 64, sizeof(struct anillo_bitacora)) != 0)
+    {
+        perror("bitacora->posix_memalign()");
+        exit(-1);
+    }
+
+    struct anillo_bitacora *anillo = new (memoria) struct anillo_bitacora;
+
+    anillo->cabeza.store(0);
+    anillo->cola.store(0);
+    anillo->cabeza_vista = 0;
+    anillo->perdidos.store(0);
+    anillo->hilo = hilo;
+
+    return anillo;
+}
+
+/* Primer registro de un hilo: se le da su anillo y se publica para el escritor. Si ya no caben más
+hilos el anillo no se publica, nadie lo vacía y todo lo que escriba ese hilo se pierde */
+struct anillo_bitacora * bitacora_anillo()
+{
+    lock_guard<mutex> guarda(cerrojo_anillos);
+    int n = num_anillos.load(memory_order_relaxed);
+
+    bitacora_hilo = nuevo_anillo(n);
+
+    if(n < BITACORA_MAX_HILOS)
+    {
+        anillos[n] = bitacora_hilo;
+        num_anillos.store(n + 1, memory_order_release);
+    }
+    else
+    {
+        fprintf(stderr, "bitacora_anillo(): demasiados hilos, no se registrará lo que escriba este.\n");
+    }
+
+    return bitacora_hilo;
+}
+
+/* Formatea cada conversión por separado con el argumento de 64 bits convertido al tipo que espera,
+de modo que da igual el modificador de longitud que lleve el formato. Las cadenas no se guardan en el
+registro y salen como (?) */
+static int formatear_mensaje(char *destino, int longitud, const char *formato, const struct registro_bitacora *registro)
+{
+    int escrito = 0, argumento = 0;
+
+    for(const char *p = formato; *p != '\0' && escrito < longitud - 1; p++)
+    {
+        if(*p != '%')
+        {
+            destino[escrito++] = *p;
+            continue;
+        }
+
+        if(p[1] == '%')
+        {
+            destino[escrito++] = '%';
+            p++;
+            continue;
+        }
+
+        // Indicadores, anchura y precisión se conservan; el modificador de longitud se sustituye por ll
+        char especificacion[32];
+        int n = 0;
+
+        especificacion[n++] = *p++;
+
+        while(*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && n < 24)
+            especificacion[n++] = *p++;
+
+        while(*p != '\0' && strchr("hljztL", *p) != NULL)
+            p++;
+
+        if(*p == '\0')
+            break;
+
+        uint64_t valor = argumento < registro->num_argumentos ? registro->argumentos[argumento] : 0;
+        int rc;
+
+        argumento++;
+
+        switch(*p)
+        {
+            case 'd': case 'i':
+                especificacion[n++] = 'l';
+                especificacion[n++] = 'l';
+                especificacion[n++] = *p;
+                especificacion[n] = '\0';
+                rc = snprintf(destino + escrito, longitud - escrito, especificacion, (long long) valor);
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                especificacion[n++] = 'l';
+                especificacion[n++] = 'l';
+                especificacion[n++] = *p;
+                especificacion[n] = '\0';
+                rc = snprintf(destino + escrito, longitud - escrito, especificacion, (unsigned long long) valor);
+                break;
+            case 'c':
+                especificacion[n++] = 'c';
+                especificacion[n] = '\0';
+                rc = snprintf(destino + escrito, longitud - escrito, especificacion, (int) valor);
+                break;
+            case 'p':
+                rc = snprintf(destino + escrito, longitud - escrito, "%p", (void *) (uintptr_t) valor);
+                break;
+            default:
+                rc = snprintf(destino + escrito, longitud - escrito, "(?)");
+                break;
+        }
+
+        if(rc > 0)
+            escrito = min(escrito + rc, longitud - 1);
+    }
+
+    destino[escrito] = '\0';
+
+    return escrito;
+}
+
+int bitacora_formatear(char *destino, int longitud, const char *formato, const struct registro_bitacora *registro)
+{
+    time_t segundos = registro->instante / 1000000000ULL;
+    struct tm fecha;
+    int n;
+
+    localtime_r(&segundos, &fecha);
+
+    n = strftime(destino, longitud, "%Y-%m-%d %H:%M:%S", &fecha);
+    n += snprintf(destino + n, longitud - n, ".%06lu %s [%u] ", (unsigned long) (registro->instante % 1000000000ULL / 1000),
+                  registro->nivel <= BITACORA_DEPURACION ? nombres_nivel[registro->nivel] : "?", registro->hilo);
+
+    if(n >= longitud)
+        return longitud - 1;
+
+    return n + formatear_mensaje(destino + n, longitud - n, formato, registro);
+}
+
+struct escritor_bitacora {
+    FILE                                        *fichero;
+    bool                                        binario;
+    unordered_map<const char *, uint32_t>       formatos;
+    uint64_t                                    perdidos[BITACORA_MAX_HILOS];
+};
+
+static void escribir_registro(struct escritor_bitacora *escritor, struct registro_bitacora *registro)
+{
+    if(!escritor->binario)
+    {
+        char linea[512];
+
+        bitacora_formatear(linea, sizeof(linea), registro->formato, registro);
+        fputs(linea, escritor->fichero);
+        fputc('\n', escritor->fichero);
+        return;
+    }
+
+    auto it = escritor->formatos.find(registro->formato);
+    uint32_t id;
+
+    if(it == escritor->formatos.end())
+    {
+        uint16_t longitud = strlen(registro->formato);
+
+        id = escritor->formatos.size();
+        escritor->formatos[registro->formato] = id;
+
+        fputc(BITACORA_ENTRADA_FORMATO, escritor->fichero);
+        fwrite(&id, sizeof(id), 1, escritor->fichero);
+        fwrite(&longitud, sizeof(longitud), 1, escritor->fichero);
+        fwrite(registro->formato, 1, longitud, escritor->fichero);
+    }
+    else
+    {
+        id = it->second;
+    }
+
+    struct registro_bitacora copia = *registro;
+    copia.formato = NULL;
+
+    fputc(BITACORA_ENTRADA_REGISTRO, escritor->fichero);
+    fwrite(&id, sizeof(id), 1, escritor->fichero);
+    fwrite(&copia, sizeof(copia), 1, escritor->fichero);
+}
+
+static void anotar_perdidos(struct escritor_bitacora *escritor, uint16_t hilo, uint64_t perdidos)
+{
+    if(escritor->binario)
+    {
+        fputc(BITACORA_ENTRADA_PERDIDOS, escritor->fichero);
+        fwrite(&hilo, sizeof(hilo), 1, escritor->fichero);
+        fwrite(&perdidos, sizeof(perdidos), 1, escritor->fichero);
+    }
+    else
+    {
+        fprintf(escritor->fichero, "Bitácora: perdidos %lu registros del hilo %u\n", (unsigned long) perdidos, hilo);
+    }
+}
+
+/* Hilo escritor: vacía por turnos los anillos de todos los hilos y sólo duerme cuando no ha
+encontrado nada. Es el único que formatea o llama a stdio */
+static void vaciar_anillos(struct escritor_bitacora *escritor)
+{
+    while(true)
+    {
+        int n = num_anillos.load(memory_order_acquire);
+        bool escrito = false;
+
+        for(int i = 0; i < n; i++)
+        {
+            struct anillo_bitacora *anillo = anillos[i];
+            uint64_t cabeza = anillo->cabeza.load(memory_order_relaxed);
+            uint64_t cola = anillo->cola.load(memory_order_acquire);
+
+            for(uint64_t posicion = cabeza; posicion < cola; posicion++)
+            {
+                escribir_registro(escritor, &anillo->registros[posicion & (BITACORA_REGISTROS - 1)]);
+            }
+
+            if(cola != cabeza)
+            {
+                anillo->cabeza.store(cola, memory_order_release);
+                escrito = true;
+            }
+
+            uint64_t perdidos = anillo->perdidos.load(memory_order_relaxed);
+
+            if(perdidos != escritor->perdidos[i])
+            {
+                anotar_perdidos(escritor, anillo->hilo, perdidos - escritor->perdidos[i]);
+                escritor->perdidos[i] = perdidos;
+                escrito = true;
+            }
+        }
+
+        if(escrito)
+            fflush(escritor->fichero);
+        else
+            usleep(BITACORA_ESPERA_US);
+    }
+}
+
+/* Arranca el hilo escritor. Sin ruta escribe texto en la salida estándar; con ruta escribe el
+fichero binario, que se lee con bitacora-leer */
+void bitacora_iniciar(const char *ruta)
+{
+    struct escritor_bitacora *escritor = new struct escritor_bitacora;
+
+    escritor->binario = ruta != NULL;
+    escritor->fichero = stdout;
+    memset(escritor->perdidos, 0, sizeof(escritor->perdidos));
+
+    if(escritor->binario)
+    {
+        if((escritor->fichero = fopen(ruta, "wb")) == NULL)
+        {
+            perror("bitacora_iniciar->fopen()");
+            exit(-1);
+        }
+
+        fwrite(BITACORA_MAGICO, 1, strlen(BITACORA_MAGICO), escritor->fichero);
+    }
+
+    thread(vaciar_anillos, escritor).detach();
+}
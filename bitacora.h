@@ -0,0 +1,119 @@
+#ifndef _BITACORA_H_
+#define _BITACORA_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <type_traits>
+
+#define BITACORA_ERROR					0
+#define BITACORA_AVISO					1
+#define BITACORA_INFO					2
+#define BITACORA_DEPURACION				3
+
+/* Nivel máximo que se compila: las llamadas de nivel superior desaparecen del binario. Por defecto
+se quedan fuera las de depuración, que están en el camino de cada conexión y desconexión; se
+compilan con make DEPURACION=1, que pasa -DBITACORA_NIVEL=BITACORA_DEPURACION */
+#ifndef BITACORA_NIVEL
+#define BITACORA_NIVEL					BITACORA_INFO
+#endif
+
+#define BITACORA_REGISTROS				4096		// Registros por hilo, potencia de dos
+#define BITACORA_MAX_ARGUMENTOS			5
+#define BITACORA_MAX_HILOS				256
+#define BITACORA_ESPERA_US				1000		// Pausa del hilo escritor cuando no hay nada
+
+#define BITACORA_MAGICO					"BITACORA1"
+
+/* Escribe un registro si el nivel está compilado. El formato tiene que ser un literal: el registro
+sólo guarda su dirección y los argumentos, que han de ser enteros o punteros, sin formatear. Cada
+línea termina en un salto que añade quien la escribe */
+#define BITACORA(nivel, formato, ...) \
+	do { if((nivel) <= BITACORA_NIVEL) bitacora_registrar((nivel), "" formato, ##__VA_ARGS__); } while(0)
+
+using namespace std;
+
+// Un registro ocupa una línea de caché
+struct registro_bitacora {
+	uint64_t 					instante;			// ns de CLOCK_REALTIME
+	const char 					*formato;
+	uint8_t 					nivel;
+	uint8_t 					num_argumentos;
+	uint16_t 					hilo;
+	uint32_t 					reservado;
+	uint64_t 					argumentos[BITACORA_MAX_ARGUMENTOS];
+};
+
+/* Anillo de un solo productor, el hilo dueño, y un solo consumidor, el hilo escritor. Si se llena
+los registros nuevos se pierden y se cuentan en perdidos, que el escritor anota en la salida */
+struct anillo_bitacora {
+	alignas(64) atomic<uint64_t> 	cabeza;			// Lo escribe el escritor
+	alignas(64) atomic<uint64_t> 	cola;			// Lo escribe el productor
+	uint64_t 					cabeza_vista;		// Copia del productor, para no leer cabeza en cada registro
+	atomic<uint64_t> 			perdidos;
+	uint16_t 					hilo;
+	struct registro_bitacora 	registros[BITACORA_REGISTROS];
+};
+
+/* Formato del fichero binario: BITACORA_MAGICO y a continuación entradas con un byte de tipo. Cada
+formato se escribe una vez, la primera vez que aparece, con un identificador que usan después los
+registros; así el fichero se puede leer sin el binario que lo generó */
+#define BITACORA_ENTRADA_FORMATO		'F'		// uint32 id, uint16 longitud, texto
+#define BITACORA_ENTRADA_REGISTRO		'R'		// uint32 id, registro_bitacora con formato a NULL
+#define BITACORA_ENTRADA_PERDIDOS		'P'		// uint16 hilo, uint64 registros perdidos
+
+extern thread_local struct anillo_bitacora *bitacora_hilo;
+
+struct anillo_bitacora * bitacora_anillo();
+void bitacora_iniciar(const char *ruta);
+
+// Línea de texto de un registro, sin el salto final: instante, nivel, hilo y mensaje
+int bitacora_formatear(char *destino, int longitud, const char *formato, const struct registro_bitacora *registro);
+
+template<typename T> inline typename enable_if<is_integral<T>::value || is_enum<T>::value, uint64_t>::type bitacora_valor(T valor)
+{
+	return (uint64_t) (int64_t) valor;
+}
+
+template<typename T> inline uint64_t bitacora_valor(T *valor)
+{
+	return (uint64_t) (uintptr_t) valor;
+}
+
+template<typename... T> inline void bitacora_registrar(int nivel, const char *formato, T... argumentos)
+{
+	static_assert(sizeof...(T) <= BITACORA_MAX_ARGUMENTOS, "Demasiados argumentos para un registro de la bitácora");
+
+	struct anillo_bitacora *anillo = bitacora_hilo != NULL ? bitacora_hilo : bitacora_anillo();
+	uint64_t cola = anillo->cola.load(memory_order_relaxed);
+
+	if(cola - anillo->cabeza_vista == BITACORA_REGISTROS)
+	{
+		anillo->cabeza_vista = anillo->cabeza.load(memory_order_acquire);
+
+		if(cola - anillo->cabeza_vista == BITACORA_REGISTROS)
+		{
+			anillo->perdidos.store(anillo->perdidos.load(memory_order_relaxed) + 1, memory_order_relaxed);
+			return;
+		}
+	}
+
+	struct registro_bitacora *registro = &anillo->registros[cola & (BITACORA_REGISTROS - 1)];
+	uint64_t valores[] = { bitacora_valor(argumentos)..., 0 };
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	registro->instante = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	registro->formato = formato;
+	registro->nivel = nivel;
+	registro->num_argumentos = sizeof...(T);
+	registro->hilo = anillo->hilo;
+
+	for(unsigned i = 0; i < sizeof...(T); i++)
+		registro->argumentos[i] = valores[i];
+
+	anillo->cola.store(cola + 1, memory_order_release);
+}
+
+#endif
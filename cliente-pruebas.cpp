@@ -43,6 +43,7 @@
 #include <assert.h>
 
 #include "mensajes.h"
+#include "posicion_delta.h"
 
 #define GRUPO_SIZE 		10
 #define GRUPO_COUNT 	10
@@ -51,10 +52,11 @@
 #define MAXEVENTS		399999
 
 typedef struct _client_data {
-	int id;
+	clienteid_t id;
 	int socket;
 	int ack_pendiente;
 	int32_t secuencia;
+	std::map<clienteid_t, mensaje_posicion> *ultimas;	// Base de los MENSAJE_POSICION_DELTA de cada origen
 } client_data;
 
 
@@ -75,6 +77,37 @@ mutex report_mutex;
 
 msec_t inicio_prueba;
 
+void siguiente_ciclo(client_data *data)
+{
+	uint8_t buffer[40];
+	mensaje_posicion posicion;
+
+	data->ack_pendiente = GRUPO_SIZE - 1;
+	data->secuencia += 1;
+
+	if(data->secuencia == CICLOS)
+	{
+		int tiempo = (time_ms() - inicio_prueba) / 1000;
+		report_mutex.lock();
+		cout << tiempo << endl;
+		report_mutex.unlock();
+		return;
+	}
+
+	if(data->secuencia > CICLOS)
+		return;
+
+	buffer[0] = MENSAJE_POSICION;
+	posicion.cliente_id_origen = data->id;
+	posicion.posicion_x = 0;
+	posicion.posicion_y = 0;
+	posicion.posicion_z = 0;
+	posicion.numero_secuencia = data->secuencia;
+	memcpy(&buffer[1], &posicion, sizeof(posicion));
+	send(data->socket, buffer, tamano_frame(MENSAJE_POSICION), 0);
+	//cout << "Empezando nuevo ciclo. ID: " << data->id << endl;
+}
+
 void client_thread(int epoll_fd)
 {
 	int n_wait;
@@ -83,7 +116,6 @@ void client_thread(int epoll_fd)
 
 	uint8_t buffer[400];
 	client_data* data;
-	uint8_t tipo_mensaje;
 	mensaje_posicion posicion;
 	mensaje_reconocimiento reconocimiento;
 
@@ -104,13 +136,39 @@ void client_thread(int epoll_fd)
 				switch(buffer[0])
 				{
 				case MENSAJE_POSICION:
+				case MENSAJE_POSICION_DELTA:
 					{
-						recv(data->socket, &posicion, sizeof(posicion), 0);
+						if(buffer[0] == MENSAJE_POSICION)
+						{
+							recv(data->socket, &posicion, sizeof(posicion), 0);
+						}
+						else
+						{
+							// El delta se aplica sobre la última posición recibida de su origen
+							clienteid_t origen;
+							mensaje_posicion_delta delta;
+
+							recv(data->socket, &delta, sizeof(delta), MSG_WAITALL);
+							recv(data->socket, buffer, delta.longitud, MSG_WAITALL);
+
+							bool valido = delta_origen(buffer, delta.longitud, &origen) && data->ultimas->count(origen);
+
+							if(valido)
+							{
+								posicion = (*data->ultimas)[origen];
+								valido = delta_aplicar(buffer, delta.longitud, &posicion);
+							}
+
+							assert(valido);
+						}
+
+						(*data->ultimas)[posicion.cliente_id_origen] = posicion;
 						reconocimiento.cliente_id_origen = data->id;
 						reconocimiento.cliente_id_destino = posicion.cliente_id_origen;
+						reconocimiento.numero_secuencia = posicion.numero_secuencia;
 
 						//cout << posicion.cliente_id_origen << endl;
-						assert(posicion.cliente_id_origen < 11000);
+						assert(posicion.cliente_id_origen != 0);
 
 
 						/*report_mutex.lock();
@@ -119,7 +177,7 @@ void client_thread(int epoll_fd)
 
 						buffer[0] = MENSAJE_RECONOCIMIENTO;
 						memcpy(&buffer[1], &reconocimiento, sizeof(reconocimiento));
-						send(data->socket, buffer, sizeof(reconocimiento) + sizeof(uint8_t), 0);
+						send(data->socket, buffer, tamano_frame(MENSAJE_RECONOCIMIENTO), 0);
 						break;
 					}
 				case MENSAJE_RECONOCIMIENTO:
@@ -131,29 +189,45 @@ void client_thread(int epoll_fd)
 						recv(data->socket, &reconocimiento, sizeof(reconocimiento), 0);
 						if(data->ack_pendiente == 0)
 						{
-							data->ack_pendiente = GRUPO_SIZE - 1;
-							data->secuencia += 1;
+							siguiente_ciclo(data);
+						}
 
-							if(data->secuencia == CICLOS)
-							{
-								int tiempo = (time_ms() - inicio_prueba) / 1000;
-								report_mutex.lock();
-								cout << tiempo << endl;
-								report_mutex.unlock();
-								break;
-							}
+						break;
+					}
+				case MENSAJE_CICLO_COMPLETO:
+					{
+						// Con el servidor en modo -a todos los reconocimientos del ciclo llegan en este mensaje
+						mensaje_ciclo_completo completo;
+						recv(data->socket, &completo, sizeof(completo), MSG_WAITALL);
 
-							if(data->secuencia > CICLOS)
-								break;
+						// Los IDs que faltan no se usan, sólo se sacan del socket
+						for(int faltan = completo.n_faltan * sizeof(clienteid_t); faltan > 0; faltan -= sizeof(buffer))
+							recv(data->socket, buffer, min(faltan, (int) sizeof(buffer)), MSG_WAITALL);
 
-							buffer[0] = MENSAJE_POSICION;
-							posicion.cliente_id_origen = data->id;
-							memcpy(&buffer[1], &posicion, sizeof(posicion));
-							send(data->socket, buffer, sizeof(uint8_t) + sizeof(posicion), 0);
-							//cout << "Empezando nuevo ciclo. ID: " << data->id << endl;
+						if((int32_t) completo.numero_secuencia == data->secuencia)
+							siguiente_ciclo(data);
 
+						break;
+					}
+				case MENSAJE_INSTANTANEA:
+					{
+						// Con el servidor en modo -T el ciclo acaba cuando se publica la propia posición
+						mensaje_instantanea instantanea;
+						bool publicada = false;
+
+						recv(data->socket, &instantanea, sizeof(instantanea), MSG_WAITALL);
+
+						for(int j = 0; j < instantanea.n_posiciones; j++)
+						{
+							recv(data->socket, &posicion, sizeof(posicion), MSG_WAITALL);
+
+							if(posicion.cliente_id_origen == data->id && (int32_t) posicion.numero_secuencia == data->secuencia)
+								publicada = true;
 						}
 
+						if(publicada)
+							siguiente_ciclo(data);
+
 						break;
 					}
 				}
@@ -189,9 +263,7 @@ int main(int argc, char** argv)
 	memcpy(buffer, &tipo_mensaje, sizeof(uint8_t));
 
 	int miembros_grupo[GRUPO_SIZE * GRUPO_COUNT];
-	int clientes_id[GRUPO_SIZE * GRUPO_COUNT];
-
-	msec_t inicio = time_ms();
+	clienteid_t clientes_id[GRUPO_SIZE * GRUPO_COUNT];
 
 	for(int i = 0; i < GRUPO_COUNT; i++)
 	{
@@ -214,11 +286,12 @@ int main(int argc, char** argv)
 			}
 
 			nueva_conexion.grupo = i;
+			nueva_conexion.capacidades = CAPACIDAD_POSICION_DELTA;
 			memcpy(buffer, &tipo_mensaje, sizeof(uint8_t));
 			memcpy(&buffer[1], &nueva_conexion, sizeof(mensaje_conexion));
 
-			send(server_socket, buffer, sizeof(uint8_t) + sizeof(mensaje_conexion),0);
-			recv(server_socket, buffer, sizeof(uint8_t) + sizeof(conexion_respuesta),0);
+			send(server_socket, buffer, tamano_frame(MENSAJE_CONEXION),0);
+			recv(server_socket, buffer, tamano_frame(MENSAJE_CONEXION_SATISFACTORIA),0);
 
 			memcpy(&conexion_respuesta, &buffer[1], sizeof(conexion_respuesta));
 
@@ -228,6 +301,7 @@ int main(int argc, char** argv)
 	    	data->ack_pendiente = GRUPO_SIZE - 1;
 	    	data->socket = server_socket;
 	    	data->secuencia = 0;
+	    	data->ultimas = new map<clienteid_t, mensaje_posicion>();
 
 	    	client_event.events = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
 	    	client_event.data.ptr = data;
@@ -242,11 +316,6 @@ int main(int argc, char** argv)
 
 	}
 
-	msec_t fin = time_ms();
-	msec_t total = (fin - inicio)/1000;
-	//cout << "Conectados " << GRUPO_SIZE * GRUPO_COUNT << " clientes en " << total << " segundos." << endl;
-	//cout << "Conexiones por segundo: " << ((GRUPO_COUNT*GRUPO_SIZE) / total) << endl;
-
 	tipo_mensaje = MENSAJE_POSICION;
 	memcpy(buffer, &tipo_mensaje, sizeof(tipo_mensaje));
 
@@ -256,19 +325,14 @@ int main(int argc, char** argv)
 	posicion.posicion_z = 0;
 	posicion.numero_secuencia = 0;
 
-	inicio = time_ms();
-
 	for(int j = 0; j < GRUPO_SIZE * GRUPO_COUNT; j++)
 	{
 		posicion.cliente_id_origen = clientes_id[j];
 		//cout << "Enviando posicion con ID Origen: " << clientes_id[j] << endl;
 		memcpy(&buffer[1], &posicion, sizeof(posicion));
-		send(miembros_grupo[j], buffer, sizeof(uint8_t) + sizeof(posicion), 0);
+		send(miembros_grupo[j], buffer, tamano_frame(MENSAJE_POSICION), 0);
 	}
 
-	fin = time_ms();
-	total = (fin - inicio);
-
 	//cout << "Los clientes han empezado su primer ciclo." << endl;
 
 	thread thread_pool[THREAD_POOL];
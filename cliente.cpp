@@ -21,6 +21,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <inttypes.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_test_font.h>
@@ -97,10 +98,11 @@ int main(int argc, const char * argv[])
 
 	struct mensaje_conexion nueva_conexion;
 	nueva_conexion.grupo = 3;
+	nueva_conexion.capacidades = 0;		// Este cliente sólo entiende MENSAJE_POSICION completos
 
 	memcpy(&buffer[1], &nueva_conexion, sizeof(nueva_conexion));
 
-	rc = send(sock, buffer, sizeof(nueva_conexion) + sizeof(uint8_t),0);
+	rc = send(sock, buffer, tamano_frame(MENSAJE_CONEXION),0);
 	
 	if(rc < 0)
 	{
@@ -108,15 +110,15 @@ int main(int argc, const char * argv[])
 		exit(0);
 	}
 
-	rc = recv(sock, buffer, sizeof(uint8_t) + sizeof(mensaje_conexion_satisfactoria), 0);
+	rc = recv(sock, buffer, tamano_frame(MENSAJE_CONEXION_SATISFACTORIA), 0);
 
 
 
 	printf("Recibidos datos de confirmación del servidor.\n");
 
 
-	cliente_id = buffer[1];
-	printf("Mi ID de cliente es: %d\n", cliente_id);
+	memcpy(&cliente_id, &buffer[1], sizeof(cliente_id));
+	printf("Mi ID de cliente es: %" PRIu64 "\n", cliente_id);
 	struct mensaje_saludo nuevo_saludo;
 	string s = "Jordi";
 	strcpy(nuevo_saludo.nombre, s.c_str());
@@ -124,7 +126,7 @@ int main(int argc, const char * argv[])
 	buffer[0] = tipo_mensaje;
 	memcpy(&buffer[1], &nuevo_saludo, sizeof(nuevo_saludo));
 
-	rc = send(sock, buffer, sizeof(nuevo_saludo) + sizeof(uint8_t),0);
+	rc = send(sock, buffer, tamano_frame(MENSAJE_SALUDO),0);
 	
 	if(rc < 0)
 	{
@@ -236,7 +238,7 @@ int main(int argc, const char * argv[])
 			buffer[0] = MENSAJE_POSICION;
 			miPosicion.numero_secuencia = ++secuencia;
 			memcpy(&buffer[1], &miPosicion, sizeof(miPosicion));
-			send(sock, buffer, sizeof(miPosicion) + sizeof(mensaje_t), 0);
+			send(sock, buffer, tamano_frame(MENSAJE_POSICION), 0);
 			ticker = time_ms();
 			clientes_copia = clientes_conocidos;
 		}
@@ -253,13 +255,13 @@ int main(int argc, const char * argv[])
 					case MENSAJE_POSICION:
 						printf("Recibido mensaje de posición.\n");
 						recv(sock, &posicion, sizeof(posicion), 0);
-						printf("Origen ID: %d\n", posicion.cliente_id_origen);
+						printf("Origen ID: %" PRIu64 "\n", posicion.cliente_id_origen);
 						buffer[0] = MENSAJE_RECONOCIMIENTO;
 						reconocimiento.cliente_id_origen = cliente_id;
 						reconocimiento.cliente_id_destino = posicion.cliente_id_origen;
 						reconocimiento.numero_secuencia = posicion.numero_secuencia;
 						memcpy(&buffer[1], &reconocimiento, sizeof(reconocimiento));
-						send(sock, buffer, sizeof(reconocimiento) + sizeof(mensaje_t), 0);
+						send(sock, buffer, tamano_frame(MENSAJE_RECONOCIMIENTO), 0);
 						encontrado = false;
 						for(uint j=0; j < clientes_conocidos.size(); j++)
 						{
@@ -277,7 +279,7 @@ int main(int argc, const char * argv[])
 							nombre_request.cliente_id_origen = cliente_id;
 							nombre_request.cliente_id_destino = posicion.cliente_id_origen;
 							memcpy(&buffer[1],&nombre_request, sizeof(nombre_request));
-							send(sock, buffer, sizeof(nombre_request) + sizeof(mensaje_t), 0);
+							send(sock, buffer, tamano_frame(MENSAJE_NOMBRE_REQUEST), 0);
 						}
 						break;
 					case MENSAJE_RECONOCIMIENTO:
@@ -302,7 +304,7 @@ int main(int argc, const char * argv[])
 							nombre_request.cliente_id_origen = cliente_id;
 							nombre_request.cliente_id_destino = reconocimiento.cliente_id_origen;
 							memcpy(&buffer[1],&nombre_request, sizeof(nombre_request));
-							send(sock, buffer, sizeof(nombre_request) + sizeof(mensaje_t), 0);
+							send(sock, buffer, tamano_frame(MENSAJE_NOMBRE_REQUEST), 0);
 						}
 						if(clientes_copia.empty())
 						{
@@ -319,7 +321,7 @@ int main(int argc, const char * argv[])
 						nombre_reply.cliente_id_destino = nombre_request.cliente_id_origen;
 						strcpy(nombre_reply.nombre, s.c_str());
 						memcpy(&buffer[1], &nombre_reply, sizeof(nombre_reply));
-						send(sock, buffer, sizeof(uint8_t) + sizeof(nombre_reply), 0);
+						send(sock, buffer, tamano_frame(MENSAJE_NOMBRE_REPLY), 0);
 						break;
 					case MENSAJE_NOMBRE_REPLY:
 						recv(sock, &nombre_reply, sizeof(nombre_reply), 0);
@@ -339,6 +341,38 @@ int main(int argc, const char * argv[])
 							}
 						}
 						break;
+					case MENSAJE_CICLO_COMPLETO:
+					{
+						struct mensaje_ciclo_completo completo;
+						recv(sock, &completo, sizeof(completo), MSG_WAITALL);
+						printf("Ciclo %u completo. Faltan %u de %u ACKs.\n", completo.numero_secuencia, completo.n_faltan, completo.esperados);
+						for(int j = 0; j < completo.n_faltan; j++)
+						{
+							clienteid_t falta;
+							recv(sock, &falta, sizeof(falta), MSG_WAITALL);
+						}
+						break;
+					}
+					case MENSAJE_INSTANTANEA:
+					{
+						struct mensaje_instantanea instantanea;
+						recv(sock, &instantanea, sizeof(instantanea), MSG_WAITALL);
+						for(int i = 0; i < instantanea.n_posiciones; i++)
+						{
+							recv(sock, &posicion, sizeof(posicion), MSG_WAITALL);
+							for(uint j=0; j < clientes_conocidos.size(); j++)
+							{
+								if(clientes_conocidos[j].id == posicion.cliente_id_origen)
+								{
+									clientes_conocidos[j].posicion_x = posicion.posicion_x;
+									clientes_conocidos[j].posicion_y = posicion.posicion_y;
+									clientes_conocidos[j].posicion_z = posicion.posicion_z;
+									break;
+								}
+							}
+						}
+						break;
+					}
 					default:
 						break;
 				}
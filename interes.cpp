@@ -0,0 +1,148 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "interes.h"
+
+
+using namespace std;
+
+// Las coordenadas son int16_t; se desplazan para que los índices de celda no sean negativos
+#define DESPLAZAMIENTO_COORDENADA		32768
+
+static uint32_t indice_celda(int coordenada, int tamano_celda)
+{
+    return (uint32_t) (coordenada + DESPLAZAMIENTO_COORDENADA) / tamano_celda;
+}
+
+static uint64_t clave_celda(uint32_t cx, uint32_t cy)
+{
+    return ((uint64_t) cx << 32) | cy;
+}
+
+struct rejilla * rejilla_crear(int radio)
+{
+    struct rejilla *rejilla = new struct rejilla;
+
+    rejilla->tamano_celda = radio > 0 ? radio : 1;
+    rejilla->radio2 = (float) radio * radio;
+
+    return rejilla;
+}
+
+void rejilla_liberar(struct rejilla *rejilla)
+{
+    delete rejilla;
+}
+
+// Saca al cliente de su celda moviendo el último a su hueco, y borra la celda si queda vacía
+void rejilla_quitar(struct rejilla *rejilla, struct epoll_data_client *cliente)
+{
+    if(!cliente->en_rejilla)
+        return;
+
+    unordered_map<uint64_t, struct celda_interes>::iterator it = rejilla->celdas.find(cliente->celda_interes);
+    struct celda_interes &celda = it->second;
+    int ultimo = celda.clientes.size() - 1;
+    int indice = cliente->indice_celda;
+
+    celda.x[indice] = celda.x[ultimo];
+    celda.y[indice] = celda.y[ultimo];
+    celda.clientes[indice] = celda.clientes[ultimo];
+    celda.clientes[indice]->indice_celda = indice;
+
+    celda.x.pop_back();
+    celda.y.pop_back();
+    celda.clientes.pop_back();
+
+    if(celda.clientes.empty())
+        rejilla->celdas.erase(it);
+
+    cliente->en_rejilla = false;
+}
+
+void rejilla_mover(struct rejilla *rejilla, struct epoll_data_client *cliente, int16_t x, int16_t y)
+{
+    uint64_t clave = clave_celda(indice_celda(x, rejilla->tamano_celda), indice_celda(y, rejilla->tamano_celda));
+
+    // Lo normal es moverse dentro de la misma celda: basta con actualizar sus coordenadas
+    if(cliente->en_rejilla && cliente->celda_interes == clave)
+    {
+        struct celda_interes &celda = rejilla->celdas[clave];
+
+        celda.x[cliente->indice_celda] = x;
+        celda.y[cliente->indice_celda] = y;
+        return;
+    }
+
+    rejilla_quitar(rejilla, cliente);
+
+    struct celda_interes &celda = rejilla->celdas[clave];
+
+    cliente->en_rejilla = true;
+    cliente->celda_interes = clave;
+    cliente->indice_celda = celda.clientes.size();
+
+    celda.x.push_back(x);
+    celda.y.push_back(y);
+    celda.clientes.push_back(cliente);
+}
+
+/* Añade a vecinos los clientes de la celda a distancia no mayor que el radio de (cx, cy). Con SSE2
+se comparan cuatro miembros por iteración y la máscara resultante dice cuáles se añaden */
+static void filtrar_celda(const struct celda_interes &celda, float cx, float cy, float radio2, vector<struct epoll_data_client *> &vecinos)
+{
+    int n = celda.clientes.size();
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128 centro_x = _mm_set1_ps(cx);
+    __m128 centro_y = _mm_set1_ps(cy);
+    __m128 limite = _mm_set1_ps(radio2);
+
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&celda.x[i]), centro_x);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&celda.y[i]), centro_y);
+        __m128 distancia2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        int mascara = _mm_movemask_ps(_mm_cmple_ps(distancia2, limite));
+
+        while(mascara != 0)
+        {
+            int bit = __builtin_ctz(mascara);
+
+            vecinos.push_back(celda.clientes[i + bit]);
+            mascara &= mascara - 1;
+        }
+    }
+#endif
+
+    for(; i < n; i++)
+    {
+        float dx = celda.x[i] - cx;
+        float dy = celda.y[i] - cy;
+
+        if(dx * dx + dy * dy <= radio2)
+            vecinos.push_back(celda.clientes[i]);
+    }
+}
+
+void rejilla_vecinos(struct rejilla *rejilla, int16_t x, int16_t y, vector<struct epoll_data_client *> &vecinos)
+{
+    uint32_t cx = indice_celda(x, rejilla->tamano_celda);
+    uint32_t cy = indice_celda(y, rejilla->tamano_celda);
+
+    for(int64_t i = (int64_t) cx - 1; i <= (int64_t) cx + 1; i++)
+    {
+        for(int64_t j = (int64_t) cy - 1; j <= (int64_t) cy + 1; j++)
+        {
+            if(i < 0 || j < 0)
+                continue;
+
+            unordered_map<uint64_t, struct celda_interes>::const_iterator it = rejilla->celdas.find(clave_celda(i, j));
+
+            if(it != rejilla->celdas.end())
+                filtrar_celda(it->second, x, y, rejilla->radio2, vecinos);
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _INTERES_H_
+#define _INTERES_H_
+
+#include <vector>
+#include <unordered_map>
+
+#include "mensajes.h"
+#include "network.h"
+
+using namespace std;
+
+/* Índice espacial de un grupo para repartir cada posición sólo a los miembros cercanos. Es una
+rejilla uniforme sobre x/y con celdas del tamaño del radio de interés, así que los miembros a menos
+de un radio de un punto están siempre en su celda o en las ocho de alrededor. Cada celda guarda las
+coordenadas como estructura de arrays para filtrar la distancia de varios miembros a la vez */
+struct celda_interes {
+	vector<float> 						x, y;
+	vector<struct epoll_data_client *> 	clientes;
+};
+
+struct rejilla {
+	int 								tamano_celda;
+	float 								radio2;
+	unordered_map<uint64_t, struct celda_interes> celdas;
+};
+
+struct rejilla * rejilla_crear(int radio);
+void rejilla_liberar(struct rejilla *rejilla);
+void rejilla_mover(struct rejilla *rejilla, struct epoll_data_client *cliente, int16_t x, int16_t y);
+void rejilla_quitar(struct rejilla *rejilla, struct epoll_data_client *cliente);
+void rejilla_vecinos(struct rejilla *rejilla, int16_t x, int16_t y, vector<struct epoll_data_client *> &vecinos);
+
+#endif
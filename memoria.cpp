@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <atomic>
+
+#include "memoria.h"
+
+
+using namespace std;
+
+struct cache_pool {
+    void    *primero;
+    int     n;
+};
+
+// Lo desactiva cualquier shard que falle al pedirlas mientras los demás lo leen
+static atomic<bool> usar_hugepages(false);
+
+static thread_local struct cache_pool caches[MEMORIA_MAX_POOLS];
+
+static struct pool_memoria pools_buffer[MEMORIA_CLASES_BUFFER] = {
+    POOL_MEMORIA(0, MEMORIA_BUFFER_MINIMO),
+    POOL_MEMORIA(1, MEMORIA_BUFFER_MINIMO << 2),
+    POOL_MEMORIA(2, MEMORIA_BUFFER_MINIMO << 4),
+    POOL_MEMORIA(3, MEMORIA_BUFFER_MINIMO << 6),
+    POOL_MEMORIA(4, MEMORIA_BUFFER_MINIMO << 8),
+    POOL_MEMORIA(5, MEMORIA_BUFFER_MINIMO << 10)
+};
+
+/* Los bloques se piden con páginas enormes si se ha activado. Si el sistema no tiene reservadas, se
+avisa una vez y se sigue con páginas normales */
+void memoria_hugepages(bool activar)
+{
+    usar_hugepages.store(activar, memory_order_relaxed);
+}
+
+static char * nuevo_bloque()
+{
+    void *bloque = MAP_FAILED;
+
+    if(usar_hugepages.load(memory_order_relaxed))
+    {
+        bloque = mmap(NULL, MEMORIA_BLOQUE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        // Si fallan a la vez varios shards, sólo avisa el primero que lo desactiva
+        if(bloque == MAP_FAILED && usar_hugepages.exchange(false, memory_order_relaxed))
+        {
+            perror("nuevo_bloque->mmap(MAP_HUGETLB)");
+        }
+    }
+
+    if(bloque == MAP_FAILED)
+        bloque = mmap(NULL, MEMORIA_BLOQUE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(bloque == MAP_FAILED)
+    {
+        perror("nuevo_bloque->mmap()");
+        exit(-1);
+    }
+
+    return (char *) bloque;
+}
+
+// Trae a la caché del hilo un lote de libres del pool, y recorta del bloque actual los que falten
+static void rellenar_cache(struct pool_memoria *pool, struct cache_pool *cache)
+{
+    size_t tamano = (pool->tamano + MEMORIA_ALINEACION - 1) & ~((size_t) MEMORIA_ALINEACION - 1);
+
+    pool->cerrojo.lock();
+
+    while(cache->n < MEMORIA_LOTE && pool->libres != NULL)
+    {
+        void *objeto = pool->libres;
+
+        pool->libres = *(void **) objeto;
+        *(void **) objeto = cache->primero;
+        cache->primero = objeto;
+        cache->n++;
+    }
+
+    while(cache->n < MEMORIA_LOTE)
+    {
+        if(pool->bloque == NULL || pool->usado + tamano > MEMORIA_BLOQUE)
+        {
+            pool->bloque = nuevo_bloque();
+            pool->usado = 0;
+        }
+
+        void *objeto = pool->bloque + pool->usado;
+
+        pool->usado += tamano;
+        *(void **) objeto = cache->primero;
+        cache->primero = objeto;
+        cache->n++;
+    }
+
+    pool->cerrojo.unlock();
+}
+
+void * pool_obtener(struct pool_memoria *pool)
+{
+    struct cache_pool *cache = &caches[pool->id];
+
+    if(cache->primero == NULL)
+        rellenar_cache(pool, cache);
+
+    void *objeto = cache->primero;
+
+    cache->primero = *(void **) objeto;
+    cache->n--;
+
+    return objeto;
+}
+
+/* Un objeto puede devolverse desde un hilo distinto del que lo obtuvo. Cuando la caché del hilo pasa
+de dos lotes, uno vuelve al pool para que lo aprovechen los demás */
+void pool_devolver(struct pool_memoria *pool, void *objeto)
+{
+    struct cache_pool *cache = &caches[pool->id];
+
+    *(void **) objeto = cache->primero;
+    cache->primero = objeto;
+    cache->n++;
+
+    if(cache->n < 2 * MEMORIA_LOTE)
+        return;
+
+    pool->cerrojo.lock();
+
+    for(int i = 0; i < MEMORIA_LOTE; i++)
+    {
+        void *sobrante = cache->primero;
+
+        cache->primero = *(void **) sobrante;
+        *(void **) sobrante = pool->libres;
+        pool->libres = sobrante;
+    }
+
+    cache->n -= MEMORIA_LOTE;
+
+    pool->cerrojo.unlock();
+}
+
+static struct pool_memoria * clase_buffer(int bytes)
+{
+    for(int i = 0; i < MEMORIA_CLASES_BUFFER; i++)
+    {
+        if((size_t) bytes <= pools_buffer[i].tamano)
+            return &pools_buffer[i];
+    }
+
+    return NULL;
+}
+
+char * buffer_obtener(int bytes, int *capacidad)
+{
+    struct pool_memoria *pool = clase_buffer(bytes);
+
+    if(pool == NULL)
+    {
+        *capacidad = bytes;
+        return (char *) malloc(bytes);
+    }
+
+    *capacidad = pool->tamano;
+    return (char *) pool_obtener(pool);
+}
+
+// bytes puede ser lo que se pidió o la capacidad devuelta: los dos llevan a la misma clase
+void buffer_devolver(char *buffer, int bytes)
+{
+    if(buffer == NULL)
+        return;
+
+    struct pool_memoria *pool = clase_buffer(bytes);
+
+    if(pool == NULL)
+        free(buffer);
+    else
+        pool_devolver(pool, buffer);
+}
@@ -0,0 +1,46 @@
+#ifndef _MEMORIA_H_
+#define _MEMORIA_H_
+
+#include <stddef.h>
+#include <mutex>
+
+#define MEMORIA_BLOQUE					(2 << 20)	// Tamaño de una página enorme
+#define MEMORIA_ALINEACION				64
+#define MEMORIA_LOTE					32
+#define MEMORIA_MAX_POOLS				8
+
+/* Clases de tamaño de los buffers: 64, 256, 1K, 4K, 16K y 64K bytes. Lo que no cabe en la mayor se
+pide a malloc() */
+#define MEMORIA_CLASES_BUFFER			6
+#define MEMORIA_BUFFER_MINIMO			64
+#define MEMORIA_BUFFER_MAXIMO			(MEMORIA_BUFFER_MINIMO << (2 * (MEMORIA_CLASES_BUFFER - 1)))
+
+#define MEMORIA_POOL_CLIENTES			MEMORIA_CLASES_BUFFER
+
+using namespace std;
+
+/* Pool de objetos de un mismo tamaño. Los objetos se recortan de bloques de MEMORIA_BLOQUE, que con
+páginas enormes ocupan una sola entrada de la TLB, y nunca se devuelven al sistema: un objeto liberado
+vuelve a la lista libres para el siguiente. Cada hilo guarda además una pequeña caché propia de libres,
+indexada por id, así que sólo toma el cerrojo para traer o devolver MEMORIA_LOTE objetos de una vez */
+struct pool_memoria {
+	int 						id;
+	size_t 						tamano;
+	mutex 						cerrojo;
+	void 						*libres;
+	char 						*bloque;
+	size_t 						usado;
+};
+
+#define POOL_MEMORIA(id, tamano)	{ (id), (tamano), {}, NULL, NULL, 0 }
+
+void memoria_hugepages(bool activar);
+
+void * pool_obtener(struct pool_memoria *pool);
+void pool_devolver(struct pool_memoria *pool, void *objeto);
+
+// Buffer de al menos bytes bytes; en capacidad se devuelve lo que mide en realidad
+char * buffer_obtener(int bytes, int *capacidad);
+void buffer_devolver(char *buffer, int bytes);
+
+#endif
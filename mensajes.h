@@ -1,6 +1,10 @@
 #ifndef _MENSAJES_H_
 #define _MENSAJES_H_
 
+#include <stdint.h>
+#include <stddef.h>
+#include <type_traits>
+
 #define MENSAJE_DESCONEXION					8
 #define MENSAJE_CONEXION 					1
 #define MENSAJE_CONEXION_SATISFACTORIA		2
@@ -9,12 +13,23 @@
 #define MENSAJE_RECONOCIMIENTO				5
 #define MENSAJE_NOMBRE_REQUEST				6
 #define MENSAJE_NOMBRE_REPLY				7
+#define MENSAJE_CICLO_COMPLETO				9
+#define MENSAJE_INSTANTANEA					10
+#define MENSAJE_POSICION_DELTA				11
+#define MENSAJE_CANAL_UDP					12
+#define MENSAJE_ENLACE_UDP					13
+
+#define MENSAJE_MAX							13
+
+// Capacidades que el cliente anuncia en MENSAJE_CONEXION
+#define CAPACIDAD_POSICION_DELTA			0x01
+#define CAPACIDAD_UDP						0x02
 
 #define NOMBRE_MAX_CHAR						20
 
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
-typedef int 			clienteid_t;
+typedef uint64_t 		clienteid_t;
 typedef int    			grupoid_t;
 typedef uint8_t  		mensaje_t;
 
@@ -22,8 +37,10 @@ struct mensaje_desconexion {
 	clienteid_t cliente_id_origen;
 };
 
+/* capacidades es una máscara de CAPACIDAD_*; un cliente que no soporte ninguna debe enviarla a 0 */
 struct mensaje_conexion {
 	grupoid_t grupo;
+	uint8_t capacidades;
 } __attribute__((packed));
 
 struct mensaje_conexion_satisfactoria {
@@ -41,13 +58,13 @@ struct mensaje_posicion {
 	int16_t posicion_y;
 	int16_t posicion_z;
 	uint32_t numero_secuencia;
-}; //__attribute__((packed));
+} __attribute__((packed));
 
 struct mensaje_reconocimiento {
 	clienteid_t cliente_id_origen;
 	clienteid_t cliente_id_destino;
 	uint32_t numero_secuencia;
-}; //__attribute__((packed));
+} __attribute__((packed));
 
 struct mensaje_nombre_request {
 	clienteid_t cliente_id_origen;
@@ -60,4 +77,143 @@ struct mensaje_nombre_reply {
 	char nombre[NOMBRE_MAX_CHAR];
 } __attribute__((packed));
 
-#endif
\ No newline at end of file
+/* Resumen de los reconocimientos de un ciclo de posición cuando el servidor los agrega. Va seguido
+de n_faltan clienteid_t con los miembros que no respondieron antes de que venciera el ciclo */
+struct mensaje_ciclo_completo {
+	uint32_t numero_secuencia;
+	uint16_t esperados;
+	uint16_t n_faltan;
+} __attribute__((packed));
+
+/* Últimas posiciones de los miembros de un grupo en un tick del servidor, cuando éste funciona por
+ticks en lugar de reenviar cada posición. Va seguido de n_posiciones mensaje_posicion */
+struct mensaje_instantanea {
+	uint32_t tick;
+	uint16_t n_posiciones;
+} __attribute__((packed));
+
+/* Posición codificada como diferencia respecto a la última del mismo origen que recibió el cliente.
+Va seguido de longitud bytes, con el formato de posicion_delta.h. Sólo se envía a clientes que
+anuncian CAPACIDAD_POSICION_DELTA */
+struct mensaje_posicion_delta {
+	uint8_t longitud;
+} __attribute__((packed));
+
+/* Respuesta, justo detrás de MENSAJE_CONEXION_SATISFACTORIA, a un cliente que anuncia CAPACIDAD_UDP.
+puerto es el del canal UDP del shard de su grupo, o 0 si el servidor no tiene canal UDP */
+struct mensaje_canal_udp {
+	uint16_t puerto;
+	uint64_t testigo;
+} __attribute__((packed));
+
+/* Primer datagrama del cliente al canal UDP. Si el testigo es el que recibió por TCP, la dirección de
+origen del datagrama queda asociada al cliente y el servidor le devuelve el mismo mensaje. A partir de
+ahí sus posiciones y reconocimientos pueden ir por UDP en ambos sentidos */
+struct mensaje_enlace_udp {
+	clienteid_t cliente_id_origen;
+	uint64_t testigo;
+} __attribute__((packed));
+
+/* Tabla de descriptores de mensaje. En el cable cada mensaje es un byte de tipo seguido de su
+estructura tal cual está en memoria, así que el tamaño del frame depende sólo del tipo. Sólo algunos
+mensajes que envía el servidor llevan detrás una lista de longitud variable, indicada en su propia
+estructura; la tabla recoge la parte fija. La tabla se indexa por tipo y mensaje_traits une cada tipo con su estructura; los static_assert de abajo
+comprueban en compilación que ambas coinciden y que el formato no cambia sin que nadie se entere */
+
+#define RUTA_NINGUNA						0	// Tipo no usado
+#define RUTA_SERVIDOR						1	// Lo consume el servidor (handshake y enlace UDP)
+#define RUTA_CLIENTE						2	// Sólo lo envía el servidor
+#define RUTA_GRUPO							3	// Se reenvía a todo el grupo salvo al origen
+#define RUTA_UNICAST						4	// Se reenvía al cliente de cliente_id_destino
+
+struct descriptor_mensaje {
+	uint16_t 	tamano;
+	uint8_t 	alineacion;
+	uint8_t 	ruta;
+	uint8_t 	offset_destino;
+};
+
+template<mensaje_t T> struct mensaje_traits;
+
+#define DECLARAR_MENSAJE(tipo, estructura, ruta_mensaje) \
+	template<> struct mensaje_traits<tipo> { \
+		typedef struct estructura tipo_estructura; \
+		static constexpr uint8_t ruta = ruta_mensaje; \
+	};
+
+DECLARAR_MENSAJE(MENSAJE_CONEXION, 					mensaje_conexion, 				RUTA_SERVIDOR)
+DECLARAR_MENSAJE(MENSAJE_CONEXION_SATISFACTORIA, 	mensaje_conexion_satisfactoria, RUTA_CLIENTE)
+DECLARAR_MENSAJE(MENSAJE_SALUDO, 					mensaje_saludo, 				RUTA_GRUPO)
+DECLARAR_MENSAJE(MENSAJE_POSICION, 					mensaje_posicion, 				RUTA_GRUPO)
+DECLARAR_MENSAJE(MENSAJE_RECONOCIMIENTO, 			mensaje_reconocimiento, 		RUTA_UNICAST)
+DECLARAR_MENSAJE(MENSAJE_NOMBRE_REQUEST, 			mensaje_nombre_request, 		RUTA_UNICAST)
+DECLARAR_MENSAJE(MENSAJE_NOMBRE_REPLY, 				mensaje_nombre_reply, 			RUTA_UNICAST)
+DECLARAR_MENSAJE(MENSAJE_DESCONEXION, 				mensaje_desconexion, 			RUTA_CLIENTE)
+DECLARAR_MENSAJE(MENSAJE_CICLO_COMPLETO, 			mensaje_ciclo_completo, 		RUTA_CLIENTE)
+DECLARAR_MENSAJE(MENSAJE_INSTANTANEA, 				mensaje_instantanea, 			RUTA_CLIENTE)
+DECLARAR_MENSAJE(MENSAJE_POSICION_DELTA, 			mensaje_posicion_delta, 		RUTA_CLIENTE)
+DECLARAR_MENSAJE(MENSAJE_CANAL_UDP, 				mensaje_canal_udp, 				RUTA_CLIENTE)
+DECLARAR_MENSAJE(MENSAJE_ENLACE_UDP, 				mensaje_enlace_udp, 			RUTA_SERVIDOR)
+
+#define DESCRIPTOR(estructura, ruta) \
+	{ sizeof(struct estructura), alignof(struct estructura), ruta, 0 }
+#define DESCRIPTOR_UNICAST(estructura) \
+	{ sizeof(struct estructura), alignof(struct estructura), RUTA_UNICAST, offsetof(struct estructura, cliente_id_destino) }
+
+static constexpr struct descriptor_mensaje descriptores_mensaje[MENSAJE_MAX + 1] = {
+	{ 0, 0, RUTA_NINGUNA, 0 },
+	DESCRIPTOR(mensaje_conexion, 				RUTA_SERVIDOR),		// MENSAJE_CONEXION
+	DESCRIPTOR(mensaje_conexion_satisfactoria, 	RUTA_CLIENTE),		// MENSAJE_CONEXION_SATISFACTORIA
+	DESCRIPTOR(mensaje_saludo, 					RUTA_GRUPO),		// MENSAJE_SALUDO
+	DESCRIPTOR(mensaje_posicion, 				RUTA_GRUPO),		// MENSAJE_POSICION
+	DESCRIPTOR_UNICAST(mensaje_reconocimiento),						// MENSAJE_RECONOCIMIENTO
+	DESCRIPTOR_UNICAST(mensaje_nombre_request),						// MENSAJE_NOMBRE_REQUEST
+	DESCRIPTOR_UNICAST(mensaje_nombre_reply),						// MENSAJE_NOMBRE_REPLY
+	DESCRIPTOR(mensaje_desconexion, 			RUTA_CLIENTE),		// MENSAJE_DESCONEXION
+	DESCRIPTOR(mensaje_ciclo_completo, 			RUTA_CLIENTE),		// MENSAJE_CICLO_COMPLETO (más la lista de IDs)
+	DESCRIPTOR(mensaje_instantanea, 			RUTA_CLIENTE),		// MENSAJE_INSTANTANEA (más las posiciones)
+	DESCRIPTOR(mensaje_posicion_delta, 			RUTA_CLIENTE),		// MENSAJE_POSICION_DELTA (más el delta)
+	DESCRIPTOR(mensaje_canal_udp, 				RUTA_CLIENTE),		// MENSAJE_CANAL_UDP
+	DESCRIPTOR(mensaje_enlace_udp, 				RUTA_SERVIDOR),		// MENSAJE_ENLACE_UDP (sólo por UDP)
+};
+
+// Tamaño del frame completo de un tipo (byte de tipo incluido), o 0 si el tipo no existe
+constexpr int tamano_frame(mensaje_t tipo)
+{
+	return (tipo <= MENSAJE_MAX && descriptores_mensaje[tipo].ruta != RUTA_NINGUNA) ?
+		(int) (sizeof(mensaje_t) + descriptores_mensaje[tipo].tamano) : 0;
+}
+
+template<mensaje_t T> struct comprobar_mensaje {
+	typedef typename mensaje_traits<T>::tipo_estructura estructura;
+
+	static_assert(std::is_trivially_copyable<estructura>::value, "Los mensajes se copian byte a byte al cable");
+	static_assert(descriptores_mensaje[T].tamano == sizeof(estructura), "Tamaño del descriptor distinto del de la estructura");
+	static_assert(descriptores_mensaje[T].alineacion == alignof(estructura), "Alineación del descriptor distinta de la de la estructura");
+	static_assert(descriptores_mensaje[T].ruta == mensaje_traits<T>::ruta, "Ruta del descriptor distinta de la del tipo");
+	static constexpr bool valido = true;
+};
+
+static_assert(comprobar_mensaje<MENSAJE_CONEXION>::valido &&
+			  comprobar_mensaje<MENSAJE_CONEXION_SATISFACTORIA>::valido &&
+			  comprobar_mensaje<MENSAJE_SALUDO>::valido &&
+			  comprobar_mensaje<MENSAJE_POSICION>::valido &&
+			  comprobar_mensaje<MENSAJE_RECONOCIMIENTO>::valido &&
+			  comprobar_mensaje<MENSAJE_NOMBRE_REQUEST>::valido &&
+			  comprobar_mensaje<MENSAJE_NOMBRE_REPLY>::valido &&
+			  comprobar_mensaje<MENSAJE_DESCONEXION>::valido &&
+			  comprobar_mensaje<MENSAJE_CICLO_COMPLETO>::valido &&
+			  comprobar_mensaje<MENSAJE_INSTANTANEA>::valido &&
+			  comprobar_mensaje<MENSAJE_POSICION_DELTA>::valido &&
+			  comprobar_mensaje<MENSAJE_CANAL_UDP>::valido &&
+			  comprobar_mensaje<MENSAJE_ENLACE_UDP>::valido, "Descriptores de mensaje inconsistentes");
+
+/* Formato en el cable de los mensajes más frecuentes. Se fija aquí para que cambiar un tipo o el
+empaquetado de una estructura no pase desapercibido */
+static_assert(sizeof(clienteid_t) == 8, "Los IDs de cliente son de 64 bits");
+static_assert(sizeof(struct mensaje_conexion) == 5, "Cambia el formato en el cable de mensaje_conexion");
+static_assert(sizeof(struct mensaje_posicion) == 18 && offsetof(struct mensaje_posicion, numero_secuencia) == 14,
+			  "Cambia el formato en el cable de mensaje_posicion");
+static_assert(sizeof(struct mensaje_reconocimiento) == 20, "Cambia el formato en el cable de mensaje_reconocimiento");
+
+#endif
@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <thread>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metricas.h"
+
+
+using namespace std;
+
+static const char *nombres_mensaje[MENSAJE_MAX + 1] = {
+    "ninguno", "conexion", "conexion_satisfactoria", "saludo", "posicion", "reconocimiento",
+    "nombre_request", "nombre_reply", "desconexion", "ciclo_completo", "instantanea",
+    "posicion_delta", "canal_udp", "enlace_udp"
+};
+
+static_assert(MENSAJE_MAX == 13, "Falta el nombre de algún mensaje en las métricas");
+
+static struct metricas *todas = NULL;
+static int total_shards = 0;
+
+// Hasta metricas_crear(), y en hilos sin métricas propias, se escribe en un bloque que nadie lee
+static struct metricas metricas_descartadas;
+
+thread_local struct metricas *metricas_hilo = &metricas_descartadas;
+
+static thread_local uint64_t vuelta_inicio = 0;
+static thread_local uint64_t vuelta_reenvios = 0;
+
+static uint64_t reloj_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Un bloque por shard más uno, el último, para el hilo aceptador, que es quien llama aquí */
+void metricas_crear(int num_shards)
+{
+    void *memoria;
+
+    if(posix_memalign(&memoria, METRICAS_LINEA_CACHE, (num_shards + 1) * sizeof(struct metricas)) != 0)
+    {
+        perror("metricas_crear->posix_memalign()");
+        exit(-1);
+    }
+
+    memset(memoria, 0, (num_shards + 1) * sizeof(struct metricas));
+
+    todas = (struct metricas *) memoria;
+    total_shards = num_shards;
+
+    metricas_asignar(&todas[num_shards]);
+}
+
+struct metricas * metricas_shard(int shard)
+{
+    return &todas[shard];
+}
+
+void metricas_asignar(struct metricas *metricas)
+{
+    metricas_hilo = metricas;
+}
+
+static int cubeta(uint64_t valor)
+{
+    if(valor < HISTOGRAMA_SUBCUBETAS)
+        return valor;
+
+    int desplazamiento = 63 - __builtin_clzll(valor) - HISTOGRAMA_BITS_SUB;
+
+    return (desplazamiento + 1) * HISTOGRAMA_SUBCUBETAS + ((valor >> desplazamiento) & (HISTOGRAMA_SUBCUBETAS - 1));
+}
+
+// Mayor valor que cae en la cubeta
+static uint64_t limite_cubeta(int indice)
+{
+    if(indice < HISTOGRAMA_SUBCUBETAS)
+        return indice;
+
+    int desplazamiento = indice / HISTOGRAMA_SUBCUBETAS - 1;
+    uint64_t base = HISTOGRAMA_SUBCUBETAS + indice % HISTOGRAMA_SUBCUBETAS;
+
+    return ((base + 1) << desplazamiento) - 1;
+}
+
+void histograma_registrar(struct histograma *histograma, uint64_t valor, uint64_t veces)
+{
+    METRICA_SUMAR(histograma->cubetas[cubeta(valor)], veces);
+    METRICA_SUMAR(histograma->cuenta, veces);
+    METRICA_SUMAR(histograma->suma, valor * veces);
+
+    if(valor > histograma->maximo)
+        __atomic_store_n(&histograma->maximo, valor, __ATOMIC_RELAXED);
+}
+
+/* La latencia de reenvío se mide por vuelta del bucle de cada shard: todo lo que se recibe en una
+vuelta se reenvía en el lote que se vacía al final, así que cada mensaje reenviado en ella cuenta el
+tiempo desde que el shard despierta hasta que ha entregado el lote al kernel */
+void metricas_vuelta_iniciar()
+{
+    vuelta_inicio = reloj_ns();
+    vuelta_reenvios = 0;
+}
+
+void metricas_reenvio(int destinos)
+{
+    vuelta_reenvios++;
+    histograma_registrar(&metricas_hilo->tamano_difusion, destinos);
+}
+
+void metricas_vuelta_terminar()
+{
+    if(vuelta_reenvios > 0)
+        histograma_registrar(&metricas_hilo->latencia_reenvio, reloj_ns() - vuelta_inicio, vuelta_reenvios);
+}
+
+static void sumar_histograma(struct histograma *total, struct histograma *parte)
+{
+    for(int i = 0; i < HISTOGRAMA_CUBETAS; i++)
+        total->cubetas[i] += METRICA_LEER(parte->cubetas[i]);
+
+    total->cuenta += METRICA_LEER(parte->cuenta);
+    total->suma += METRICA_LEER(parte->suma);
+
+    uint64_t maximo = METRICA_LEER(parte->maximo);
+
+    if(maximo > total->maximo)
+        total->maximo = maximo;
+}
+
+static uint64_t percentil(const struct histograma *histograma, double p)
+{
+    uint64_t objetivo = (uint64_t) (histograma->cuenta * p), acumulado = 0;
+
+    if(histograma->cuenta == 0)
+        return 0;
+
+    for(int i = 0; i < HISTOGRAMA_CUBETAS; i++)
+    {
+        acumulado += histograma->cubetas[i];
+
+        if(acumulado > objetivo)
+            return min(limite_cubeta(i), histograma->maximo);
+    }
+
+    return histograma->maximo;
+}
+
+/* Copia de las métricas de todos los hilos sumadas, leída mientras siguen escribiéndose. Sólo la usa
+el hilo que sirve las métricas */
+static struct metricas agregadas;
+
+static void agregar(struct metricas *total)
+{
+    memset(total, 0, sizeof(struct metricas));
+
+    for(int s = 0; s <= total_shards; s++)
+    {
+        struct metricas *parte = &todas[s];
+
+        for(int i = 0; i <= MENSAJE_MAX; i++)
+        {
+            total->mensajes_entrada[i] += METRICA_LEER(parte->mensajes_entrada[i]);
+            total->mensajes_salida[i] += METRICA_LEER(parte->mensajes_salida[i]);
+        }
+
+        total->bytes_entrada += METRICA_LEER(parte->bytes_entrada);
+        total->bytes_salida += METRICA_LEER(parte->bytes_salida);
+        total->llamadas_recepcion += METRICA_LEER(parte->llamadas_recepcion);
+        total->llamadas_envio += METRICA_LEER(parte->llamadas_envio);
+        total->llamadas_espera += METRICA_LEER(parte->llamadas_espera);
+        total->envios_parciales += METRICA_LEER(parte->envios_parciales);
+        total->datagramas_entrada += METRICA_LEER(parte->datagramas_entrada);
+        total->datagramas_salida += METRICA_LEER(parte->datagramas_salida);
+        total->datagramas_descartados += METRICA_LEER(parte->datagramas_descartados);
+        total->desconexiones += METRICA_LEER(parte->desconexiones);
+        total->saturados += METRICA_LEER(parte->saturados);
+        total->lento_descartados += METRICA_LEER(parte->lento_descartados);
+        total->lento_diezmados += METRICA_LEER(parte->lento_diezmados);
+        total->lento_desconectados += METRICA_LEER(parte->lento_desconectados);
+        total->grupos_migrados += METRICA_LEER(parte->grupos_migrados);
+        total->particiones_descartadas += METRICA_LEER(parte->particiones_descartadas);
+        total->clientes += METRICA_LEER(parte->clientes);
+        total->grupos += METRICA_LEER(parte->grupos);
+
+        sumar_histograma(&total->latencia_reenvio, &parte->latencia_reenvio);
+        sumar_histograma(&total->tamano_difusion, &parte->tamano_difusion);
+        sumar_histograma(&total->profundidad_cola, &parte->profundidad_cola);
+        sumar_histograma(&total->retraso_cola, &parte->retraso_cola);
+    }
+}
+
+static void anadir(string &salida, const char *formato, ...) __attribute__((format(printf, 2, 3)));
+
+static void anadir(string &salida, const char *formato, ...)
+{
+    char linea[256];
+    va_list argumentos;
+
+    va_start(argumentos, formato);
+    vsnprintf(linea, sizeof(linea), formato, argumentos);
+    va_end(argumentos);
+
+    salida += linea;
+}
+
+static const char *nombres_percentil[] = { "p50", "p90", "p99", "p999" };
+static const double valores_percentil[] = { 0.50, 0.90, 0.99, 0.999 };
+
+static void histograma_texto(string &salida, const char *nombre, const struct histograma *histograma)
+{
+    anadir(salida, "%s_cuenta %lu\n", nombre, histograma->cuenta);
+    anadir(salida, "%s_media %lu\n", nombre, histograma->cuenta ? histograma->suma / histograma->cuenta : 0);
+
+    for(int i = 0; i < 4; i++)
+        anadir(salida, "%s{percentil=\"%s\"} %lu\n", nombre, nombres_percentil[i], percentil(histograma, valores_percentil[i]));
+
+    anadir(salida, "%s_max %lu\n", nombre, histograma->maximo);
+}
+
+static void histograma_json(string &salida, const char *nombre, const struct histograma *histograma)
+{
+    anadir(salida, "\"%s\":{\"cuenta\":%lu,\"media\":%lu", nombre, histograma->cuenta, histograma->cuenta ? histograma->suma / histograma->cuenta : 0);
+
+    for(int i = 0; i < 4; i++)
+        anadir(salida, ",\"%s\":%lu", nombres_percentil[i], percentil(histograma, valores_percentil[i]));
+
+    anadir(salida, ",\"max\":%lu}", histograma->maximo);
+}
+
+/* Formato de texto de una métrica por línea, con las de cada tipo de mensaje y los percentiles
+etiquetados entre llaves */
+string metricas_texto()
+{
+    struct metricas *total = &agregadas;
+    string salida;
+
+    agregar(total);
+
+    anadir(salida, "clientes %ld\n", total->clientes);
+    anadir(salida, "grupos %ld\n", total->grupos);
+
+    for(int i = 1; i <= MENSAJE_MAX; i++)
+        anadir(salida, "mensajes_entrada{tipo=\"%s\"} %lu\n", nombres_mensaje[i], total->mensajes_entrada[i]);
+
+    for(int i = 1; i <= MENSAJE_MAX; i++)
+        anadir(salida, "mensajes_salida{tipo=\"%s\"} %lu\n", nombres_mensaje[i], total->mensajes_salida[i]);
+
+    anadir(salida, "bytes_entrada %lu\n", total->bytes_entrada);
+    anadir(salida, "bytes_salida %lu\n", total->bytes_salida);
+    anadir(salida, "llamadas_recepcion %lu\n", total->llamadas_recepcion);
+    anadir(salida, "llamadas_envio %lu\n", total->llamadas_envio);
+    anadir(salida, "llamadas_espera %lu\n", total->llamadas_espera);
+    anadir(salida, "envios_parciales %lu\n", total->envios_parciales);
+    anadir(salida, "datagramas_entrada %lu\n", total->datagramas_entrada);
+    anadir(salida, "datagramas_salida %lu\n", total->datagramas_salida);
+    anadir(salida, "datagramas_descartados %lu\n", total->datagramas_descartados);
+    anadir(salida, "desconexiones %lu\n", total->desconexiones);
+    anadir(salida, "saturados %lu\n", total->saturados);
+    anadir(salida, "lento_descartados %lu\n", total->lento_descartados);
+    anadir(salida, "lento_diezmados %lu\n", total->lento_diezmados);
+    anadir(salida, "lento_desconectados %lu\n", total->lento_desconectados);
+    anadir(salida, "grupos_migrados %lu\n", total->grupos_migrados);
+    anadir(salida, "particiones_descartadas %lu\n", total->particiones_descartadas);
+
+    histograma_texto(salida, "latencia_reenvio_ns", &total->latencia_reenvio);
+    histograma_texto(salida, "tamano_difusion", &total->tamano_difusion);
+    histograma_texto(salida, "profundidad_cola", &total->profundidad_cola);
+    histograma_texto(salida, "retraso_cola_ms", &total->retraso_cola);
+
+    for(int s = 0; s < total_shards; s++)
+    {
+        anadir(salida, "shard_clientes{shard=\"%d\"} %ld\n", s, METRICA_LEER(todas[s].clientes));
+        anadir(salida, "shard_grupos{shard=\"%d\"} %ld\n", s, METRICA_LEER(todas[s].grupos));
+    }
+
+    return salida;
+}
+
+string metricas_json()
+{
+    struct metricas *total = &agregadas;
+    string salida;
+
+    agregar(total);
+
+    anadir(salida, "{\"clientes\":%ld,\"grupos\":%ld", total->clientes, total->grupos);
+
+    salida += ",\"mensajes_entrada\":{";
+    for(int i = 1; i <= MENSAJE_MAX; i++)
+        anadir(salida, "%s\"%s\":%lu", i > 1 ? "," : "", nombres_mensaje[i], total->mensajes_entrada[i]);
+
+    salida += "},\"mensajes_salida\":{";
+    for(int i = 1; i <= MENSAJE_MAX; i++)
+        anadir(salida, "%s\"%s\":%lu", i > 1 ? "," : "", nombres_mensaje[i], total->mensajes_salida[i]);
+
+    anadir(salida, "},\"bytes_entrada\":%lu,\"bytes_salida\":%lu", total->bytes_entrada, total->bytes_salida);
+    anadir(salida, ",\"llamadas_recepcion\":%lu,\"llamadas_envio\":%lu,\"llamadas_espera\":%lu", total->llamadas_recepcion, total->llamadas_envio, total->llamadas_espera);
+    anadir(salida, ",\"envios_parciales\":%lu", total->envios_parciales);
+    anadir(salida, ",\"datagramas_entrada\":%lu,\"datagramas_salida\":%lu,\"datagramas_descartados\":%lu", total->datagramas_entrada, total->datagramas_salida, total->datagramas_descartados);
+    anadir(salida, ",\"desconexiones\":%lu,\"saturados\":%lu", total->desconexiones, total->saturados);
+    anadir(salida, ",\"lento_descartados\":%lu,\"lento_diezmados\":%lu,\"lento_desconectados\":%lu", total->lento_descartados, total->lento_diezmados, total->lento_desconectados);
+    anadir(salida, ",\"grupos_migrados\":%lu,\"particiones_descartadas\":%lu,", total->grupos_migrados, total->particiones_descartadas);
+
+    histograma_json(salida, "latencia_reenvio_ns", &total->latencia_reenvio);
+    salida += ",";
+    histograma_json(salida, "tamano_difusion", &total->tamano_difusion);
+    salida += ",";
+    histograma_json(salida, "profundidad_cola", &total->profundidad_cola);
+    salida += ",";
+    histograma_json(salida, "retraso_cola_ms", &total->retraso_cola);
+
+    salida += ",\"shards\":[";
+    for(int s = 0; s < total_shards; s++)
+        anadir(salida, "%s{\"clientes\":%ld,\"grupos\":%ld}", s > 0 ? "," : "", METRICA_LEER(todas[s].clientes), METRICA_LEER(todas[s].grupos));
+    salida += "]}\n";
+
+    return salida;
+}
+
+static void atender_peticiones(int socketfd)
+{
+    while(true)
+    {
+        int cliente = accept(socketfd, NULL, NULL);
+
+        if(cliente < 0)
+        {
+            if(errno != EINTR)
+                perror("metricas->accept()");
+            continue;
+        }
+
+        // La petición es una línea opcional: "json" pide JSON y cualquier otra cosa, o nada, texto
+        struct timeval espera = { 0, 100000 };
+        char peticion[64];
+
+        setsockopt(cliente, SOL_SOCKET, SO_RCVTIMEO, &espera, sizeof(espera));
+
+        int leidos = read(cliente, peticion, sizeof(peticion) - 1);
+        string respuesta = leidos >= 4 && strncmp(peticion, "json", 4) == 0 ? metricas_json() : metricas_texto();
+
+        for(size_t enviado = 0; enviado < respuesta.size(); )
+        {
+            int rc = write(cliente, respuesta.data() + enviado, respuesta.size() - enviado);
+
+            if(rc <= 0)
+                break;
+
+            enviado += rc;
+        }
+
+        close(cliente);
+    }
+}
+
+/* Sirve las métricas en un socket Unix desde un hilo propio, que no toca nada de los shards salvo
+leer sus métricas. Cada conexión recibe un informe y se cierra */
+void metricas_servir(const char *ruta)
+{
+    struct sockaddr_un direccion;
+    int socketfd;
+
+    if(strlen(ruta) >= sizeof(direccion.sun_path))
+    {
+        fprintf(stderr, "metricas_servir(): ruta demasiado larga: %s\n", ruta);
+        exit(-1);
+    }
+
+    if((socketfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("metricas_servir->socket()");
+        exit(-1);
+    }
+
+    memset(&direccion, 0, sizeof(direccion));
+    direccion.sun_family = AF_UNIX;
+    strcpy(direccion.sun_path, ruta);
+
+    unlink(ruta);
+
+    if(bind(socketfd, (struct sockaddr *) &direccion, sizeof(direccion)) < 0 || listen(socketfd, 16) < 0)
+    {
+        perror("metricas_servir->bind()");
+        exit(-1);
+    }
+
+    thread(atender_peticiones, socketfd).detach();
+}
@@ -0,0 +1,68 @@
+#ifndef _METRICAS_H_
+#define _METRICAS_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "mensajes.h"
+
+#define METRICAS_LINEA_CACHE			64
+
+/* Histograma logarítmico al estilo HDR: cada potencia de dos se divide en HISTOGRAMA_SUBCUBETAS
+cubetas iguales, así que el error relativo de cualquier valor es como mucho de 1/16 */
+#define HISTOGRAMA_BITS_SUB				4
+#define HISTOGRAMA_SUBCUBETAS			(1 << HISTOGRAMA_BITS_SUB)
+#define HISTOGRAMA_CUBETAS				((64 - HISTOGRAMA_BITS_SUB + 1) * HISTOGRAMA_SUBCUBETAS)
+
+/* Las métricas sólo las escribe el hilo al que pertenecen, sin instrucciones atómicas de
+lectura-modificación-escritura: METRICA_SUMAR carga y guarda con atomicidad relajada, que en x86 son
+movimientos normales, y el hilo que sirve las estadísticas lee con la misma atomicidad relajada */
+#define METRICA_LEER(campo)				__atomic_load_n(&(campo), __ATOMIC_RELAXED)
+#define METRICA_SUMAR(campo, n)			__atomic_store_n(&(campo), METRICA_LEER(campo) + (n), __ATOMIC_RELAXED)
+
+using namespace std;
+
+struct histograma {
+	uint64_t 					cubetas[HISTOGRAMA_CUBETAS];
+	uint64_t 					cuenta;
+	uint64_t 					suma;
+	uint64_t 					maximo;
+};
+
+/* Métricas de un hilo (un shard o el aceptador), alineadas a su propia línea de caché para que la
+escritura de un shard no invalide la de otro. clientes y grupos son niveles: suben y bajan */
+struct metricas {
+	alignas(METRICAS_LINEA_CACHE)
+	uint64_t 					mensajes_entrada[MENSAJE_MAX + 1];
+	uint64_t 					mensajes_salida[MENSAJE_MAX + 1];
+	uint64_t 					bytes_entrada, bytes_salida;
+	uint64_t 					llamadas_recepcion, llamadas_envio, llamadas_espera;
+	uint64_t 					envios_parciales;
+	uint64_t 					datagramas_entrada, datagramas_salida, datagramas_descartados;
+	uint64_t 					desconexiones, saturados;
+	uint64_t 					lento_descartados, lento_diezmados, lento_desconectados;
+	uint64_t 					grupos_migrados, particiones_descartadas;
+	int64_t 					clientes, grupos;
+
+	struct histograma 			latencia_reenvio;		// ns desde que se despierta hasta que se vacía el lote
+	struct histograma 			tamano_difusion;		// tamaño de los destinos de cada reenvío, origen incluido
+	struct histograma 			profundidad_cola;		// mensajes que siguen en cola tras vaciar el lote
+	struct histograma 			retraso_cola;			// ms del más antiguo de las colas que no se vacían
+};
+
+extern thread_local struct metricas *metricas_hilo;
+
+void metricas_crear(int num_shards);
+struct metricas * metricas_shard(int shard);
+void metricas_asignar(struct metricas *metricas);
+void histograma_registrar(struct histograma *histograma, uint64_t valor, uint64_t veces = 1);
+
+void metricas_vuelta_iniciar();
+void metricas_reenvio(int destinos);
+void metricas_vuelta_terminar();
+
+string metricas_texto();
+string metricas_json();
+void metricas_servir(const char *ruta);
+
+#endif
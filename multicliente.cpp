@@ -29,6 +29,7 @@
 #include <assert.h>
 
 #include "mensajes.h"
+#include "posicion_delta.h"
 
 using namespace std;
 
@@ -36,6 +37,20 @@ typedef int64_t msec_t;
 
 mutex report_mutex;
 
+// Con el servidor en modo -a los reconocimientos llegan agregados en un MENSAJE_CICLO_COMPLETO
+bool agregado = false;
+
+/* Con el servidor en modo -T no hay reconocimientos: las posiciones llegan en MENSAJE_INSTANTANEA y
+el ciclo termina cuando una instantánea trae la propia posición con la secuencia actual */
+bool instantaneas = false;
+
+// Con el servidor en modo -u las posiciones y los reconocimientos van por su canal UDP
+bool udp = false;
+
+#define UDP_INTENTOS_ENLACE		10
+#define UDP_ESPERA_ENLACE_MS	200
+#define UDP_REENVIO_MS			500
+
 msec_t time_ms(void)
 {
     struct timeval tv;
@@ -43,6 +58,94 @@ msec_t time_ms(void)
     return (msec_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+/* Los mensajes que llegan por el canal UDP se leen de su datagrama, que trae el mensaje entero, en
+lugar del socket TCP. Así el mismo código atiende una posición o un reconocimiento venga por donde venga */
+struct lector_mensaje {
+	int 		socket;
+	uint8_t 	*datagrama;
+	int 		restantes;
+};
+
+int recibir(struct lector_mensaje *lector, void *destino, int longitud)
+{
+	if(lector->datagrama == NULL)
+		return recv(lector->socket, destino, longitud, 0);
+
+	if(longitud > lector->restantes)
+		return -1;
+
+	memcpy(destino, lector->datagrama, longitud);
+	lector->datagrama += longitud;
+	lector->restantes -= longitud;
+
+	return longitud;
+}
+
+/* Lee el MENSAJE_CANAL_UDP que sigue a la conexión satisfactoria y envía el MENSAJE_ENLACE_UDP hasta
+que el servidor lo devuelve. Devuelve el socket UDP ya conectado al puerto del shard del grupo, o -1 si
+el servidor no tiene canal UDP o no responde, y entonces todo sigue por TCP */
+int enlazar_udp(int server_socket, struct sockaddr_in dir, clienteid_t cliente_id)
+{
+	uint8_t buffer[40], respuesta[40];
+	struct mensaje_canal_udp canal;
+	struct mensaje_enlace_udp enlace;
+	int udp_socket;
+
+	if(recv(server_socket, buffer, tamano_frame(MENSAJE_CANAL_UDP), MSG_WAITALL) != tamano_frame(MENSAJE_CANAL_UDP) ||
+	   buffer[0] != MENSAJE_CANAL_UDP)
+	{
+		perror("[MENSAJE_CANAL_UDP] recv() error");
+		return -1;
+	}
+
+	memcpy(&canal, &buffer[1], sizeof(canal));
+
+	if(canal.puerto == 0)
+		return -1;
+
+	if((udp_socket = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+	{
+		perror("socket() error");
+		return -1;
+	}
+
+	dir.sin_port = htons(canal.puerto);
+
+	if(connect(udp_socket, (struct sockaddr *)&dir, sizeof(struct sockaddr_in)) < 0)
+	{
+		perror("connect() error");
+		close(udp_socket);
+		return -1;
+	}
+
+	enlace.cliente_id_origen = cliente_id;
+	enlace.testigo = canal.testigo;
+	buffer[0] = MENSAJE_ENLACE_UDP;
+	memcpy(&buffer[1], &enlace, sizeof(enlace));
+
+	// El enlace puede perderse o llegar antes de que el shard nos haya unido al grupo, así que se reintenta
+	for(int intento = 0; intento < UDP_INTENTOS_ENLACE; intento++)
+	{
+		fd_set fd;
+		struct timeval espera = { 0, UDP_ESPERA_ENLACE_MS * 1000 };
+
+		send(udp_socket, buffer, tamano_frame(MENSAJE_ENLACE_UDP), 0);
+
+		FD_ZERO(&fd);
+		FD_SET(udp_socket, &fd);
+
+		if(select(udp_socket + 1, &fd, NULL, NULL, &espera) > 0 &&
+		   recv(udp_socket, respuesta, sizeof(respuesta), 0) == tamano_frame(MENSAJE_ENLACE_UDP) &&
+		   respuesta[0] == MENSAJE_ENLACE_UDP)
+		{
+			return udp_socket;
+		}
+	}
+
+	close(udp_socket);
+	return -1;
+}
+
 int cliente_thread(int grupo, string nombre_fichero)
 {
 	/* Esta función se lanzará en un hilo que representará a un cliente. Sus variables y su comportamiento
@@ -99,6 +202,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 	struct mensaje_conexion nueva_conexion;
 
 	nueva_conexion.grupo = grupo;
+	nueva_conexion.capacidades = CAPACIDAD_POSICION_DELTA | (udp ? CAPACIDAD_UDP : 0);
 	tipo_mensaje = MENSAJE_CONEXION;
 
 	// Copiamos el tipo al primer byte y la estructura a partir del segundo byte del buffer
@@ -108,7 +212,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 	do
 	{
 
-		rc = send(server_socket, buffer, sizeof(nueva_conexion) + sizeof(uint8_t),0);
+		rc = send(server_socket, buffer, tamano_frame(MENSAJE_CONEXION),0);
 		
 		// Si se cierra la conexión o hay un error, cerramos el hilo
 		if(rc <= 0)
@@ -150,6 +254,19 @@ int cliente_thread(int grupo, string nombre_fichero)
 	// Leemos la ID que nos han asignado y la guardamos
 	cliente_id = conexion_satisfactoria.cliente_id;
 
+	/* Las posiciones y los reconocimientos salen por socket_datos, que es el canal UDP si el servidor
+	nos lo da, y lo que llegue se lee a través de lector */
+	int udp_socket = udp ? enlazar_udp(server_socket, dir, cliente_id) : -1;
+	int socket_datos = udp_socket >= 0 ? udp_socket : server_socket;
+	struct lector_mensaje lector = { server_socket, NULL, 0 };
+	uint8_t datagrama[200];
+	int64_t reenvio = 0;
+
+	if(udp && udp_socket < 0)
+	{
+		cout << "El servidor no ofrece canal UDP, se sigue por TCP." << endl;
+	}
+
 	// Una vez conectados al grupo, es hora de enviar el mensaje de saludo
 	struct mensaje_saludo nuevo_saludo;
 	string s = "Jordi";
@@ -162,7 +279,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 	strcpy(nuevo_saludo.nombre, s.c_str());
 	memcpy(&buffer[1], &nuevo_saludo, sizeof(nuevo_saludo));
 
-	rc = send(server_socket, buffer, sizeof(nuevo_saludo) + sizeof(uint8_t),0);
+	rc = send(server_socket, buffer, tamano_frame(MENSAJE_SALUDO),0);
 
 	if(rc <= 0)
 	{
@@ -192,6 +309,9 @@ int cliente_thread(int grupo, string nombre_fichero)
 	FD_ZERO(&fd);
 	FD_SET(server_socket, &fd);
 
+	if(udp_socket >= 0)
+		FD_SET(udp_socket, &fd);
+
 	int n;
 	struct timeval  timeout;
 	timeout.tv_sec = 1;
@@ -212,7 +332,10 @@ int cliente_thread(int grupo, string nombre_fichero)
     de reconocimiento. Como vamos a realizar muchas búsquedas por ID, nos interesa una función hash para encontrar
     rápidamente a los clientes. Un contenedor map<key,value> ordena los valores por su llave, teniendo un coste de 
     búsqueda menor que si buscásemos secuencialmente por un vector */
-    map<int, cliente_info> clientes_conocidos, clientes_copia;
+    map<clienteid_t, cliente_info> clientes_conocidos, clientes_copia;
+
+    // Última posición recibida de cada origen, que es la base sobre la que se aplica su siguiente delta
+    map<clienteid_t, struct mensaje_posicion> ultimas_posiciones;
 
     //fichero << cliente_id << endl;
     ticker = time_ms();
@@ -225,7 +348,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 	{
 		// Primero ejecutamos las dos instrucciones necesarias para el select
 		memcpy(&fd_copy, &fd, sizeof(fd));
-		n = select(server_socket + 1, &fd_copy, NULL, NULL, &timeout);
+		n = select(max(server_socket, udp_socket) + 1, &fd_copy, NULL, NULL, &timeout);
 
 		/* La variable nuevo_ciclo estará activada cuando toque hacer un nuevo ciclo. Esto es, cuando tengamos todos
 		los mensajes de reconocimiento del ciclo actual */
@@ -247,7 +370,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 
 			// Copiamos la estructura ya actualizada a continuación del byte de tipo de mensaje
 			memcpy(&buffer[1], &miPosicion, sizeof(miPosicion));
-			rc = send(server_socket, buffer, sizeof(miPosicion) + sizeof(mensaje_t), 0);
+			rc = send(socket_datos, buffer, tamano_frame(MENSAJE_POSICION), 0);
 
 			if(rc <= 0)
 			{
@@ -260,6 +383,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 
 			// Reiniciamos el contador de tiempo para saber cuanto tiempo durará el siguiente ciclo
 			ticker = time_ms();
+			reenvio = ticker;
 
 			// Copiamos los clientes conocidos, aquellos de los que deberemos esperar sus ACKs
 			clientes_copia = clientes_conocidos;
@@ -269,13 +393,20 @@ int cliente_thread(int grupo, string nombre_fichero)
 			fichero << "[ID" << cliente_id << "] Esperando " << clientes_copia.size() << " mensajes de reconocimiento" << endl;
 			
 
-			if(clientes_copia.size() == 0)
+			if(clientes_copia.size() == 0 && !agregado && !instantaneas)
 			{
 				nuevo_ciclo = true;
 			}
 			/*fichero << "Se necesitan encontrar " << clientes_copia.size() << " ACKs coincidentes para siguiente ciclo." << endl;
 			if(clientes_copia.empty() && (secuencia > 70))
 				break;*/
+		} else if(udp_socket >= 0 && time_ms() - reenvio > UDP_REENVIO_MS) {
+			/* Por UDP se puede haber perdido la posición o algún reconocimiento: se repite la posición y
+			quien ya la tenía vuelve a reconocerla, lo que no afecta a los reconocimientos ya recibidos */
+			buffer[0] = MENSAJE_POSICION;
+			memcpy(&buffer[1], &miPosicion, sizeof(miPosicion));
+			send(udp_socket, buffer, tamano_frame(MENSAJE_POSICION), 0);
+			reenvio = time_ms();
 		} else {
 			//fichero << "Soy el ID: " << cliente_id << " y me faltan " << clientes_copia.size() << " ACKs." << endl;
 		}
@@ -285,23 +416,43 @@ int cliente_thread(int grupo, string nombre_fichero)
 		iterar sobre n pues podemos directamente comprobar si es el socket del servidor el que tiene datos para leer */
 		if(n > 0)
 		{
-			if(FD_ISSET(server_socket, &fd_copy))
+			bool por_udp = udp_socket >= 0 && FD_ISSET(udp_socket, &fd_copy);
+
+			if(por_udp || FD_ISSET(server_socket, &fd_copy))
 			{
 				mensaje_t tipo;
 
-				// Recibimos el primer byte, que indica el tipo de mensaje recibido
-				rc = recv(server_socket, &tipo, sizeof(tipo), 0);
+				lector.datagrama = NULL;
 
-				if(rc <= 0)
+				if(por_udp)
 				{
-					perror("[TIPO_MENSAJE] recv() error");
-					close(server_socket);
-					return 0;
+					// Un datagrama es un mensaje entero; por el canal UDP sólo llegan posiciones y reconocimientos
+					rc = recv(udp_socket, datagrama, sizeof(datagrama), 0);
+					tipo = datagrama[0];
+
+					if(rc <= 0 || (tipo != MENSAJE_POSICION && tipo != MENSAJE_RECONOCIMIENTO) || rc != tamano_frame(tipo))
+						continue;
+
+					lector.datagrama = &datagrama[1];
+					lector.restantes = rc - 1;
+				}
+				else
+				{
+					// Recibimos el primer byte, que indica el tipo de mensaje recibido
+					rc = recv(server_socket, &tipo, sizeof(tipo), 0);
+
+					if(rc <= 0)
+					{
+						perror("[TIPO_MENSAJE] recv() error");
+						close(server_socket);
+						return 0;
+					}
 				}
 
 				switch(tipo)
 				{
 					case MENSAJE_POSICION:
+					case MENSAJE_POSICION_DELTA:
 						{
 						/* En caso de recibir un mensaje de posición son varias las tareas que se deben hacer.
 						En primer lugar, y sin importar si conocemos o no al cliente, le mandamos de vuelta tan
@@ -309,7 +460,38 @@ int cliente_thread(int grupo, string nombre_fichero)
 
 
 						// Recibimos el resto del mensaje y lo guardamos en la estructura correspondiente
-						rc = recv(server_socket, &posicion, sizeof(posicion), 0);
+						if(tipo == MENSAJE_POSICION)
+						{
+							rc = recibir(&lector, &posicion, sizeof(posicion));
+						}
+						else
+						{
+							/* Un delta trae sólo las diferencias con la última posición de su origen, así que se
+							reconstruye la posición completa sobre la que tenemos guardada */
+							struct mensaje_posicion_delta delta;
+							clienteid_t origen;
+
+							rc = recv(server_socket, &delta, sizeof(delta), MSG_WAITALL);
+
+							if(rc > 0)
+								rc = recv(server_socket, buffer, delta.longitud, MSG_WAITALL);
+
+							if(rc > 0)
+							{
+								map<clienteid_t, struct mensaje_posicion>::iterator base;
+
+								if(!delta_origen(buffer, delta.longitud, &origen) ||
+								   (base = ultimas_posiciones.find(origen)) == ultimas_posiciones.end())
+								{
+									fprintf(stderr, "[MENSAJE_POSICION_DELTA] delta sin posición base\n");
+									close(server_socket);
+									return 0;
+								}
+
+								posicion = base->second;
+								delta_aplicar(buffer, delta.longitud, &posicion);
+							}
+						}
 
 						if(rc <= 0)
 						{
@@ -318,6 +500,8 @@ int cliente_thread(int grupo, string nombre_fichero)
 							return 0;
 						}
 
+						ultimas_posiciones[posicion.cliente_id_origen] = posicion;
+
 						
 						fichero << "[ID" << cliente_id << "] POSICIÓN. ID: " << posicion.cliente_id_origen << 
 						 											". SECUENCIA: " << posicion.numero_secuencia << endl;
@@ -345,7 +529,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 						fichero << "[ID" << cliente_id << "] ENVÍO DE ACK. ID_DEST: " << reconocimiento.cliente_id_destino << 
 						 										". SECUENCIA: " << reconocimiento.numero_secuencia << endl;
 						
-						rc = send(server_socket, buffer, sizeof(reconocimiento) + sizeof(mensaje_t), 0);
+						rc = send(socket_datos, buffer, tamano_frame(MENSAJE_RECONOCIMIENTO), 0);
 
 						if(rc <= 0)
 						{
@@ -378,7 +562,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 							//fichero << "Enviando petición de información a ID " << posicion.cliente_id_origen << endl;
 
 							// Y mandamos el mensaje al servidor
-							//rc = send(server_socket, buffer, sizeof(nombre_request) + sizeof(mensaje_t), 0);
+							//rc = send(server_socket, buffer, tamano_frame(MENSAJE_NOMBRE_REQUEST), 0);
 
 							if(rc <= 0)
 							{
@@ -407,7 +591,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 							nombre_request.cliente_id_destino = posicion.cliente_id_origen;
 							memcpy(&buffer[1],&nombre_request, sizeof(nombre_request));
 							//fichero << "Enviando petición de información a ID " << posicion.cliente_id_origen << endl;
-							send(sock, buffer, sizeof(nombre_request) + sizeof(mensaje_t), 0);
+							send(sock, buffer, tamano_frame(MENSAJE_NOMBRE_REQUEST), 0);
 						}*/
 						break;
 						}
@@ -419,7 +603,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 						pendientes */
 
 						// Leemos el resto del mensaje
-						rc = recv(server_socket, &reconocimiento, sizeof(reconocimiento), 0);
+						rc = recibir(&lector, &reconocimiento, sizeof(reconocimiento));
 
 						if(rc <= 0)
 						{
@@ -468,7 +652,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 							/*buffer[0] = MENSAJE_POSICION;
 							miPosicion.numero_secuencia = ++secuencia;
 							memcpy(&buffer[1], &miPosicion, sizeof(miPosicion));
-							send(sock, buffer, sizeof(miPosicion) + sizeof(mensaje_t), 0);
+							send(sock, buffer, tamano_frame(MENSAJE_POSICION), 0);
 							ticker = time_ms();*/
 							clientes_copia = clientes_conocidos;
 							nuevo_ciclo = true;
@@ -490,7 +674,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 
 							// Y mandamos el mensaje al servidor
 
-							rc = send(server_socket, buffer, sizeof(nombre_request) + sizeof(mensaje_t), 0);
+							rc = send(server_socket, buffer, tamano_frame(MENSAJE_NOMBRE_REQUEST), 0);
 
 							if(rc <= 0)
 							{
@@ -523,8 +707,8 @@ int cliente_thread(int grupo, string nombre_fichero)
 						nuevo_cliente.posicion_z = 0;
 
 						// Insertamos el nuevo cliente en nuestro contenedor
-						int id_aux = nuevo_saludo.cliente_id_origen;
-						clientes_conocidos.insert(pair<int,cliente_info>(id_aux, nuevo_cliente));
+						clienteid_t id_aux = nuevo_saludo.cliente_id_origen;
+						clientes_conocidos.insert(pair<clienteid_t,cliente_info>(id_aux, nuevo_cliente));
 						fichero << "Se ha conectado un nuevo miembro a GRUPO" << endl;
 						fichero << ">>> Conozco " << clientes_conocidos.size() << " clientes <<<" << endl;
 						break;
@@ -554,7 +738,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 
 						// Copiamos todos los datos al buffer y enviamos de vuelta al servidor
 						memcpy(&buffer[1], &nombre_reply, sizeof(nombre_reply));
-						rc = send(server_socket, buffer, sizeof(uint8_t) + sizeof(nombre_reply), 0);
+						rc = send(server_socket, buffer, tamano_frame(MENSAJE_NOMBRE_REPLY), 0);
 
 						if(rc <= 0)
 						{
@@ -591,10 +775,10 @@ int cliente_thread(int grupo, string nombre_fichero)
 						reply_info.posicion_z = 0;
 
 						// Añadimos el nuevo cliente al contenedor
-						int id_aux = nombre_reply.cliente_id_origen;
+						clienteid_t id_aux = nombre_reply.cliente_id_origen;
 						if(clientes_conocidos.find(id_aux) == clientes_conocidos.end())
 						{
-							clientes_conocidos.insert(pair<int,cliente_info>(id_aux, reply_info));
+							clientes_conocidos.insert(pair<clienteid_t,cliente_info>(id_aux, reply_info));
 						}
 
 						/*if(clientes_conocidos.size() > 9)
@@ -653,7 +837,7 @@ int cliente_thread(int grupo, string nombre_fichero)
 
 
 						// Buscamos el cliente desconectado en el contendor de la copia
-						map<int, cliente_info>::iterator busqueda = clientes_copia.find(desconexion.cliente_id_origen);
+						map<clienteid_t, cliente_info>::iterator busqueda = clientes_copia.find(desconexion.cliente_id_origen);
 
 						// Si lo encontramos en la copia, nos aseguramos que también está en el original. Borramos ambos
 						if(busqueda != clientes_copia.end())
@@ -704,18 +888,113 @@ int cliente_thread(int grupo, string nombre_fichero)
 						//fichero << "Aún espero " << clientes_copia.size() << " mensajes de reconocimiento más." << endl;
 
 						// Aparte, si este usuario desconectado era el último que esperábamos, empezamos un nuevo ciclo
-						if(clientes_copia.empty())
+						if(clientes_copia.empty() && !agregado && !instantaneas)
 						{
 							nuevo_ciclo = true;
 							/*buffer[0] = MENSAJE_POSICION;
 							miPosicion.numero_secuencia = ++secuencia;
 							memcpy(&buffer[1], &miPosicion, sizeof(miPosicion));
-							send(sock, buffer, sizeof(miPosicion) + sizeof(mensaje_t), 0);
+							send(sock, buffer, tamano_frame(MENSAJE_POSICION), 0);
 							ticker = time_ms();*/
 							clientes_copia = clientes_conocidos;
 						}
 						break;
 						}
+					case MENSAJE_CICLO_COMPLETO:
+						{
+						struct mensaje_ciclo_completo completo;
+
+						rc = recv(server_socket, &completo, sizeof(completo), MSG_WAITALL);
+
+						if(rc <= 0)
+						{
+							perror("[MENSAJE_CICLO_COMPLETO] recv() error");
+							close(server_socket);
+							return 0;
+						}
+
+						// Detrás vienen los IDs de quienes no respondieron a tiempo
+						vector<clienteid_t> faltan(completo.n_faltan);
+
+						if(completo.n_faltan > 0)
+						{
+							rc = recv(server_socket, faltan.data(), completo.n_faltan * sizeof(clienteid_t), MSG_WAITALL);
+
+							if(rc <= 0)
+							{
+								perror("[MENSAJE_CICLO_COMPLETO] recv() error");
+								close(server_socket);
+								return 0;
+							}
+						}
+
+						fichero << "[ID" << cliente_id << "] CICLO COMPLETO. SECUENCIA: " << completo.numero_secuencia <<
+																". ESPERADOS: " << completo.esperados << ". FALTAN: " << completo.n_faltan << endl;
+
+						for(uint j = 0; j < faltan.size(); j++)
+						{
+							fichero << "[ID" << cliente_id << "] SIN RECONOCIMIENTO DE " << faltan[j] << endl;
+						}
+
+						if(completo.numero_secuencia == secuencia)
+						{
+							fichero << " >>>>>>>>>>>>>>> Ciclo completo. Latencia de ciclo: " << time_ms() - ticker << endl;
+							nuevo_ciclo = true;
+						}
+						break;
+						}
+					case MENSAJE_INSTANTANEA:
+						{
+						struct mensaje_instantanea instantanea;
+
+						rc = recv(server_socket, &instantanea, sizeof(instantanea), MSG_WAITALL);
+
+						if(rc <= 0)
+						{
+							perror("[MENSAJE_INSTANTANEA] recv() error");
+							close(server_socket);
+							return 0;
+						}
+
+						vector<struct mensaje_posicion> posiciones(instantanea.n_posiciones);
+
+						if(instantanea.n_posiciones > 0)
+						{
+							rc = recv(server_socket, posiciones.data(), instantanea.n_posiciones * sizeof(struct mensaje_posicion), MSG_WAITALL);
+
+							if(rc <= 0)
+							{
+								perror("[MENSAJE_INSTANTANEA] recv() error");
+								close(server_socket);
+								return 0;
+							}
+						}
+
+						fichero << "[ID" << cliente_id << "] INSTANTÁNEA. TICK: " << instantanea.tick << ". POSICIONES: " << instantanea.n_posiciones << endl;
+
+						for(uint j = 0; j < posiciones.size(); j++)
+						{
+							if(posiciones[j].cliente_id_origen == cliente_id)
+							{
+								if(instantaneas && posiciones[j].numero_secuencia == secuencia)
+								{
+									fichero << " >>>>>>>>>>>>>>> Posición publicada. Latencia de ciclo: " << time_ms() - ticker << endl;
+									nuevo_ciclo = true;
+								}
+								continue;
+							}
+
+							map<clienteid_t, cliente_info>::iterator conocido = clientes_conocidos.find(posiciones[j].cliente_id_origen);
+
+							if(conocido != clientes_conocidos.end())
+							{
+								conocido->second.posicion_x = posiciones[j].posicion_x;
+								conocido->second.posicion_y = posiciones[j].posicion_y;
+								conocido->second.posicion_z = posiciones[j].posicion_z;
+							}
+						}
+						break;
+						}
 					default:
 						
 						fichero << "[ID" << cliente_id << " ERROR] Mensaje no reconocido." << endl;
@@ -740,6 +1019,9 @@ int cliente_thread(int grupo, string nombre_fichero)
 	sleep(1);
     shutdown(server_socket, SHUT_WR);
 	close(server_socket);
+
+	if(udp_socket >= 0)
+		close(udp_socket);
 	report_mutex.unlock();
 
 	return 0;
@@ -749,9 +1031,22 @@ int main(int argc, const char* argv[])
 {
 	vector<thread> hilos;
 
+	if(argc < 3)
+	{
+		cout << "Uso: " << argv[0] << " grupos clientes_por_grupo [agregado | instantaneas | udp]" << endl;
+		return -1;
+	}
+
 	int grupos = atoi(argv[1]);
 	int clientes_en_grupo = atoi(argv[2]);
 
+	/* El tercer argumento indica el modo del servidor: -a agrega los reconocimientos, -T envía instantáneas
+	y -u ofrece el canal UDP */
+	string modo = argc > 3 ? argv[3] : "";
+	agregado = (modo == "agregado");
+	instantaneas = (modo == "instantaneas");
+	udp = (modo == "udp");
+
 	for(int i = 0; i < grupos; i++)
 	{
 		for(int j = 0; j < clientes_en_grupo; j++)
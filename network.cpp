@@ -1,9 +1,18 @@
+#include <new>
+#include <algorithm>
+#include <poll.h>
+#include <inttypes.h>
+
 #include "network.h"
+#include "uring.h"
+#include "memoria.h"
+#include "metricas.h"
+#include "bitacora.h"
 
 
 using namespace std;
 
-int aio_socket_escucha(int puerto) {
+int aio_socket_escucha(int puerto, bool reuseport) {
 	int listen_sd, optval=1;
     struct sockaddr_in serveraddr;
 
@@ -18,6 +27,13 @@ int aio_socket_escucha(int puerto) {
         exit(-1);
     }
 
+    // Con SO_REUSEPORT varios sockets comparten puerto y el kernel reparte las conexiones entre ellos
+    if (reuseport && setsockopt(listen_sd, SOL_SOCKET, SO_REUSEPORT,
+                   (const void *)&optval , sizeof(int)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(-1);
+    }
+
     memset(&serveraddr, 0, sizeof(serveraddr));
     serveraddr.sin_family = AF_INET;
     serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -39,72 +55,731 @@ int aio_socket_escucha(int puerto) {
     return listen_sd;
 }
 
+int udp_socket_escucha(int puerto) {
+    int udp_sd;
+    struct sockaddr_in serveraddr;
+
+    if ((udp_sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket()");
+        exit(-1);
+    }
+
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short) puerto);
+
+    if (bind(udp_sd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+        perror("bind");
+        exit(-1);
+    }
+
+    return udp_sd;
+}
+
+struct mensaje_compartido * mensaje_crear(const void * buffer, int length)
+{
+    struct mensaje_compartido *mensaje = (struct mensaje_compartido *) malloc(sizeof(struct mensaje_compartido) + length);
+
+    new (&mensaje->referencias) atomic<int>(1);
+    mensaje->longitud = length;
+    mensaje->clave = 0;
+    mensaje->alternativa = NULL;
+    mensaje->datos = (char *) (mensaje + 1);
+    memcpy(mensaje->datos, buffer, length);
+
+    return mensaje;
+}
+
+void mensaje_retener(struct mensaje_compartido * mensaje)
+{
+    mensaje->referencias.fetch_add(1, memory_order_relaxed);
+}
+
+void mensaje_liberar(struct mensaje_compartido * mensaje)
+{
+    if(mensaje->referencias.fetch_sub(1, memory_order_acq_rel) == 1)
+    {
+        if(mensaje->alternativa != NULL)
+            mensaje_liberar(mensaje->alternativa);
+
+        free(mensaje);
+    }
+}
+
+// Bytes que puede acumular la cola de salida de un cliente antes de considerarlo saturado
+static int limite_salida = LIMITE_SALIDA_DEFECTO;
+
+// Si el hilo está dentro de un lote (ver async_lote_iniciar()) y la hora del lote, 0 si aún no se ha leído
+static thread_local bool lote_activo = false;
+static thread_local uint32_t ahora_lote = 0;
+
+void async_limite_salida(int bytes)
+{
+    limite_salida = bytes;
+}
+
+/* Registra el cliente en epollfd. EPOLLOUT sólo se pide mientras haya algo en la cola de salida;
+con la cola vacía cada ACK del cliente despertaría al shard para nada */
+int async_registrar(struct epoll_data_client* data, int epollfd, int operacion)
+{
+    struct epoll_event event;
+
+    data->epollfd = epollfd;
+    data->epollout = data->salida_cuenta > 0;
+
+    event.events = EVENTOS_CLIENTE | (data->epollout ? (uint32_t) EPOLLOUT : 0);
+    event.data.ptr = data;
+
+    return epoll_ctl(epollfd, operacion, data->socketfd, &event);
+}
+
+static void armar_epollout(struct epoll_data_client* data, bool armar)
+{
+    if(data->epollout == armar || data->epollfd < 0)
+        return;
+
+    if(async_registrar(data, data->epollfd, EPOLL_CTL_MOD) < 0)
+    {
+        perror("armar_epollout->epoll_ctl()");
+    }
+}
+
+/* La cola de salida es un anillo de referencias a mensajes. Empieza vacío y dobla su capacidad
+cuando se llena, desenrollando las entradas para que vuelvan a empezar en la posición 0. La memoria
+sale de los buffers por clase de tamaño y se devuelve en cuanto la cola se vacía */
+static void crecer_salida(struct epoll_data_client* data)
+{
+    int capacidad = data->salida_capacidad ? data->salida_capacidad * 2 : COLA_SALIDA_INICIAL;
+    int bytes;
+    struct entrada_salida *cola = (struct entrada_salida *) buffer_obtener(capacidad * sizeof(struct entrada_salida), &bytes);
+
+    for(int i = 0; i < data->salida_cuenta; i++)
+    {
+        cola[i] = data->cola_salida[(data->salida_inicio + i) & (data->salida_capacidad - 1)];
+    }
+
+    buffer_devolver((char *) data->cola_salida, data->salida_capacidad * sizeof(struct entrada_salida));
+    data->cola_salida = cola;
+    data->salida_capacidad = capacidad;
+    data->salida_inicio = 0;
+}
+
+/* Envío en curso de un cliente con io_uring. El kernel lee msg e iov hasta que llega la completada, y
+las en_vuelo primeras entradas de la cola de salida, que son las que cubre, no se pueden tocar hasta entonces */
+struct envio_uring {
+    struct msghdr   msg;
+    struct iovec    iov[IOV_LOTE];
+    int             en_vuelo;
+    int             bytes;
+};
+
+static thread_local struct anillo_uring *uring_hilo = NULL;
+
+static bool usar_conflacion = true;
+
+void async_conflacion(bool activar)
+{
+    usar_conflacion = activar;
+}
+
+/* Si en la cola hay un mensaje con la misma clave que aún no se ha empezado a enviar, el nuevo ocupa
+su sitio. Cada entrada se identifica por su número absoluto de encolado (salida_base es el de la
+primera), así que el índice de claves no se toca al crecer el anillo ni al enviar; las entradas que
+ya han salido de la cola simplemente quedan fuera de rango. Si el nuevo es un delta, el destinatario
+no llegará a tener la base contra la que se codificó, así que entra su versión completa */
+static bool sustituir_salida(struct epoll_data_client* data, struct mensaje_compartido * mensaje)
+{
+    if(data->salida_claves == NULL)
+        return false;
+
+    unordered_map<clienteid_t, uint64_t>::iterator it = data->salida_claves->find(mensaje->clave);
+
+    if(it == data->salida_claves->end() || it->second < data->salida_base)
+        return false;
+
+    uint64_t posicion = it->second - data->salida_base;
+
+    if(posicion >= (uint64_t) data->salida_cuenta)
+        return false;
+
+    if(data->uring_envio != NULL && posicion < (uint64_t) data->uring_envio->en_vuelo)
+        return false;
+
+    struct entrada_salida *entrada = &data->cola_salida[(data->salida_inicio + posicion) & (data->salida_capacidad - 1)];
+
+    if(entrada->enviado != 0 || entrada->mensaje->clave != mensaje->clave)
+        return false;
+
+    if(mensaje->alternativa != NULL)
+        mensaje = mensaje->alternativa;
+
+    data->salida_bytes += mensaje->longitud - entrada->mensaje->longitud;
+    mensaje_retener(mensaje);
+    mensaje_liberar(entrada->mensaje);
+    entrada->mensaje = mensaje;
+
+    return true;
+}
+
+static int politica_lento = LENTO_NINGUNA;
+static int umbral_lento = LENTO_UMBRAL_DEFECTO_MS;
+
+void async_politica_lento(int politica, int umbral_ms)
+{
+    politica_lento = politica;
+    umbral_lento = umbral_ms;
+}
+
+/* Dentro de un lote se lee el reloj una sola vez, la primera vez que hace falta: el lote empieza antes
+de que el shard se bloquee esperando eventos, así que la hora de async_lote_iniciar() no valdría */
+static inline uint32_t ahora_ms()
+{
+    if(!lote_activo)
+        return reloj_ms();
+
+    if(ahora_lote == 0)
+        ahora_lote = reloj_ms();
+
+    return ahora_lote;
+}
+
+// Milisegundos que lleva en cola el mensaje más antiguo pendiente de enviar al cliente
+int async_retraso_ms(struct epoll_data_client* data)
+{
+    if(data->salida_cuenta == 0)
+        return 0;
+
+    return (int) (ahora_ms() - data->cola_salida[data->salida_inicio].encolado);
+}
+
+/* Indica si el cliente, por ir atrasado, debe quedarse sin la actualización de estado que se le iba a
+enviar. Es quien difunde el que decide no encolarla, porque es quien sabe qué base de delta tiene cada
+destinatario: si se le salta una posición, la siguiente le llegará completa */
+bool async_lento_descarta(struct epoll_data_client* data)
+{
+    if(politica_lento != LENTO_DESCARTAR && politica_lento != LENTO_DIEZMAR)
+        return false;
+
+    if(async_retraso_ms(data) <= umbral_lento)
+        return false;
+
+    if(politica_lento == LENTO_DESCARTAR)
+    {
+        METRICA_SUMAR(metricas_hilo->lento_descartados, 1);
+        return true;
+    }
+
+    if(data->lento_cuenta++ % LENTO_DIEZMADO == 0)
+        return false;
+
+    METRICA_SUMAR(metricas_hilo->lento_diezmados, 1);
+    return true;
+}
+
+/* Añade a la cola de salida lo que queda por enviar de mensaje a partir del byte enviado. Todos los
+envíos a un cliente unido a su grupo pasan por aquí y quien recibe WRITE_SATURADO lo desconecta, así
+que con LENTO_DESCONECTAR cada atrasado que se cuenta es una baja. La política se mira antes de la
+conflación: sustituir un mensaje no adelanta la cola, que sigue igual de atrasada */
+static int encolar_salida(struct epoll_data_client* data, struct mensaje_compartido * mensaje, int enviado)
+{
+    bool conflable = usar_conflacion && mensaje->clave != 0 && enviado == 0;
+
+    if(politica_lento == LENTO_DESCONECTAR && async_retraso_ms(data) > umbral_lento)
+    {
+        METRICA_SUMAR(metricas_hilo->lento_desconectados, 1);
+        return WRITE_SATURADO;
+    }
+
+    if(conflable && data->salida_cuenta > 0 && sustituir_salida(data, mensaje))
+    {
+        return 0;
+    }
+
+    if(data->salida_bytes + mensaje->longitud - enviado > limite_salida)
+    {
+        return WRITE_SATURADO;
+    }
+
+    if(data->salida_cuenta == data->salida_capacidad)
+    {
+        crecer_salida(data);
+    }
+
+    int indice = (data->salida_inicio + data->salida_cuenta) & (data->salida_capacidad - 1);
+
+    mensaje_retener(mensaje);
+    data->cola_salida[indice].mensaje = mensaje;
+    data->cola_salida[indice].enviado = enviado;
+    data->cola_salida[indice].encolado = ahora_ms();
+
+    if(conflable)
+    {
+        if(data->salida_claves == NULL)
+            data->salida_claves = new unordered_map<clienteid_t, uint64_t>();
+
+        (*data->salida_claves)[mensaje->clave] = data->salida_base + data->salida_cuenta;
+    }
+
+    data->salida_cuenta++;
+    data->salida_bytes += mensaje->longitud - enviado;
+
+    return 0;
+}
+
+/* Durante un lote las escrituras sólo se encolan y el cliente se apunta en la lista de sucios del
+hilo. Al terminar el lote cada cliente sucio se vacía una sola vez con writev(), de modo que los N
+mensajes que recibe en una misma vuelta de epoll_wait() le cuestan una llamada en lugar de N */
+static thread_local struct epoll_data_client *lote_sucios = NULL;
+static bool usar_cork = false;
+
+static void marcar_sucio(struct epoll_data_client* data)
+{
+    if(data->sucio)
+        return;
+
+    data->sucio = true;
+    data->siguiente_sucio = lote_sucios;
+    lote_sucios = data;
+}
+
+void async_cork(bool activar)
+{
+    usar_cork = activar;
+}
+
+void async_lote_iniciar()
+{
+    lote_activo = true;
+    ahora_lote = 0;
+}
+
+void async_lote_terminar(manejador_fallo fallo, void * contexto)
+{
+    int activar = 1, desactivar = 0;
+
+    lote_activo = false;
+
+    while(lote_sucios != NULL)
+    {
+        struct epoll_data_client *data = lote_sucios;
+
+        lote_sucios = data->siguiente_sucio;
+        data->sucio = false;
+
+        if(data->estado == CLIENTE_DESCONECTADO)
+            continue;
+
+        if(data->uring_activo)
+        {
+            async_write_delay(data);
+            histograma_registrar(&metricas_hilo->profundidad_cola, data->salida_cuenta);
+
+            if(data->salida_cuenta > 0)
+                histograma_registrar(&metricas_hilo->retraso_cola, async_retraso_ms(data));
+            continue;
+        }
+
+        // Si la cola no cabe en un solo writev(), TCP_CORK evita que cada llamada salga en segmentos a medio llenar
+        bool cork = usar_cork && data->salida_cuenta > IOV_LOTE;
+
+        if(cork)
+            setsockopt(data->socketfd, IPPROTO_TCP, TCP_CORK, &activar, sizeof(activar));
+
+        int rc = async_write_delay(data);
+
+        if(cork)
+            setsockopt(data->socketfd, IPPROTO_TCP, TCP_CORK, &desactivar, sizeof(desactivar));
+
+        // El socket ya no sirve: lo da de baja quien lleva el cliente, como cualquier otro envío fallido
+        if(rc < 0)
+        {
+            fallo(data, contexto);
+            continue;
+        }
+
+        histograma_registrar(&metricas_hilo->profundidad_cola, data->salida_cuenta);
+
+        if(data->salida_cuenta > 0)
+            histograma_registrar(&metricas_hilo->retraso_cola, async_retraso_ms(data));
+    }
+}
+
 int async_write(struct epoll_data_client* data, void* buffer, int length)
+{
+    if(lote_activo)
+    {
+        struct mensaje_compartido *mensaje = mensaje_crear(buffer, length);
+        int rc = async_write_compartido(data, mensaje);
+
+        mensaje_liberar(mensaje);
+        return rc;
+    }
+
+    return async_write_directo(data, buffer, length);
+}
+
+// Tipo del mensaje para las métricas; los que no son del protocolo se cuentan en la posición 0
+static inline int tipo_salida(const void *datos)
+{
+    unsigned char tipo = *(const unsigned char *) datos;
+
+    return tipo <= MENSAJE_MAX ? tipo : 0;
+}
+
+static inline void contar_envio(int rc, int total)
+{
+    METRICA_SUMAR(metricas_hilo->llamadas_envio, 1);
+
+    if(rc > 0)
+        METRICA_SUMAR(metricas_hilo->bytes_salida, rc);
+
+    if(rc >= 0 && rc < total)
+        METRICA_SUMAR(metricas_hilo->envios_parciales, 1);
+}
+
+/* Si no hay nada pendiente se intenta enviar directamente; lo que el socket no acepte se guarda en
+la cola de salida para async_write_delay() */
+int async_write_directo(struct epoll_data_client* data, void* buffer, int length)
 {
     int rc = 0;
-    //if(data->write_count == 0)
-    //{
+
+    METRICA_SUMAR(metricas_hilo->mensajes_salida[tipo_salida(buffer)], 1);
+
+    if(data->salida_cuenta == 0)
+    {
         rc = send(data->socketfd, buffer, length, MSG_NOSIGNAL);
-      //  if(rc == length)
+        contar_envio(rc, length);
+
+        if(rc == length)
             return rc;
-    //}
-    memcpy(data->write_buffer + data->write_count, buffer + rc, length - rc);
-    data->write_count += length - rc;
-    
-    rc = async_write_delay(data);
+
+        if(rc < 0)
+        {
+            if(errno != EWOULDBLOCK && errno != EAGAIN)
+            {
+                BITACORA(BITACORA_AVISO, "Error enviando a ClienteID: %" PRIu64, data->clienteid);
+                return WRITE_ERROR;
+            }
+            rc = 0;
+        }
+    }
+
+    struct mensaje_compartido *resto = mensaje_crear((char *) buffer + rc, length - rc);
+
+    rc = encolar_salida(data, resto, 0);
+    mensaje_liberar(resto);
 
     if(rc < 0)
+        return rc;
+
+    return async_write_delay(data);
+}
+
+int async_write_compartido(struct epoll_data_client* data, struct mensaje_compartido * mensaje)
+{
+    int rc = 0;
+
+    METRICA_SUMAR(metricas_hilo->mensajes_salida[tipo_salida(mensaje->datos)], 1);
+
+    if(lote_activo)
     {
-        cout << "Error enviando a ClienteID: " << data->socketfd << endl;
+        rc = encolar_salida(data, mensaje, 0);
+
+        if(rc == 0)
+            marcar_sucio(data);
+
+        return rc;
     }
 
-    return rc;
+    if(data->salida_cuenta == 0)
+    {
+        rc = send(data->socketfd, mensaje->datos, mensaje->longitud, MSG_NOSIGNAL);
+        contar_envio(rc, mensaje->longitud);
+
+        if(rc == mensaje->longitud)
+            return rc;
+
+        if(rc < 0)
+        {
+            if(errno != EWOULDBLOCK && errno != EAGAIN)
+            {
+                BITACORA(BITACORA_AVISO, "Error enviando a ClienteID: %" PRIu64, data->clienteid);
+                return WRITE_ERROR;
+            }
+            rc = 0;
+        }
+    }
+
+    rc = encolar_salida(data, mensaje, rc);
+
+    if(rc < 0)
+        return rc;
+
+    return async_write_delay(data);
+}
+
+// Libera los mensajes enviados por completo y avanza el primero que haya quedado a medias
+static void consumir_salida(struct epoll_data_client* data, int rc)
+{
+    int mascara = data->salida_capacidad - 1;
+
+    data->salida_bytes -= rc;
+
+    while(rc > 0)
+    {
+        struct entrada_salida *entrada = &data->cola_salida[data->salida_inicio];
+        int pendiente = entrada->mensaje->longitud - entrada->enviado;
+
+        if(rc < pendiente)
+        {
+            entrada->enviado += rc;
+            break;
+        }
+
+        rc -= pendiente;
+        mensaje_liberar(entrada->mensaje);
+        data->salida_inicio = (data->salida_inicio + 1) & mascara;
+        data->salida_cuenta--;
+        data->salida_base++;
+    }
+
+    // Un cliente al día no retiene cola: las claves que quedan ya no apuntan a nada pendiente
+    if(data->salida_cuenta == 0)
+    {
+        buffer_devolver((char *) data->cola_salida, data->salida_capacidad * sizeof(struct entrada_salida));
+        data->cola_salida = NULL;
+        data->salida_capacidad = 0;
+        data->salida_inicio = 0;
+
+        if(data->salida_claves != NULL)
+            data->salida_claves->clear();
+    }
 }
 
+/* Con io_uring la cola se envía con un sendmsg() en el anillo, hasta IOV_LOTE mensajes, que sale con la
+llamada que espera las completadas de la vuelta. Sólo hay un envío en curso por cliente; al completarse
+se prepara el siguiente con lo que se haya encolado entretanto. Si el socket estaba lleno, el reintento
+va enlazado detrás de un poll que espera a que admita datos */
+static void preparar_envio(struct epoll_data_client* data, bool esperar)
+{
+    int mascara = data->salida_capacidad - 1;
+
+    if(data->salida_cuenta == 0 || (data->uring_envio != NULL && data->uring_envio->en_vuelo > 0))
+        return;
+
+    if(data->uring_envio == NULL)
+    {
+        int capacidad;
+        data->uring_envio = (struct envio_uring *) buffer_obtener(sizeof(struct envio_uring), &capacidad);
+    }
+
+    struct envio_uring *envio = data->uring_envio;
+    int n = data->salida_cuenta < IOV_LOTE ? data->salida_cuenta : IOV_LOTE;
+
+    envio->bytes = 0;
+
+    for(int i = 0; i < n; i++)
+    {
+        struct entrada_salida *entrada = &data->cola_salida[(data->salida_inicio + i) & mascara];
+        envio->iov[i].iov_base = entrada->mensaje->datos + entrada->enviado;
+        envio->iov[i].iov_len = entrada->mensaje->longitud - entrada->enviado;
+        envio->bytes += envio->iov[i].iov_len;
+    }
+
+    memset(&envio->msg, 0, sizeof(envio->msg));
+    envio->msg.msg_iov = envio->iov;
+    envio->msg.msg_iovlen = n;
+    envio->en_vuelo = n;
+
+    struct io_uring_sqe *sqe;
+
+    if(esperar)
+    {
+        sqe = uring_sqe(uring_hilo);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = data->uring_fichero >= 0 ? data->uring_fichero : data->socketfd;
+        sqe->flags = (data->uring_fichero >= 0 ? IOSQE_FIXED_FILE : 0) | IOSQE_IO_LINK;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = URING_DATOS(data, URING_OP_ESPERA);
+    }
+
+    sqe = uring_sqe(uring_hilo);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = data->uring_fichero >= 0 ? data->uring_fichero : data->socketfd;
+    sqe->flags = data->uring_fichero >= 0 ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uint64_t) (uintptr_t) &envio->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_DATOS(data, URING_OP_ENVIO);
+}
+
+// Vacía la cola de salida con writev(), hasta IOV_LOTE mensajes por llamada
 int async_write_delay(struct epoll_data_client* data)
 {
-    int rc;
+    struct iovec iov[IOV_LOTE];
+    int rc, mascara = data->salida_capacidad - 1;
 
-    if(data->write_count == 0)
+    if(data->uring_activo)
+    {
+        preparar_envio(data, false);
         return 0;
+    }
 
-    do
+    while(data->salida_cuenta > 0)
     {
-        //cout << "Van a escribirse " << data->write_count << endl;
-        //assert(data->write_count > 0);
-        rc = send(data->socketfd, data->write_buffer, data->write_count, MSG_NOSIGNAL);
+        int n = data->salida_cuenta < IOV_LOTE ? data->salida_cuenta : IOV_LOTE;
+
+        int total = 0;
+
+        for(int i = 0; i < n; i++)
+        {
+            struct entrada_salida *entrada = &data->cola_salida[(data->salida_inicio + i) & mascara];
+            iov[i].iov_base = entrada->mensaje->datos + entrada->enviado;
+            iov[i].iov_len = entrada->mensaje->longitud - entrada->enviado;
+            total += iov[i].iov_len;
+        }
+
+        rc = writev(data->socketfd, iov, n);
+        contar_envio(rc, total);
 
         if(rc < 0)
         {
             if( errno == EWOULDBLOCK || errno == EAGAIN)
             {
-                return 0;
+                break;
             }
-            perror("async_write_delay->send()");
-            return -1;
+            perror("async_write_delay->writev()");
+            return WRITE_ERROR;
         }
 
         if(rc == 0)
         {
-            return 0;
+            break;
         }
 
-        //cout << "Escritos " << rc << " bytes. Quedan " << data->write_count - rc << " bytes." << endl;
+        consumir_salida(data, rc);
+    }
+
+    armar_epollout(data, data->salida_cuenta > 0);
 
-        data->write_count = data->write_count - rc;
-        memcpy(data->write_buffer, data->write_buffer + rc, data->write_count);
-    } while(rc > 0 && data->write_count > 0);
+    return 0;
+}
+
+/* Los frames se procesan sobre el buffer de lectura del hilo, que comparten todos sus clientes. Un
+cliente sólo tiene buffer propio, de la clase de tamaño justa, mientras le quedan datos sin procesar
+entre dos recepciones: un frame a medias o lo que el manejador ha dejado para después. Así un cliente
+parado no ocupa memoria de lectura */
+static thread_local char lectura_hilo[BUFFER_LECTURA_HILO];
+
+// Lleva lo pendiente del cliente al principio del buffer del hilo, para recibir a continuación
+static void leer_en_hilo(struct epoll_data_client * data)
+{
+    int pendiente = data->read_fin - data->read_inicio;
+
+    if(data->read_buffer == lectura_hilo)
+        return;
+
+    if(pendiente > 0)
+        memcpy(lectura_hilo, data->read_buffer + data->read_inicio, pendiente);
+
+    buffer_devolver(data->read_buffer, data->read_capacidad);
+
+    data->read_buffer = lectura_hilo;
+    data->read_capacidad = BUFFER_LECTURA_HILO;
+    data->read_inicio = 0;
+    data->read_fin = pendiente;
+}
+
+// Deja lo pendiente, si queda algo, al principio de un buffer propio del cliente
+static void guardar_pendiente(struct epoll_data_client * data)
+{
+    int pendiente = data->read_fin - data->read_inicio;
+
+    if(pendiente == 0)
+    {
+        if(data->read_buffer != lectura_hilo)
+            buffer_devolver(data->read_buffer, data->read_capacidad);
+
+        data->read_buffer = NULL;
+        data->read_capacidad = 0;
+    }
+    else if(data->read_buffer == lectura_hilo)
+    {
+        data->read_buffer = buffer_obtener(pendiente, &data->read_capacidad);
+        memcpy(data->read_buffer, lectura_hilo + data->read_inicio, pendiente);
+    }
+    else if(data->read_inicio > 0)
+    {
+        memmove(data->read_buffer, data->read_buffer + data->read_inicio, pendiente);
+    }
+
+    data->read_inicio = 0;
+    data->read_fin = pendiente;
+}
+
+/* Entrega al manejador todos los frames completos que ya estén en el buffer, sin llamadas al sistema.
+La longitud de cada frame sale de la tabla de descriptores de mensajes.h; un byte de tipo
+desconocido se descarta, igual que hacía la lectura byte a byte. Lo que queda es como
+mucho un frame a medias, que se guarda en el buffer propio del cliente para la siguiente recepción */
+int async_procesar_frames(struct epoll_data_client * data, manejador_frame manejador, void * contexto)
+{
+    int rc = READ_BLOCK;
+
+    while(data->read_inicio < data->read_fin && data->estado != CLIENTE_DESCONECTADO)
+    {
+        char *frame = data->read_buffer + data->read_inicio;
+        int disponible = data->read_fin - data->read_inicio;
+        int longitud = tamano_frame(frame[0]);
+
+        if(longitud == 0)
+        {
+            data->read_inicio++;
+            continue;
+        }
+
+        if(longitud > disponible)
+            break;
+
+        data->read_inicio += longitud;
+        METRICA_SUMAR(metricas_hilo->mensajes_entrada[(unsigned char) frame[0]], 1);
+
+        if(manejador(data, frame, longitud, contexto) != 0)
+        {
+            rc = READ_SUCCESS;
+            break;
+        }
+    }
+
+    guardar_pendiente(data);
 
     return rc;
 }
 
-int async_read(struct epoll_data_client *data, void *buffer, int length)
+/* Lee del socket en bloques tan grandes como quepan en el buffer y procesa todos los frames que
+contengan. Una lectura que no llena el hueco significa que el socket se ha vaciado, y como los
+clientes están en modo edge-triggered cualquier dato nuevo generará otro evento: no hace falta la
+llamada extra que acabaría en EAGAIN */
+int async_read_frames(struct epoll_data_client * data, manejador_frame manejador, void * contexto)
 {
     int rc;
 
+    rc = async_procesar_frames(data, manejador, contexto);
+
+    if(rc != READ_BLOCK)
+        return rc;
+
     do
     {
-        rc = read(data->socketfd, data->read_buffer_ptr, data->read_count);
+        leer_en_hilo(data);
+
+        int hueco = BUFFER_LECTURA_HILO - data->read_fin;
+
+        rc = recv(data->socketfd, data->read_buffer + data->read_fin, hueco, 0);
+        METRICA_SUMAR(metricas_hilo->llamadas_recepcion, 1);
+
+        if(rc <= 0)
+            guardar_pendiente(data);
 
         if(rc < 0)
         {
@@ -113,74 +788,388 @@ int async_read(struct epoll_data_client *data, void *buffer, int length)
                 return READ_BLOCK;
             }
 
-            perror("async_read->read()");
-            cout << "async_read() error: " << data->socketfd << endl;
+            perror("async_read_frames->recv()");
+            BITACORA(BITACORA_AVISO, "async_read_frames() error: %d", data->socketfd);
 
             return READ_ERROR;
         }
 
-        if( rc == 0)
+        if(rc == 0)
         {
             return READ_CLOSE;
         }
 
-        data->read_count -= rc;
-        data->read_buffer_ptr += rc;
-        data->read_count_total += rc;
+        data->read_fin += rc;
+        METRICA_SUMAR(metricas_hilo->bytes_entrada, rc);
+
+        int procesado = async_procesar_frames(data, manejador, contexto);
+
+        if(procesado != READ_BLOCK)
+            return procesado;
+
+        if(rc < hueco)
+            return READ_BLOCK;
+
+    } while(data->estado != CLIENTE_DESCONECTADO);
+
+    return READ_BLOCK;
+}
+
+
+/* Lee los datagramas pendientes en lotes de UDP_LOTE con recvmmsg(). Los que no caben en
+UDP_MAX_DATAGRAMA no son de este protocolo y se descartan */
+void udp_recibir(struct canal_udp * canal, manejador_datagrama manejador, void * contexto)
+{
+    static thread_local char datagramas[UDP_LOTE][UDP_MAX_DATAGRAMA];
+    struct sockaddr_in origenes[UDP_LOTE];
+    struct mmsghdr mensajes[UDP_LOTE];
+    struct iovec iov[UDP_LOTE];
+    int n;
+
+    do
+    {
+        memset(mensajes, 0, sizeof(mensajes));
+
+        for(int i = 0; i < UDP_LOTE; i++)
+        {
+            iov[i].iov_base = datagramas[i];
+            iov[i].iov_len = UDP_MAX_DATAGRAMA;
+            mensajes[i].msg_hdr.msg_iov = &iov[i];
+            mensajes[i].msg_hdr.msg_iovlen = 1;
+            mensajes[i].msg_hdr.msg_name = &origenes[i];
+            mensajes[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        n = recvmmsg(canal->socketfd, mensajes, UDP_LOTE, MSG_DONTWAIT, NULL);
+
+        if(n < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("udp_recibir->recvmmsg()");
+            return;
+        }
+
+        METRICA_SUMAR(metricas_hilo->datagramas_entrada, n);
+
+        for(int i = 0; i < n; i++)
+        {
+            if(!(mensajes[i].msg_hdr.msg_flags & MSG_TRUNC))
+                manejador(datagramas[i], mensajes[i].msg_len, &origenes[i], contexto);
+        }
+
+    } while(n == UDP_LOTE);
+}
+
+void udp_encolar(struct canal_udp * canal, const struct sockaddr_in * destino, struct mensaje_compartido * mensaje)
+{
+    struct datagrama_salida datagrama;
+
+    mensaje_retener(mensaje);
+    datagrama.destino = *destino;
+    datagrama.mensaje = mensaje;
+    canal->salida.push_back(datagrama);
+}
+
+/* Envía los datagramas acumulados en lotes de UDP_LOTE con sendmmsg(). Si el buffer del socket se
+llena, el resto se descarta: una posición o un reconocimiento perdido lo sustituye el siguiente */
+void udp_vaciar(struct canal_udp * canal)
+{
+    struct mmsghdr mensajes[UDP_LOTE];
+    struct iovec iov[UDP_LOTE];
+    bool lleno = false;
+    size_t salidos = 0;
+
+    for(size_t inicio = 0; inicio < canal->salida.size() && !lleno; inicio += UDP_LOTE)
+    {
+        int n = min((int) (canal->salida.size() - inicio), UDP_LOTE);
+        int enviados = 0;
+
+        memset(mensajes, 0, n * sizeof(struct mmsghdr));
 
-        if(!data->tipo_mensaje_read)
+        for(int i = 0; i < n; i++)
         {
-            data->tipo_mensaje_read = true;
-            switch (data->read_buffer[0])
+            struct datagrama_salida *datagrama = &canal->salida[inicio + i];
+
+            iov[i].iov_base = datagrama->mensaje->datos;
+            iov[i].iov_len = datagrama->mensaje->longitud;
+            mensajes[i].msg_hdr.msg_iov = &iov[i];
+            mensajes[i].msg_hdr.msg_iovlen = 1;
+            mensajes[i].msg_hdr.msg_name = &datagrama->destino;
+            mensajes[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        while(enviados < n)
+        {
+            int rc = sendmmsg(canal->socketfd, &mensajes[enviados], n - enviados, MSG_DONTWAIT);
+
+            if(rc < 0)
             {
-            case MENSAJE_CONEXION:
-                data->read_count = sizeof(struct mensaje_conexion);
-                break;
-            case MENSAJE_SALUDO:
-                data->read_count = sizeof(struct mensaje_saludo);
-                break;
-            case MENSAJE_POSICION:
-                data->read_count = sizeof(struct mensaje_posicion);
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("udp_vaciar->sendmmsg()");
+                lleno = true;
                 break;
-            case MENSAJE_RECONOCIMIENTO:
-                data->read_count = sizeof(struct mensaje_reconocimiento);
-                break;
-            case MENSAJE_NOMBRE_REQUEST:
-                data->read_count = sizeof(struct mensaje_nombre_request);
-                break;
-            case MENSAJE_NOMBRE_REPLY:
-                data->read_count = sizeof(struct mensaje_nombre_reply);
-                break;
-            default:
-                data->read_count = 1;
-                data->tipo_mensaje_read = false;
             }
+
+            enviados += rc;
         }
 
-        if(data->read_count == 0)
+        salidos += enviados;
+    }
+
+    METRICA_SUMAR(metricas_hilo->datagramas_salida, salidos);
+    METRICA_SUMAR(metricas_hilo->datagramas_descartados, canal->salida.size() - salidos);
+
+    for(size_t i = 0; i < canal->salida.size(); i++)
+    {
+        mensaje_liberar(canal->salida[i].mensaje);
+    }
+
+    canal->salida.clear();
+}
+
+void async_uring(struct anillo_uring * anillo)
+{
+    uring_hilo = anillo;
+}
+
+static void armar_recepcion(struct epoll_data_client * data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(uring_hilo);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = data->uring_fichero >= 0 ? data->uring_fichero : data->socketfd;
+    sqe->flags = (data->uring_fichero >= 0 ? IOSQE_FIXED_FILE : 0) | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GRUPO_BUFFERS;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = URING_DATOS(data, URING_OP_RECV);
+
+    data->uring_recibiendo = true;
+}
+
+/* Pasa al anillo del hilo un cliente que deja el epoll: su socket ocupa un hueco de la tabla de
+ficheros registrados, si queda alguno, y queda armada una recepción multishot que dura mientras el
+kernel no la dé por terminada */
+void async_uring_registrar(struct epoll_data_client * data)
+{
+    data->uring_activo = true;
+    data->uring_fichero = uring_fichero_alta(uring_hilo, data->socketfd);
+    data->epollfd = -1;
+    data->epollout = false;
+
+    armar_recepcion(data);
+    preparar_envio(data, false);
+}
+
+/* Completada de la recepción de un cliente. Los datos están en un buffer proporcionado, que se copia
+al buffer de lectura del hilo detrás de lo que tuviera pendiente el cliente, por si un frame ha quedado
+a caballo entre dos recepciones, y se devuelve al anillo en cuanto se ha copiado. Devuelve lo mismo
+que async_read_frames() */
+int async_uring_recibido(struct epoll_data_client * data, int res, unsigned flags, manejador_frame manejador, void * contexto)
+{
+    int rc = READ_BLOCK;
+
+    METRICA_SUMAR(metricas_hilo->llamadas_recepcion, 1);
+
+    if(!(flags & IORING_CQE_F_MORE))
+        data->uring_recibiendo = false;
+
+    if(flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        char *datos = uring_buffer(uring_hilo, id);
+        int longitud = res;
+
+        METRICA_SUMAR(metricas_hilo->bytes_entrada, res);
+
+        while(longitud > 0 && rc == READ_BLOCK && data->estado != CLIENTE_DESCONECTADO)
         {
-#ifdef _DEBUG_
-            //printf("Recibido mensaje completo. Tamaño: %d\n", data->read_count_total);
-#endif
-            memcpy(buffer, data->read_buffer, length);
-            data->read_buffer_ptr = data->read_buffer;
-            data->tipo_mensaje_read = false;
-            data->read_count = 1;
-            data->read_count_total = 0;
-            return READ_SUCCESS;
+            leer_en_hilo(data);
+
+            int n = min(BUFFER_LECTURA_HILO - data->read_fin, longitud);
+
+            if(n == 0)
+            {
+                guardar_pendiente(data);
+                rc = READ_ERROR;
+                break;
+            }
+
+            memcpy(data->read_buffer + data->read_fin, datos, n);
+            data->read_fin += n;
+            datos += n;
+            longitud -= n;
+
+            rc = async_procesar_frames(data, manejador, contexto);
         }
-    } while(rc > 0);
 
-    return READ_ERROR;
+        uring_buffer_devolver(uring_hilo, id);
+    }
+
+    if(data->estado == CLIENTE_DESCONECTADO)
+        return READ_BLOCK;
+
+    if(res == 0)
+        return READ_CLOSE;
+
+    // Sin buffers libres el kernel termina la recepción; se vuelve a armar y esperará a que haya
+    if(res < 0 && res != -ENOBUFS)
+        return READ_ERROR;
+
+    if(!(flags & IORING_CQE_F_MORE))
+        armar_recepcion(data);
+
+    return rc;
+}
+
+/* Completada del envío de un cliente: se consume de la cola lo enviado y se prepara el siguiente envío.
+Un socket lleno devuelve -EAGAIN y el reintento espera a que vuelva a admitir datos */
+int async_uring_enviado(struct epoll_data_client * data, int res)
+{
+    data->uring_envio->en_vuelo = 0;
+
+    if(data->estado == CLIENTE_DESCONECTADO)
+        return 0;
+
+    if(res == -EAGAIN)
+    {
+        preparar_envio(data, true);
+        return 0;
+    }
+
+    contar_envio(res, data->uring_envio->bytes);
+
+    if(res < 0)
+        return WRITE_ERROR;
+
+    consumir_salida(data, res);
+
+    if(data->salida_cuenta == 0)
+    {
+        buffer_devolver((char *) data->uring_envio, sizeof(struct envio_uring));
+        data->uring_envio = NULL;
+    }
+
+    preparar_envio(data, false);
+
+    return 0;
+}
+
+/* Pide al kernel que, al leer del socket sin datos, sondee la cola de la tarjeta durante us
+microsegundos antes de dormir, y que prefiera ese sondeo a las interrupciones. Sólo tiene efecto con
+tarjetas con NAPI, no en loopback, y subir SO_BUSY_POLL por encima de net.core.busy_read puede pedir
+CAP_NET_ADMIN: si no se puede, el shard sigue con su propia espera activa */
+void async_busy_poll(struct epoll_data_client* data, int us)
+{
+    int activar = 1;
+
+    setsockopt(data->socketfd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+    setsockopt(data->socketfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &activar, sizeof(activar));
+}
+
+/* Cierra el socket de un cliente. Con io_uring antes se corta la conexión, lo que termina la recepción
+multishot y los envíos pendientes, y se libera su hueco de la tabla de ficheros, que si no mantendría
+el socket abierto */
+void async_cerrar(struct epoll_data_client* data)
+{
+    if(data->uring_activo)
+    {
+        shutdown(data->socketfd, SHUT_RDWR);
+
+        if(data->uring_fichero >= 0)
+            uring_fichero_baja(uring_hilo, data->uring_fichero);
+
+        data->uring_fichero = -1;
+    }
+
+    close(data->socketfd);
+}
+
+/* Los clientes salen de un pool propio en lugar de malloc(): sin sus buffers, que sólo existen
+mientras hay datos pendientes, un cliente ocupa unos pocos cientos de bytes */
+static struct pool_memoria pool_clientes = POOL_MEMORIA(MEMORIA_POOL_CLIENTES, sizeof(struct epoll_data_client));
+
+struct epoll_data_client * new_epoll_data(int socketfd)
+{
+    struct epoll_data_client *data = (struct epoll_data_client *) pool_obtener(&pool_clientes);
+
+    init_epoll_data(socketfd, data);
+
+    return data;
 }
 
+/* Un cliente cerrado sólo se puede liberar cuando el kernel ya no va a completar nada suyo: ni la
+recepción multishot, que termina con el cierre, ni un envío en curso */
+bool async_liberable(struct epoll_data_client* data)
+{
+    if(!data->uring_activo)
+        return true;
+
+    return !data->uring_recibiendo && (data->uring_envio == NULL || data->uring_envio->en_vuelo == 0);
+}
 
 void init_epoll_data(int socketfd, struct epoll_data_client * data)
 {
     data->socketfd = socketfd;
-    data->read_buffer_ptr = data->read_buffer;
-    data->tipo_mensaje_read = false;
-    data->read_count = 1;
-    data->write_count = 0;
+    data->clienteid = 0;
+    data->read_buffer = NULL;
+    data->read_capacidad = 0;
+    data->read_inicio = 0;
+    data->read_fin = 0;
+    data->cola_salida = NULL;
+    data->salida_inicio = 0;
+    data->salida_cuenta = 0;
+    data->salida_capacidad = 0;
+    data->salida_bytes = 0;
+    data->lento_cuenta = 0;
+    data->salida_base = 0;
+    data->salida_claves = NULL;
+    data->epollfd = -1;
+    data->epollout = false;
+    data->sucio = false;
+    data->siguiente_sucio = NULL;
     data->grupoid = 0;
+    data->grupo = NULL;
+    data->estado = CLIENTE_HANDSHAKE;
+    data->capacidades = 0;
+    data->tiene_posicion = false;
+    data->difusiones = 0;
+    data->bases_delta = NULL;
+    data->udp_testigo = 0;
+    data->udp_enlazado = false;
+    data->uring_activo = false;
+    data->uring_recibiendo = false;
+    data->uring_fichero = -1;
+    data->uring_envio = NULL;
+    data->en_rejilla = false;
+    data->handshake_siguiente = NULL;
+    data->handshake_anterior = NULL;
+}
+
+void free_epoll_data(struct epoll_data_client * data)
+{
+    for(int i = 0; i < data->salida_cuenta; i++)
+    {
+        mensaje_liberar(data->cola_salida[(data->salida_inicio + i) & (data->salida_capacidad - 1)].mensaje);
+    }
+
+    delete data->salida_claves;
+    delete data->bases_delta;
+    buffer_devolver((char *) data->uring_envio, sizeof(struct envio_uring));
+    buffer_devolver((char *) data->cola_salida, data->salida_capacidad * sizeof(struct entrada_salida));
+    buffer_devolver(data->read_buffer, data->read_capacidad);
+    pool_devolver(&pool_clientes, data);
+}
+
+uint64_t reloj_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t reloj_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
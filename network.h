@@ -8,12 +8,17 @@
 #include <sys/time.h>
 #include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <iostream>
 #include <fcntl.h>
 #include <assert.h>
+#include <atomic>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
 
 #include "mensajes.h"
 
@@ -22,26 +27,157 @@
 #define READ_BLOCK				        0
 #define READ_SUCCESS					1
 
+#define WRITE_SATURADO					-2
+#define WRITE_ERROR						-1
+
+#define CLIENTE_HANDSHAKE				0
+#define CLIENTE_CONECTADO				1
+#define CLIENTE_DESCONECTADO			2
+
 #define LISTEN_QUEUE 					1024
-#define INITIAL_BUFFER_SIZE				10000
+#define BUFFER_LECTURA_HILO				(1 << 16)
+#define COLA_SALIDA_INICIAL				16
+#define LIMITE_SALIDA_DEFECTO			(1 << 20)
+#define IOV_LOTE						64
+#define UDP_LOTE						64
+#define UDP_MAX_DATAGRAMA				512
+
+/* Política con los clientes lentos, los que tienen en la cola de salida algo encolado hace más del
+umbral. Descartar y diezmar sólo afectan a las actualizaciones de estado (posiciones e instantáneas),
+que la siguiente sustituye; desconectar se aplica a cualquier mensaje */
+#define LENTO_NINGUNA					0
+#define LENTO_DESCARTAR					1		// No reciben posiciones mientras sigan atrasados
+#define LENTO_DIEZMAR					2		// Reciben una de cada LENTO_DIEZMADO
+#define LENTO_DESCONECTAR				3
+#define LENTO_UMBRAL_DEFECTO_MS			250
+#define LENTO_DIEZMADO					4
+
+#define EVENTOS_CLIENTE					(EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLHUP | EPOLLERR)
 
 using namespace std;
 
+struct grupo;
+struct anillo_uring;
+struct envio_uring;
+
+/* Mensaje ya codificado que comparten todos sus destinatarios. Cada cola de salida que lo contiene
+tiene una referencia, y el último en terminar de enviarlo lo libera. Así los bytes se guardan una sola
+vez por muchos destinatarios que vayan atrasados. clave, si no es 0, marca un mensaje que sustituye
+a cualquier otro con la misma clave que el destinatario aún no haya empezado a enviar. Un mensaje que
+sólo se entiende a continuación del que sustituye (un delta) lleva en alternativa, retenida, la versión
+completa, que es la que ocupa el sitio del sustituido */
+struct mensaje_compartido {
+	atomic<int>		referencias;
+	int 			longitud;
+	clienteid_t		clave;
+	struct mensaje_compartido *alternativa;
+	char			*datos;
+};
+
+struct entrada_salida {
+	struct mensaje_compartido 	*mensaje;
+	int 						enviado;
+	uint32_t 					encolado;		// reloj_ms() truncado, para medir el retraso
+};
+
 struct epoll_data_client {
 	int 			socketfd;
+	clienteid_t		clienteid;
 	grupoid_t		grupoid;
-	char 			write_buffer[INITIAL_BUFFER_SIZE];
-	char 			read_buffer[INITIAL_BUFFER_SIZE];
-	char			*read_buffer_ptr, *write_buffer_ptr;
-	int 			read_count, read_count_total, write_count;
-	bool			tipo_mensaje_read;
+	struct grupo	*grupo;
+	int 			estado;
+	uint8_t			capacidades;
+	struct mensaje_posicion posicion;
+	bool			tiene_posicion;
+	uint32_t		difusiones;
+	unordered_map<clienteid_t, uint32_t> *bases_delta;
+	uint64_t		udp_testigo;
+	bool			udp_enlazado;
+	struct sockaddr_in udp_direccion;
+	bool			uring_activo;
+	bool			uring_recibiendo;
+	int 			uring_fichero;
+	struct envio_uring *uring_envio;
+	bool			en_rejilla;
+	uint64_t		celda_interes;
+	int 			indice_celda;
+	uint64_t		limite_handshake;
+	struct epoll_data_client *handshake_siguiente, *handshake_anterior;
+	char 			*read_buffer;
+	int 			read_capacidad, read_inicio, read_fin;
+	struct entrada_salida *cola_salida;
+	int 			salida_inicio, salida_cuenta, salida_capacidad, salida_bytes;
+	uint32_t 		lento_cuenta;
+	uint64_t 		salida_base;
+	unordered_map<clienteid_t, uint64_t> *salida_claves;
+	int 			epollfd;
+	bool			epollout;
+	bool			sucio;
+	struct epoll_data_client *siguiente_sucio;
 };
 
-int aio_socket_escucha(int puerto);
+/* Canal UDP de un shard para posiciones y reconocimientos. Lo que se envía durante una vuelta de epoll
+se acumula en salida y sale de una vez con sendmmsg(), igual que los lotes de las colas TCP */
+struct datagrama_salida {
+	struct sockaddr_in 			destino;
+	struct mensaje_compartido 	*mensaje;
+};
+
+struct canal_udp {
+	int 						socketfd;
+	vector<struct datagrama_salida> salida;
+};
+
+// Recibe cada datagrama entero junto con la dirección de la que procede
+typedef void (*manejador_datagrama)(char * datagrama, int length, struct sockaddr_in * origen, void * contexto);
+
+int aio_socket_escucha(int puerto, bool reuseport = false);
+int udp_socket_escucha(int puerto);
+void udp_recibir(struct canal_udp * canal, manejador_datagrama manejador, void * contexto);
+void udp_encolar(struct canal_udp * canal, const struct sockaddr_in * destino, struct mensaje_compartido * mensaje);
+void udp_vaciar(struct canal_udp * canal);
+struct mensaje_compartido * mensaje_crear(const void * buffer, int length);
+void mensaje_retener(struct mensaje_compartido * mensaje);
+void mensaje_liberar(struct mensaje_compartido * mensaje);
+
 int async_write(struct epoll_data_client* data, void * buffer, int length);
+int async_write_directo(struct epoll_data_client* data, void * buffer, int length);
+int async_write_compartido(struct epoll_data_client* data, struct mensaje_compartido * mensaje);
 int async_write_delay(struct epoll_data_client* data);
-int async_read(struct epoll_data_client * data, void * buffer, int length);
+void async_limite_salida(int bytes);
+void async_cork(bool activar);
+void async_conflacion(bool activar);
+void async_politica_lento(int politica, int umbral_ms);
+int async_retraso_ms(struct epoll_data_client* data);
+bool async_lento_descarta(struct epoll_data_client* data);
+void async_lote_iniciar();
+/* Al cerrar el lote, cada cliente cuyo socket falla al vaciar su cola se pasa al manejador, que es
+quien lo da de baja. El recorrido ya ha dejado atrás al cliente, así que puede cerrarlo allí mismo */
+typedef void (*manejador_fallo)(struct epoll_data_client * data, void * contexto);
+
+void async_lote_terminar(manejador_fallo fallo, void * contexto);
+int async_registrar(struct epoll_data_client* data, int epollfd, int operacion);
+void async_cerrar(struct epoll_data_client* data);
+void async_busy_poll(struct epoll_data_client* data, int us);
+bool async_liberable(struct epoll_data_client* data);
+/* Recibe cada frame completo (byte de tipo más estructura) directamente sobre el buffer de lectura.
+Devuelve 0 para seguir con el siguiente frame o distinto de 0 para parar y dejar el resto en el buffer */
+typedef int (*manejador_frame)(struct epoll_data_client * data, char * frame, int length, void * contexto);
+
+int async_read_frames(struct epoll_data_client * data, manejador_frame manejador, void * contexto);
+int async_procesar_frames(struct epoll_data_client * data, manejador_frame manejador, void * contexto);
+/* Con io_uring el hilo del shard indica su anillo y los clientes unidos a un grupo dejan el epoll: sus
+recepciones y envíos se completan en el anillo y el bucle del shard entrega cada completada aquí */
+void async_uring(struct anillo_uring * anillo);
+void async_uring_registrar(struct epoll_data_client * data);
+int async_uring_recibido(struct epoll_data_client * data, int res, unsigned flags, manejador_frame manejador, void * contexto);
+int async_uring_enviado(struct epoll_data_client * data, int res);
+
+struct epoll_data_client * new_epoll_data(int socketfd);
 void init_epoll_data(int socketfd, struct epoll_data_client * data);
+void free_epoll_data(struct epoll_data_client * data);
+uint64_t reloj_ms();
+uint64_t reloj_us();
 
 
 #endif
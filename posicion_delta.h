@@ -0,0 +1,110 @@
+#ifndef _POSICION_DELTA_H_
+#define _POSICION_DELTA_H_
+
+#include <stdint.h>
+
+#include "mensajes.h"
+
+/* Codificación de MENSAJE_POSICION_DELTA, común al servidor y a los clientes. Tras el byte de tipo y
+el de longitud van, como varints, el ID del origen, las diferencias de x, y, z en zig-zag y el avance
+del número de secuencia, todo respecto a la última posición de ese origen que recibió el cliente.
+Un movimiento de pocas unidades ocupa así 11 bytes en lugar de los 19 del MENSAJE_POSICION */
+
+#define DELTA_MAX_BYTES						(10 + 3 * 5 + 5)
+
+static inline int varint_escribir(uint64_t valor, uint8_t *salida)
+{
+	int n = 0;
+
+	while(valor >= 0x80)
+	{
+		salida[n++] = (uint8_t) valor | 0x80;
+		valor >>= 7;
+	}
+
+	salida[n++] = (uint8_t) valor;
+	return n;
+}
+
+// Devuelve los bytes leídos, o -1 si el varint no termina dentro de los longitud bytes
+static inline int varint_leer(const uint8_t *datos, int longitud, uint64_t *valor)
+{
+	uint64_t resultado = 0;
+
+	for(int n = 0; n < longitud && n < 10; n++)
+	{
+		resultado |= (uint64_t) (datos[n] & 0x7f) << (7 * n);
+
+		if(!(datos[n] & 0x80))
+		{
+			*valor = resultado;
+			return n + 1;
+		}
+	}
+
+	return -1;
+}
+
+static inline uint32_t zigzag(int32_t valor)
+{
+	return ((uint32_t) valor << 1) ^ (uint32_t) (valor >> 31);
+}
+
+static inline int32_t dezigzag(uint32_t valor)
+{
+	return (int32_t) (valor >> 1) ^ -(int32_t) (valor & 1);
+}
+
+/* Escribe en salida el cuerpo del delta de base a nueva (sin byte de tipo ni de longitud) y devuelve
+su longitud, como mucho DELTA_MAX_BYTES */
+static inline int delta_codificar(const struct mensaje_posicion *base, const struct mensaje_posicion *nueva, uint8_t *salida)
+{
+	int n = 0;
+
+	n += varint_escribir(nueva->cliente_id_origen, &salida[n]);
+	n += varint_escribir(zigzag(nueva->posicion_x - base->posicion_x), &salida[n]);
+	n += varint_escribir(zigzag(nueva->posicion_y - base->posicion_y), &salida[n]);
+	n += varint_escribir(zigzag(nueva->posicion_z - base->posicion_z), &salida[n]);
+	n += varint_escribir((uint32_t) (nueva->numero_secuencia - base->numero_secuencia), &salida[n]);
+
+	return n;
+}
+
+// Lee el origen del delta, que dice contra qué posición hay que aplicarlo
+static inline bool delta_origen(const uint8_t *datos, int longitud, clienteid_t *origen)
+{
+	uint64_t valor;
+
+	if(varint_leer(datos, longitud, &valor) < 0)
+		return false;
+
+	*origen = valor;
+	return true;
+}
+
+// Aplica el delta sobre posicion, que debe contener la última posición recibida de ese origen
+static inline bool delta_aplicar(const uint8_t *datos, int longitud, struct mensaje_posicion *posicion)
+{
+	uint64_t campos[5];
+	int n = 0;
+
+	for(int i = 0; i < 5; i++)
+	{
+		int leidos = varint_leer(&datos[n], longitud - n, &campos[i]);
+
+		if(leidos < 0)
+			return false;
+
+		n += leidos;
+	}
+
+	posicion->cliente_id_origen = campos[0];
+	posicion->posicion_x += dezigzag(campos[1]);
+	posicion->posicion_y += dezigzag(campos[2]);
+	posicion->posicion_z += dezigzag(campos[3]);
+	posicion->numero_secuencia += (uint32_t) campos[4];
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,638 @@
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <unordered_set>
+
+#include "reactor.h"
+#include "metricas.h"
+
+
+using namespace std;
+
+static struct reactor_shard *todos_shards = NULL;
+static int total_shards = 0;
+static atomic<uint64_t> epoca_global(0);
+
+/* Grupos que el balanceo ha sacado del shard que les toca por su ID, y grupos particionados, cuyos
+miembros nuevos se reparten por turno entre todos los shards. Sólo se modifica en las migraciones y al
+particionar, así que basta un mutex. Mientras no haya ninguna excepción, que es lo normal sin -G ni -P,
+los handshakes no lo tocan: hay_excepciones se activa antes de añadir la primera y no se desactiva */
+static mutex ubicacion_mutex;
+static atomic<bool> hay_excepciones(false);
+static unordered_map<grupoid_t, int> ubicacion_grupos;
+static unordered_map<grupoid_t, struct particiones_grupo *> grupos_particionados;
+static unsigned int turno_particion = 0;
+
+void grupo_alta(struct grupo *grupo, struct epoll_data_client *cliente)
+{
+    vector_cliente *nuevos = grupo->miembros ? new vector_cliente(*grupo->miembros) : new vector_cliente();
+
+    nuevos->push_back(cliente);
+    grupo->miembros = snapshot_grupo(nuevos);
+}
+
+void grupo_baja(struct grupo *grupo, struct epoll_data_client *cliente)
+{
+    vector_cliente *nuevos = new vector_cliente();
+
+    if(grupo->rejilla != NULL)
+        rejilla_quitar(grupo->rejilla, cliente);
+
+    nuevos->reserve(grupo->miembros->size());
+
+    for(uint i = 0; i < grupo->miembros->size(); i++)
+    {
+        if((*grupo->miembros)[i] != cliente)
+            nuevos->push_back((*grupo->miembros)[i]);
+    }
+
+    grupo->miembros = snapshot_grupo(nuevos);
+}
+
+int reactor_num_cores()
+{
+    int cores = thread::hardware_concurrency();
+
+    if(cores <= 0)
+        cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cores > 0 ? cores : 1;
+}
+
+static void fijar_hilo_cpu(thread &hilo, int cpu)
+{
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    int rc = pthread_setaffinity_np(hilo.native_handle(), sizeof(cpu_set_t), &cpus);
+
+    if(rc != 0)
+    {
+        errno = rc;
+        perror("pthread_setaffinity_np()");
+    }
+}
+
+void reactor_crear(struct reactor_shard *shards, int num_shards, bool fijar_cpu)
+{
+    int cores = reactor_num_cores();
+
+    todos_shards = shards;
+    total_shards = num_shards;
+
+    for(int i = 0; i < num_shards; i++)
+    {
+        struct reactor_shard *shard = &shards[i];
+        struct epoll_event event;
+
+        shard->id = i;
+        shard->aceptador.listen_sd = -1;
+        shard->timerfd = -1;
+        shard->tickfd = -1;
+        shard->tick = 0;
+        shard->udp.socketfd = -1;
+        shard->uring = NULL;
+        shard->epoca.store(0);
+        shard->ciclos_primero = NULL;
+        shard->ciclos_ultimo = NULL;
+        shard->cpu = fijar_cpu ? i % cores : -1;
+        shard->espera_activa_us = 0;
+        shard->balanceofd = -1;
+        shard->carga.store(0);
+        shard->migrar_destino = -1;
+        shard->particiones_entrada = new atomic<cola_particion *>[num_shards];
+        shard->particiones_pendientes = new vector<struct difusion_particion>[num_shards];
+        shard->particiones_aviso.assign(num_shards, 0);
+
+        for(int j = 0; j < num_shards; j++)
+            shard->particiones_entrada[j].store(NULL);
+
+        if((shard->epollfd = epoll_create1(0)) < 0)
+        {
+            perror("epoll_create1()");
+            exit(-1);
+        }
+
+        if((shard->eventfd = eventfd(0, EFD_NONBLOCK)) < 0)
+        {
+            perror("eventfd()");
+            exit(-1);
+        }
+
+        /* El puntero al propio campo eventfd sirve de marca para distinguir su evento del de
+        los clientes, cuyo data.ptr apunta a su epoll_data_client */
+        event.events = EPOLLIN;
+        event.data.ptr = &shard->eventfd;
+
+        if(epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->eventfd, &event) < 0)
+        {
+            perror("epoll_ctl()");
+            exit(-1);
+        }
+    }
+}
+
+static int crear_timer_periodico(long periodo_ns)
+{
+    int timerfd;
+    struct itimerspec periodo;
+
+    if((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+    {
+        perror("timerfd_create()");
+        exit(-1);
+    }
+
+    periodo.it_interval.tv_sec = periodo_ns / 1000000000L;
+    periodo.it_interval.tv_nsec = periodo_ns % 1000000000L;
+    periodo.it_value = periodo.it_interval;
+
+    if(timerfd_settime(timerfd, 0, &periodo, NULL) < 0)
+    {
+        perror("timerfd_settime()");
+        exit(-1);
+    }
+
+    return timerfd;
+}
+
+void reactor_aceptador_iniciar(struct aceptador *aceptador, int listen_sd, int epollfd)
+{
+    struct epoll_event event;
+
+    aceptador->listen_sd = listen_sd;
+    aceptador->epollfd = epollfd;
+    aceptador->primero = NULL;
+    aceptador->ultimo = NULL;
+    aceptador->timerfd = crear_timer_periodico(HANDSHAKE_REVISION_MS * 1000000L);
+
+    event.events = EPOLLIN;
+    event.data.ptr = &aceptador->listen_sd;
+
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, listen_sd, &event) < 0)
+    {
+        perror("epoll_ctl()");
+        exit(-1);
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &aceptador->timerfd;
+
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, aceptador->timerfd, &event) < 0)
+    {
+        perror("epoll_ctl()");
+        exit(-1);
+    }
+}
+
+void reactor_escuchar(struct reactor_shard *shard, int listen_sd)
+{
+    reactor_aceptador_iniciar(&shard->aceptador, listen_sd, shard->epollfd);
+}
+
+/* Timer periódico del propio shard para las tareas que vencen con el tiempo, como los ciclos de
+reconocimientos. Su evento se marca con el puntero al campo timerfd */
+void reactor_mantenimiento_iniciar(struct reactor_shard *shard, int periodo_ms)
+{
+    struct epoll_event event;
+
+    shard->timerfd = crear_timer_periodico(periodo_ms * 1000000L);
+
+    event.events = EPOLLIN;
+    event.data.ptr = &shard->timerfd;
+
+    if(epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->timerfd, &event) < 0)
+    {
+        perror("epoll_ctl()");
+        exit(-1);
+    }
+}
+
+/* Timer del balanceo de grupos: en cada periodo el shard publica su carga y, si está muy por encima
+del más libre, le cede uno de sus grupos. Su evento se marca con el puntero al campo balanceofd */
+void reactor_balanceo_iniciar(struct reactor_shard *shard, int periodo_ms)
+{
+    struct epoll_event event;
+
+    shard->balanceofd = crear_timer_periodico(periodo_ms * 1000000L);
+
+    event.events = EPOLLIN;
+    event.data.ptr = &shard->balanceofd;
+
+    if(epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->balanceofd, &event) < 0)
+    {
+        perror("epoll_ctl()");
+        exit(-1);
+    }
+}
+
+/* Timer del modo de instantáneas: en cada tick el shard envía a cada grupo con cambios las últimas
+posiciones de sus miembros. Su evento se marca con el puntero al campo tickfd */
+void reactor_tick_iniciar(struct reactor_shard *shard, int hz)
+{
+    struct epoll_event event;
+
+    shard->tickfd = crear_timer_periodico(1000000000L / hz);
+
+    event.events = EPOLLIN;
+    event.data.ptr = &shard->tickfd;
+
+    if(epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->tickfd, &event) < 0)
+    {
+        perror("epoll_ctl()");
+        exit(-1);
+    }
+}
+
+/* Canal UDP propio del shard, en su propio puerto, para que los datagramas de un grupo lleguen
+directamente al hilo que lo atiende. Su evento se marca con el puntero al campo udp.socketfd */
+void reactor_udp_iniciar(struct reactor_shard *shard, int puerto)
+{
+    struct epoll_event event;
+
+    shard->udp.socketfd = udp_socket_escucha(puerto);
+
+    event.events = EPOLLIN;
+    event.data.ptr = &shard->udp.socketfd;
+
+    if(epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->udp.socketfd, &event) < 0)
+    {
+        perror("epoll_ctl()");
+        exit(-1);
+    }
+}
+
+/* Espera multishot sobre el epoll del shard: en modo io_uring el hilo sólo se bloquea en el anillo, y
+todo lo que sigue en el epoll (inbox, timers, handshakes y UDP) le llega como una completada más */
+void reactor_uring_epoll(struct reactor_shard *shard)
+{
+    struct io_uring_sqe *sqe = uring_sqe(shard->uring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard->epollfd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_DATOS(shard, URING_OP_EPOLL);
+}
+
+// Aceptación multishot sobre el socket de escucha propio del shard
+void reactor_uring_aceptar(struct reactor_shard *shard)
+{
+    struct io_uring_sqe *sqe = uring_sqe(shard->uring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard->aceptador.listen_sd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = URING_DATOS(&shard->aceptador, URING_OP_ACEPTAR);
+}
+
+/* Crea el anillo io_uring del shard. Los clientes conectados pasan a recibir y enviar por él, y si el
+shard tiene su propio socket de escucha también acepta por él. Devuelve false si el kernel no admite
+algo de lo que hace falta, y entonces el shard se queda como estaba, sólo con epoll */
+bool reactor_uring_iniciar(struct reactor_shard *shard)
+{
+    struct anillo_uring *anillo = (struct anillo_uring *) malloc(sizeof(struct anillo_uring));
+
+    if(!uring_crear(anillo, URING_ENTRADAS))
+    {
+        free(anillo);
+        return false;
+    }
+
+    // Sin tabla de ficheros registrados se usan los descriptores tal cual
+    if(!uring_buffers_registrar(anillo) || !uring_probar(anillo))
+    {
+        uring_liberar(anillo);
+        free(anillo);
+        return false;
+    }
+
+    uring_ficheros_registrar(anillo, URING_FICHEROS);
+
+    shard->uring = anillo;
+    reactor_uring_epoll(shard);
+
+    if(shard->aceptador.listen_sd >= 0)
+    {
+        if(epoll_ctl(shard->epollfd, EPOLL_CTL_DEL, shard->aceptador.listen_sd, NULL) < 0)
+        {
+            perror("epoll_ctl()");
+            exit(-1);
+        }
+
+        reactor_uring_aceptar(shard);
+    }
+
+    return true;
+}
+
+/* Con espera activa el shard sigue sondeando su epoll sin bloquearse durante us microsegundos sin
+eventos, y sólo entonces se bloquea. Conviene junto con fijar cada shard a un core reservado, porque
+mientras sondea lo ocupa entero */
+void reactor_espera_activa(struct reactor_shard *shard, int us)
+{
+    shard->espera_activa_us = us;
+}
+
+void reactor_arrancar(struct reactor_shard *shards, int num_shards, void (*bucle)(struct reactor_shard *))
+{
+    for(int i = 0; i < num_shards; i++)
+    {
+        shards[i].hilo = thread(bucle, &shards[i]);
+
+        if(shards[i].cpu >= 0)
+            fijar_hilo_cpu(shards[i].hilo, shards[i].cpu);
+    }
+}
+
+/* Reclamación por épocas de los clientes desconectados. Al retirar un cliente ya no es accesible desde
+ningún grupo ni desde el registro, pero algún shard puede tener aún su puntero en la mano. Cada shard
+anuncia en cada vuelta de su bucle la época que ha visto, y mientras está bloqueado esperando eventos
+anuncia EPOCA_REPOSO, porque entonces no tiene ninguno. Un retirado se libera cuando todos han anunciado
+una época igual o posterior a la suya */
+void reactor_retirar(struct reactor_shard *shard, struct epoll_data_client *cliente)
+{
+    struct cliente_retirado retirado;
+
+    retirado.cliente = cliente;
+    retirado.epoca = epoca_global.fetch_add(1) + 1;
+
+    shard->retirados.push_back(retirado);
+}
+
+// Punto de reposo del shard: anuncia la época actual y libera lo que ya nadie puede estar usando
+void reactor_quiescente(struct reactor_shard *shard)
+{
+    shard->epoca.store(epoca_global.load());
+
+    if(shard->retirados.empty())
+        return;
+
+    uint64_t minima = EPOCA_REPOSO;
+
+    for(int i = 0; i < total_shards; i++)
+    {
+        uint64_t epoca = todos_shards[i].epoca.load();
+
+        if(epoca < minima)
+            minima = epoca;
+    }
+
+    // Un cliente con operaciones de io_uring en curso espera a la siguiente vuelta
+    uint j = 0;
+
+    for(uint i = 0; i < shard->retirados.size(); i++)
+    {
+        struct cliente_retirado retirado = shard->retirados[i];
+
+        if(retirado.epoca <= minima && async_liberable(retirado.cliente))
+            free_epoll_data(retirado.cliente);
+        else
+            shard->retirados[j++] = retirado;
+    }
+
+    shard->retirados.resize(j);
+}
+
+// Antes de bloquearse: el shard no retiene ningún cliente hasta su siguiente punto de reposo
+void reactor_reposo(struct reactor_shard *shard)
+{
+    shard->epoca.store(EPOCA_REPOSO);
+}
+
+// Con ubicacion_mutex tomado. Un grupo particionado da el siguiente shard del turno o -1, según turno
+static int ubicacion_grupo(grupoid_t grupo, int num_shards, bool turno)
+{
+    if(grupos_particionados.count(grupo) > 0)
+        return turno ? (int) (turno_particion++ % num_shards) : -1;
+
+    unordered_map<grupoid_t, int>::iterator it = ubicacion_grupos.find(grupo);
+
+    if(it != ubicacion_grupos.end())
+        return it->second;
+
+    return (unsigned int) grupo % num_shards;
+}
+
+/* Shard dueño de un grupo: el que le toca por su ID salvo que el balanceo lo haya movido. Quien lee
+un shard que acaba de ceder el grupo, o aún no ve la excepción, deja la tarea en ese shard, que se la
+reenvía al nuevo */
+int reactor_shard_grupo(grupoid_t grupo, int num_shards)
+{
+    if(!hay_excepciones.load(memory_order_acquire))
+        return (unsigned int) grupo % num_shards;
+
+    lock_guard<mutex> guarda(ubicacion_mutex);
+
+    return ubicacion_grupo(grupo, num_shards, true);
+}
+
+void reactor_ubicar_grupo(grupoid_t grupo, int shard, int num_shards)
+{
+    lock_guard<mutex> guarda(ubicacion_mutex);
+
+    if(shard == (int) ((unsigned int) grupo % num_shards))
+    {
+        ubicacion_grupos.erase(grupo);
+    }
+    else
+    {
+        hay_excepciones.store(true, memory_order_release);
+        ubicacion_grupos[grupo] = shard;
+    }
+}
+
+// Como reactor_shard_grupo(), pero -1 si el grupo está particionado: cualquier shard puede tener miembros
+int reactor_dueno_grupo(grupoid_t grupo, int num_shards)
+{
+    if(!hay_excepciones.load(memory_order_acquire))
+        return (unsigned int) grupo % num_shards;
+
+    lock_guard<mutex> guarda(ubicacion_mutex);
+
+    return ubicacion_grupo(grupo, num_shards, false);
+}
+
+/* A partir de aquí los miembros nuevos del grupo se reparten entre todos los shards. Lo decide el
+dueño del grupo cuando llega al umbral, y no se deshace. Devuelve la máscara de shards del grupo,
+aún vacía */
+struct particiones_grupo * reactor_particionar_grupo(grupoid_t grupo)
+{
+    lock_guard<mutex> guarda(ubicacion_mutex);
+
+    hay_excepciones.store(true, memory_order_release);
+
+    struct particiones_grupo *&particiones = grupos_particionados[grupo];
+
+    if(particiones == NULL)
+    {
+        particiones = new struct particiones_grupo;
+        particiones->palabras = (total_shards + 63) / 64;
+        particiones->shards = new atomic<uint64_t>[particiones->palabras];
+
+        for(int i = 0; i < particiones->palabras; i++)
+            particiones->shards[i].store(0);
+    }
+
+    ubicacion_grupos.erase(grupo);
+    return particiones;
+}
+
+// Máscara de shards del grupo, o NULL si no está particionado
+struct particiones_grupo * reactor_grupo_particionado(grupoid_t grupo)
+{
+    if(!hay_excepciones.load(memory_order_acquire))
+        return NULL;
+
+    lock_guard<mutex> guarda(ubicacion_mutex);
+    unordered_map<grupoid_t, struct particiones_grupo *>::iterator it = grupos_particionados.find(grupo);
+
+    return it != grupos_particionados.end() ? it->second : NULL;
+}
+
+void reactor_particion_marcar(struct particiones_grupo *particiones, int shard, bool tiene_miembros)
+{
+    uint64_t bit = 1ULL << (shard % 64);
+
+    if(tiene_miembros)
+        particiones->shards[shard / 64].fetch_or(bit, memory_order_release);
+    else
+        particiones->shards[shard / 64].fetch_and(~bit, memory_order_release);
+}
+
+/* Deja una difusión para el shard destino, sin despertarlo: eso se hace una vez por destino al final
+de la vuelta. Si su cola está llena, o ya hay difusiones esperando, espera con ellas para no
+adelantarlas */
+void reactor_particion_enviar(struct reactor_shard *shard, int destino, struct difusion_particion difusion)
+{
+    cola_particion *cola = todos_shards[destino].particiones_entrada[shard->id].load(memory_order_acquire);
+
+    if(cola == NULL)
+    {
+        cola = spsc_crear<struct difusion_particion>(PARTICION_COLA);
+        todos_shards[destino].particiones_entrada[shard->id].store(cola, memory_order_release);
+    }
+
+    vector<struct difusion_particion> &pendientes = shard->particiones_pendientes[destino];
+
+    if(pendientes.empty() && spsc_meter(cola, difusion))
+    {
+        shard->particiones_aviso[destino] = 1;
+        return;
+    }
+
+    /* Un destino que no vacía su cola no puede hacer crecer sin límite lo retenido para él. Pasado
+    PARTICION_RETENIDAS_MAX se descarta todo salvo las bajas, que son pocas y sin las que sus miembros
+    se quedarían con IDs que ya no existen. Una posición perdida no rompe los deltas: los destinatarios
+    que no la reciben conservan su base y la siguiente les llega completa */
+    if(pendientes.size() >= PARTICION_RETENIDAS_MAX && difusion.mensaje->datos[0] != MENSAJE_DESCONEXION)
+    {
+        METRICA_SUMAR(metricas_hilo->particiones_descartadas, 1);
+        mensaje_liberar(difusion.mensaje);
+
+        if(difusion.delta != NULL)
+            mensaje_liberar(difusion.delta);
+        return;
+    }
+
+    pendientes.push_back(difusion);
+    shard->particiones_aviso[destino] = 1;
+}
+
+/* Final de la vuelta: mete en las colas lo que estaba esperando y despierta a los destinos que tienen
+algo nuevo. Si algo sigue sin caber, el shard se despierta a sí mismo para volver a intentarlo en la
+siguiente vuelta en lugar de bloquearse con difusiones retenidas */
+void reactor_particiones_vaciar(struct reactor_shard *shard)
+{
+    uint64_t uno = 1;
+    bool retenidas = false;
+
+    for(int i = 0; i < total_shards; i++)
+    {
+        vector<struct difusion_particion> &pendientes = shard->particiones_pendientes[i];
+
+        if(!pendientes.empty())
+        {
+            cola_particion *cola = todos_shards[i].particiones_entrada[shard->id].load(memory_order_relaxed);
+            size_t metidas = 0;
+
+            while(metidas < pendientes.size() && spsc_meter(cola, pendientes[metidas]))
+                metidas++;
+
+            // El aviso de cuando se retuvieron ya se dio, así que lo que entra ahora necesita el suyo
+            if(metidas > 0)
+                shard->particiones_aviso[i] = 1;
+
+            pendientes.erase(pendientes.begin(), pendientes.begin() + metidas);
+            retenidas = retenidas || !pendientes.empty();
+        }
+
+        if(shard->particiones_aviso[i])
+        {
+            shard->particiones_aviso[i] = 0;
+
+            if(write(todos_shards[i].eventfd, &uno, sizeof(uno)) < 0 && errno != EAGAIN)
+            {
+                perror("reactor_particiones_vaciar->write()");
+            }
+        }
+    }
+
+    if(retenidas && write(shard->eventfd, &uno, sizeof(uno)) < 0 && errno != EAGAIN)
+    {
+        perror("reactor_particiones_vaciar->write()");
+    }
+}
+
+/* Saca las difusiones que han dejado las demás particiones. Se llama al atender el eventfd, después
+de leerlo: lo que se meta en una cola después de vaciarla vuelve a despertar al shard */
+void reactor_particiones_recoger(struct reactor_shard *shard, vector<struct difusion_particion> &difusiones)
+{
+    struct difusion_particion difusion;
+
+    difusiones.clear();
+
+    for(int i = 0; i < total_shards; i++)
+    {
+        cola_particion *cola = shard->particiones_entrada[i].load(memory_order_acquire);
+
+        if(cola == NULL)
+            continue;
+
+        while(spsc_sacar(cola, &difusion))
+            difusiones.push_back(difusion);
+    }
+}
+
+void reactor_encolar(struct reactor_shard *shard, struct tarea_shard tarea)
+{
+    uint64_t uno = 1;
+
+    shard->inbox_mutex.lock();
+    shard->inbox.push_back(tarea);
+    shard->inbox_mutex.unlock();
+
+    if(write(shard->eventfd, &uno, sizeof(uno)) < 0 && errno != EAGAIN)
+    {
+        perror("reactor_encolar->write()");
+    }
+}
+
+void reactor_recoger(struct reactor_shard *shard, vector<struct tarea_shard> &tareas)
+{
+    uint64_t contador;
+
+    if(read(shard->eventfd, &contador, sizeof(contador)) < 0 && errno != EAGAIN)
+    {
+        perror("reactor_recoger->read()");
+    }
+
+    tareas.clear();
+
+    shard->inbox_mutex.lock();
+    tareas.swap(shard->inbox);
+    shard->inbox_mutex.unlock();
+}
@@ -0,0 +1,243 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "mensajes.h"
+#include "network.h"
+#include "interes.h"
+#include "uring.h"
+#include "spsc.h"
+
+#define EVENTOS_SHARD 				1024
+
+#define TAREA_NUEVO_CLIENTE			1
+#define TAREA_UNICAST				2
+#define TAREA_MIGRAR_GRUPO			3
+
+#define HANDSHAKE_TIMEOUT_MS		5000
+#define HANDSHAKE_REVISION_MS		500
+
+#define CICLO_TIMEOUT_MS			1000
+#define CICLO_REVISION_MS			100
+
+#define INSTANTANEA_MAX_POSICIONES	4096
+
+#define BALANCEO_CARGA_MINIMA		1000		// Carga por periodo por debajo de la cual un shard no cede grupos
+#define BALANCEO_DESEQUILIBRIO		4			// Se cede si la diferencia con el más libre pasa de 1/4 de la carga propia
+
+#define PARTICION_COLA				1024		// Difusiones en vuelo entre cada par de shards, potencia de dos
+#define PARTICION_RETENIDAS_MAX		8192		// Difusiones retenidas para un destino con la cola llena
+
+#define EPOCA_REPOSO				UINT64_MAX
+
+using namespace std;
+
+struct grupo_key {
+	grupoid_t grupoid;
+};
+
+struct grupo_hash {
+	size_t operator() (const grupo_key& g) const
+	{
+		return g.grupoid;
+	}
+};
+
+struct grupo_hash_equal {
+	bool operator() (const grupo_key& lkey, const grupo_key& rkey) const
+	{
+		return lkey.grupoid == rkey.grupoid;
+	}
+};
+
+typedef vector<struct epoll_data_client *> vector_cliente;
+
+/* Versión inmutable de los miembros de un grupo. Las altas y bajas publican una versión nueva en
+lugar de modificar la actual, así el reenvío recorre los miembros sin copiarlos y sin que le afecte
+que alguno se dé de baja a mitad del recorrido: la versión que tiene en la mano vive mientras la
+referencie */
+typedef shared_ptr<const vector_cliente> snapshot_grupo;
+
+/* Shards que tienen miembros de un grupo particionado, un bit por shard. La comparten todas las
+particiones del grupo y cada shard sólo cambia su propio bit, al tener su primer miembro y al quedarse
+sin ninguno */
+struct particiones_grupo {
+	int 						palabras;
+	atomic<uint64_t> 			*shards;
+};
+
+/* carga es el trabajo que ha dado el grupo en el periodo de balanceo en curso: uno por mensaje
+recibido más uno por cada destinatario al que se ha reenviado. Un grupo particionado tiene miembros en
+varios shards, cada uno con su propia struct grupo para los suyos, y lo que se difunde en una partición
+se pasa a las demás. particiones es NULL mientras no lo está */
+struct grupo {
+	grupoid_t 					grupoid;
+	snapshot_grupo 				miembros;
+	bool 						cambiado;
+	struct rejilla 				*rejilla;
+	uint64_t 					carga;
+	struct particiones_grupo 	*particiones;
+};
+
+typedef unordered_map<grupo_key, struct grupo, grupo_hash, grupo_hash_equal> mapa_grupos;
+
+/* Ciclo de posición de un cliente cuyos reconocimientos recoge el servidor en vez de reenviarlos.
+esperados son los IDs a los que se reenvió la posición, ordenados para buscarlos por bisección, y
+recibidos tiene un bit por cada uno que marca si ya ha respondido. Los ciclos abiertos de un shard
+forman una lista por orden de apertura, que es también el orden en que vencen */
+struct ciclo_ack {
+	clienteid_t 				origen;
+	uint32_t 					secuencia;
+	vector<clienteid_t> 		esperados;
+	vector<uint64_t> 			recibidos;
+	int 						pendientes;
+	uint64_t 					limite;
+	struct ciclo_ack 			*siguiente, *anterior;
+};
+
+typedef unordered_map<clienteid_t, struct ciclo_ack *> mapa_ciclos;
+
+/* Estado de un grupo en tránsito de un shard a otro: el grupo con sus miembros, ya fuera del epoll del
+shard que lo cede, y los ciclos abiertos de esos miembros. Mientras viaja los miembros apuntan a este
+grupo, y el shard que lo adopta los pasa al suyo */
+struct migracion_grupo {
+	struct grupo 				grupo;
+	vector<struct ciclo_ack *> 	ciclos;
+};
+
+/* Trabajo que otro hilo deja a un shard. El shard lo recoge en su propio bucle, de modo que
+todo el estado de sus grupos sólo se toca desde su hilo. TAREA_NUEVO_CLIENTE usa cliente y
+TAREA_UNICAST entrega mensaje al cliente destino si sigue en el grupo grupoid; emisor es el ID que el
+servidor conoce del cliente que lo envió, no el que dice el mensaje. TAREA_MIGRAR_GRUPO entrega al
+shard el grupo de migracion */
+struct tarea_shard {
+	int 						tipo;
+	struct epoll_data_client 	*cliente;
+	clienteid_t 				destino;
+	clienteid_t 				emisor;
+	grupoid_t 					grupoid;
+	struct mensaje_compartido 	*mensaje;
+	struct migracion_grupo 		*migracion;
+};
+
+/* Mensaje que una partición de un grupo pasa a las demás para que cada una lo reparta entre sus
+miembros. En las posiciones mensaje es el frame completo, delta el delta contra la anterior del origen
+(NULL si no la hay), difusiones la cuenta del origen con ésta incluida y x, y sus coordenadas para el
+radio de interés. Cada copia lleva su propia referencia a mensaje y a delta */
+struct difusion_particion {
+	grupoid_t 					grupoid;
+	clienteid_t 				origen;
+	struct mensaje_compartido 	*mensaje;
+	struct mensaje_compartido 	*delta;
+	uint32_t 					difusiones;
+	bool 						posicion;
+	int16_t 					x, y;
+};
+
+typedef struct cola_spsc<struct difusion_particion> cola_particion;
+
+/* Socket de escucha junto con los clientes aceptados que aún no han completado el MENSAJE_CONEXION.
+Los pendientes forman una lista por orden de llegada, que es también el orden en que vencen, de modo
+que el timerfd sólo tiene que mirar el principio de la lista */
+struct aceptador {
+	int 						listen_sd;
+	int 						epollfd;
+	int 						timerfd;
+	struct epoll_data_client 	*primero, *ultimo;
+};
+
+/* Cliente desconectado a la espera de que se pueda liberar: cuando todos los shards hayan pasado por
+un punto de reposo con una época igual o posterior a la suya, ninguno puede conservar su puntero */
+struct cliente_retirado {
+	struct epoll_data_client 	*cliente;
+	uint64_t 					epoca;
+};
+
+/* Un shard es un hilo con su propio epoll. Cada grupo pertenece a un único shard, que es el
+único que lee o modifica sus miembros */
+struct reactor_shard {
+	int 						id;
+	int 						epollfd;
+	int 						eventfd;
+	int 						cpu;
+	int 						espera_activa_us;		// 0: el shard se bloquea en cuanto no hay eventos
+	thread 						hilo;
+
+	mutex 						inbox_mutex;
+	vector<struct tarea_shard> 	inbox;
+
+	struct aceptador 			aceptador;
+
+	mapa_grupos 				clientes_grupo;
+
+	int 						tickfd;
+	uint32_t 					tick;
+	vector<struct grupo *> 		grupos_cambiados;
+
+	int 						timerfd;
+	mapa_ciclos 				ciclos;
+	struct ciclo_ack 			*ciclos_primero, *ciclos_ultimo;
+
+	struct canal_udp 			udp;
+
+	struct anillo_uring 		*uring;
+
+	int 						balanceofd;
+	atomic<uint64_t> 			carga;				// Carga del último periodo de balanceo, la leen los demás
+	grupoid_t 					migrar_grupo;
+	int 						migrar_destino;		// -1 si no hay ningún grupo que ceder
+
+	/* Colas de difusiones entre particiones: una por cada shard que envía a éste, que la crea en su
+	primer envío. Lo que no cabe en la cola de un destino espera en su pendientes, y aviso marca los
+	destinos a los que despertar al final de la vuelta */
+	atomic<cola_particion *> 	*particiones_entrada;
+	vector<struct difusion_particion> *particiones_pendientes;
+	vector<char> 				particiones_aviso;
+
+	vector<struct epoll_data_client *> desconectados;
+	atomic<uint64_t> 			epoca;
+	vector<struct cliente_retirado> retirados;
+};
+
+void grupo_alta(struct grupo *grupo, struct epoll_data_client *cliente);
+void grupo_baja(struct grupo *grupo, struct epoll_data_client *cliente);
+
+int reactor_num_cores();
+void reactor_crear(struct reactor_shard *shards, int num_shards, bool fijar_cpu);
+void reactor_aceptador_iniciar(struct aceptador *aceptador, int listen_sd, int epollfd);
+void reactor_escuchar(struct reactor_shard *shard, int listen_sd);
+void reactor_mantenimiento_iniciar(struct reactor_shard *shard, int periodo_ms);
+void reactor_tick_iniciar(struct reactor_shard *shard, int hz);
+void reactor_udp_iniciar(struct reactor_shard *shard, int puerto);
+bool reactor_uring_iniciar(struct reactor_shard *shard);
+void reactor_uring_epoll(struct reactor_shard *shard);
+void reactor_uring_aceptar(struct reactor_shard *shard);
+void reactor_espera_activa(struct reactor_shard *shard, int us);
+void reactor_balanceo_iniciar(struct reactor_shard *shard, int periodo_ms);
+void reactor_arrancar(struct reactor_shard *shards, int num_shards, void (*bucle)(struct reactor_shard *));
+int reactor_shard_grupo(grupoid_t grupo, int num_shards);
+void reactor_ubicar_grupo(grupoid_t grupo, int shard, int num_shards);
+int reactor_dueno_grupo(grupoid_t grupo, int num_shards);
+struct particiones_grupo * reactor_particionar_grupo(grupoid_t grupo);
+struct particiones_grupo * reactor_grupo_particionado(grupoid_t grupo);
+void reactor_particion_marcar(struct particiones_grupo *particiones, int shard, bool tiene_miembros);
+void reactor_particion_enviar(struct reactor_shard *shard, int destino, struct difusion_particion difusion);
+void reactor_particiones_vaciar(struct reactor_shard *shard);
+void reactor_particiones_recoger(struct reactor_shard *shard, vector<struct difusion_particion> &difusiones);
+void reactor_retirar(struct reactor_shard *shard, struct epoll_data_client *cliente);
+void reactor_quiescente(struct reactor_shard *shard);
+void reactor_reposo(struct reactor_shard *shard);
+void reactor_encolar(struct reactor_shard *shard, struct tarea_shard tarea);
+void reactor_recoger(struct reactor_shard *shard, vector<struct tarea_shard> &tareas);
+
+#endif
@@ -0,0 +1,129 @@
+#include "registro.h"
+
+
+using namespace std;
+
+void registro_crear(struct registro_clientes *registro, uint32_t capacidad)
+{
+    registro->slots = new struct registro_slot[capacidad];
+    registro->capacidad = capacidad;
+    registro->usados = 0;
+    registro->libres = REGISTRO_FIN_LIBRES;
+
+    for(uint32_t i = 0; i < capacidad; i++)
+    {
+        registro->slots[i].generacion.store(1, memory_order_relaxed);
+        registro->slots[i].shard.store(-1, memory_order_relaxed);
+        registro->slots[i].cliente.store(NULL, memory_order_relaxed);
+        registro->slots[i].siguiente_libre = REGISTRO_FIN_LIBRES;
+    }
+}
+
+/* Reserva un hueco para el cliente y devuelve su ID, o CLIENTEID_NULO si el registro está lleno.
+Se reutilizan primero los huecos liberados y después los que nunca se han usado */
+clienteid_t registro_alta(struct registro_clientes *registro, struct epoll_data_client *cliente, int shard)
+{
+    uint32_t indice;
+
+    registro->libres_mutex.lock();
+
+    if(registro->libres != REGISTRO_FIN_LIBRES)
+    {
+        indice = registro->libres;
+        registro->libres = registro->slots[indice].siguiente_libre;
+    }
+    else if(registro->usados < registro->capacidad)
+    {
+        indice = registro->usados++;
+    }
+    else
+    {
+        registro->libres_mutex.unlock();
+        return CLIENTEID_NULO;
+    }
+
+    registro->libres_mutex.unlock();
+
+    struct registro_slot *slot = &registro->slots[indice];
+
+    slot->shard.store(shard, memory_order_relaxed);
+    slot->cliente.store(cliente, memory_order_release);
+
+    return CLIENTEID(indice, slot->generacion.load(memory_order_relaxed));
+}
+
+void registro_baja(struct registro_clientes *registro, clienteid_t id)
+{
+    uint32_t indice = CLIENTEID_INDICE(id);
+
+    if(indice >= registro->capacidad)
+        return;
+
+    struct registro_slot *slot = &registro->slots[indice];
+    uint32_t generacion = slot->generacion.load(memory_order_relaxed);
+
+    if(generacion != CLIENTEID_GENERACION(id))
+        return;
+
+    // La generación 0 daría IDs nulos, se salta al dar la vuelta
+    if(++generacion == 0)
+        generacion = 1;
+
+    slot->generacion.store(generacion, memory_order_release);
+    slot->cliente.store(NULL, memory_order_relaxed);
+    slot->shard.store(-1, memory_order_relaxed);
+
+    registro->libres_mutex.lock();
+    slot->siguiente_libre = registro->libres;
+    registro->libres = indice;
+    registro->libres_mutex.unlock();
+}
+
+/* Shard dueño del cliente, o -1 si el ID no es de ningún cliente conectado */
+int registro_shard(struct registro_clientes *registro, clienteid_t id)
+{
+    uint32_t indice = CLIENTEID_INDICE(id);
+
+    if(indice >= registro->capacidad)
+        return -1;
+
+    struct registro_slot *slot = &registro->slots[indice];
+
+    if(slot->generacion.load(memory_order_acquire) != CLIENTEID_GENERACION(id))
+        return -1;
+
+    return slot->shard.load(memory_order_acquire);
+}
+
+/* Pasa el cliente a otro shard cuando su grupo se migra. Lo llama el shard que lo cede, después de
+haberle dejado al nuevo la tarea que lo adopta: quien vea el shard nuevo encola detrás de ella */
+void registro_mover(struct registro_clientes *registro, clienteid_t id, int shard)
+{
+    uint32_t indice = CLIENTEID_INDICE(id);
+
+    if(indice >= registro->capacidad)
+        return;
+
+    struct registro_slot *slot = &registro->slots[indice];
+
+    if(slot->generacion.load(memory_order_relaxed) != CLIENTEID_GENERACION(id))
+        return;
+
+    slot->shard.store(shard, memory_order_release);
+}
+
+/* Cliente con ese ID, o NULL si ya no existe. Sólo debe llamarla el shard dueño del cliente */
+struct epoll_data_client * registro_cliente(struct registro_clientes *registro, clienteid_t id)
+{
+    uint32_t indice = CLIENTEID_INDICE(id);
+
+    if(indice >= registro->capacidad)
+        return NULL;
+
+    struct registro_slot *slot = &registro->slots[indice];
+
+    if(slot->generacion.load(memory_order_acquire) != CLIENTEID_GENERACION(id))
+        return NULL;
+
+    return slot->cliente.load(memory_order_acquire);
+}
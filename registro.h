@@ -0,0 +1,49 @@
+#ifndef _REGISTRO_H_
+#define _REGISTRO_H_
+
+#include <atomic>
+#include <mutex>
+
+#include "mensajes.h"
+#include "network.h"
+
+#define REGISTRO_CAPACIDAD_DEFECTO		(1 << 18)
+#define REGISTRO_FIN_LIBRES				0xffffffff
+
+/* Un ID de cliente es el índice de su hueco en el registro junto con la generación del hueco. Al
+darse de baja un cliente la generación avanza, de modo que su ID deja de valer aunque el hueco (o su
+socket) se reutilice para otro cliente. La generación empieza en 1, así que el ID 0 nunca es válido */
+#define CLIENTEID_NULO					((clienteid_t) 0)
+#define CLIENTEID(indice, generacion)	(((clienteid_t) (generacion) << 32) | (uint32_t) (indice))
+#define CLIENTEID_INDICE(id)			((uint32_t) (id))
+#define CLIENTEID_GENERACION(id)		((uint32_t) ((id) >> 32))
+
+using namespace std;
+
+/* Los campos atómicos se leen desde cualquier shard sin bloquear. Sólo el shard dueño del cliente
+lo da de baja, así que desde ese shard el puntero es siempre seguro de usar */
+struct registro_slot {
+	atomic<uint32_t> 				generacion;
+	atomic<int> 					shard;
+	atomic<struct epoll_data_client *> cliente;
+	uint32_t 						siguiente_libre;
+};
+
+/* Tabla de todos los clientes del servidor, indexada por ID. Las altas y bajas, que sólo ocurren al
+conectar y desconectar, comparten un mutex; las búsquedas no lo tocan */
+struct registro_clientes {
+	struct registro_slot 			*slots;
+	uint32_t 						capacidad;
+	uint32_t 						usados;
+	uint32_t 						libres;
+	mutex 							libres_mutex;
+};
+
+void registro_crear(struct registro_clientes *registro, uint32_t capacidad);
+clienteid_t registro_alta(struct registro_clientes *registro, struct epoll_data_client *cliente, int shard);
+void registro_baja(struct registro_clientes *registro, clienteid_t id);
+int registro_shard(struct registro_clientes *registro, clienteid_t id);
+void registro_mover(struct registro_clientes *registro, clienteid_t id, int shard);
+struct epoll_data_client * registro_cliente(struct registro_clientes *registro, clienteid_t id);
+
+#endif
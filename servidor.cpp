@@ -24,10 +24,20 @@
 #include <mutex>
 #include <iostream>
 #include <unordered_map>
+#include <atomic>
 #include <assert.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <random>
 
 #include "mensajes.h"
 #include "network.h"
+#include "reactor.h"
+#include "registro.h"
+#include "posicion_delta.h"
+#include "memoria.h"
+#include "metricas.h"
+#include "bitacora.h"
 
 #define SERVER_PORT  12345
 #define MAXEVENTS	 30000
@@ -36,487 +46,1921 @@
 #define FALSE            0
 
 #define MAX_GRUPOS 10000
-#define THREAD_POOL 1024
 
 
-#define _DEBUG_
 
 
+using namespace std;
+
+atomic<int> clientes_conectados(0);
+
+struct reactor_shard *shards;
+int num_shards;
+
+struct registro_clientes registro;
+
+bool agregar_acks = false;
+int tick_hz = 0;
+int radio_interes = 0;
+int puerto_udp = 0;
+int balanceo_ms = 0;
+int umbral_particion = 0;
+
+
+int manejar_frame(struct epoll_data_client * data_client, char * buffer_mensaje, int longitud, void * contexto);
+void desconectar_saturado(struct reactor_shard *shard, struct epoll_data_client * data_client);
+void difundir(struct reactor_shard *shard, struct epoll_data_client * origen, const vector_cliente &destinos, struct mensaje_compartido *difusion);
+void atender_difusion(struct reactor_shard *shard, struct difusion_particion *difusion);
+void difundir_particiones(struct reactor_shard *shard, struct grupo *grupo, clienteid_t origen, struct mensaje_compartido *mensaje,
+						  struct mensaje_compartido *delta, uint32_t difusiones, const struct mensaje_posicion *posicion);
+
+void unir_cliente_grupo(struct reactor_shard *shard, struct epoll_data_client *data, int operacion)
+{
+	struct grupo_key key;
+	struct grupo *grupo;
+
+	key.grupoid = data->grupoid;
+	grupo = &shard->clientes_grupo[key];
+	grupo->grupoid = data->grupoid;
+
+	data->grupo = grupo;
+	grupo_alta(grupo, data);
+
+	METRICA_SUMAR(metricas_hilo->clientes, 1);
+	if(grupo->miembros->size() == 1)
+		METRICA_SUMAR(metricas_hilo->grupos, 1);
+
+	/* Al llegar al umbral el dueño particiona el grupo: los miembros nuevos irán a todos los shards por
+	turno, cada uno con su partición. El primer miembro de una partición averigua si lo está, y cada
+	partición con miembros se apunta en la máscara del grupo para recibir sus difusiones */
+	if(umbral_particion > 0)
+	{
+		if(grupo->particiones == NULL && grupo->miembros->size() >= (uint) umbral_particion)
+		{
+			grupo->particiones = reactor_particionar_grupo(grupo->grupoid);
+			BITACORA(BITACORA_INFO, "GrupoID %d particionado entre los shards con %d miembros.", grupo->grupoid, (int) grupo->miembros->size());
+		}
+		else if(grupo->particiones == NULL && grupo->miembros->size() == 1)
+		{
+			grupo->particiones = reactor_grupo_particionado(grupo->grupoid);
+		}
+
+		if(grupo->particiones != NULL)
+			reactor_particion_marcar(grupo->particiones, shard->id, true);
+	}
+
+	data->estado = CLIENTE_CONECTADO;
+
+	if(shard->espera_activa_us > 0)
+		async_busy_poll(data, shard->espera_activa_us);
+
+	// Con io_uring el cliente sale del epoll, donde sólo quedan el handshake, los timers y el inbox
+	if(shard->uring != NULL)
+	{
+		if(operacion == EPOLL_CTL_MOD && epoll_ctl(shard->epollfd, EPOLL_CTL_DEL, data->socketfd, NULL) < 0)
+		{
+			perror("unir_cliente_grupo->epoll_ctl()");
+		}
+
+		async_uring_registrar(data);
+	}
+	else if(async_registrar(data, shard->epollfd, operacion) < 0)
+	{
+		perror("unir_cliente_grupo->epoll_ctl()");
+	}
+
+	// Lo que llegó detrás del MENSAJE_CONEXION en la misma lectura ya no generará evento
+	async_procesar_frames(data, manejar_frame, shard);
+}
+
+void ciclo_enlazar(struct reactor_shard *shard, struct ciclo_ack *ciclo)
+{
+	ciclo->siguiente = NULL;
+	ciclo->anterior = shard->ciclos_ultimo;
+
+	if(shard->ciclos_ultimo != NULL)
+		shard->ciclos_ultimo->siguiente = ciclo;
+	else
+		shard->ciclos_primero = ciclo;
+
+	shard->ciclos_ultimo = ciclo;
+}
+
+void ciclo_desenlazar(struct reactor_shard *shard, struct ciclo_ack *ciclo)
+{
+	if(ciclo->anterior != NULL)
+		ciclo->anterior->siguiente = ciclo->siguiente;
+	else
+		shard->ciclos_primero = ciclo->siguiente;
+
+	if(ciclo->siguiente != NULL)
+		ciclo->siguiente->anterior = ciclo->anterior;
+	else
+		shard->ciclos_ultimo = ciclo->anterior;
+}
+
+/* Enlaza un ciclo que llega de otro shard en el sitio que le toca por su límite, para que la lista
+siga ordenada por vencimiento. Los que llegan suelen ser recientes, así que se busca desde el final */
+void ciclo_insertar(struct reactor_shard *shard, struct ciclo_ack *ciclo)
+{
+	struct ciclo_ack *anterior = shard->ciclos_ultimo;
+
+	while(anterior != NULL && anterior->limite > ciclo->limite)
+		anterior = anterior->anterior;
+
+	ciclo->anterior = anterior;
+	ciclo->siguiente = anterior != NULL ? anterior->siguiente : shard->ciclos_primero;
+
+	if(ciclo->siguiente != NULL)
+		ciclo->siguiente->anterior = ciclo;
+	else
+		shard->ciclos_ultimo = ciclo;
+
+	if(anterior != NULL)
+		anterior->siguiente = ciclo;
+	else
+		shard->ciclos_primero = ciclo;
+}
+
+/* Envía al origen el MENSAJE_CICLO_COMPLETO con los miembros que no han respondido, si es que el
+origen sigue conectado, y descarta el ciclo. Un origen al que no se le puede enviar se desconecta */
+void ciclo_cerrar(struct reactor_shard *shard, struct ciclo_ack *ciclo)
+{
+	struct epoll_data_client *origen = registro_cliente(&registro, ciclo->origen);
+
+	if(origen != NULL && origen->estado == CLIENTE_CONECTADO)
+	{
+		struct mensaje_ciclo_completo completo;
+		vector<char> buffer_mensaje(tamano_frame(MENSAJE_CICLO_COMPLETO) + ciclo->pendientes * sizeof(clienteid_t));
+		int faltan = 0;
+
+		buffer_mensaje[0] = MENSAJE_CICLO_COMPLETO;
+
+		for(uint i = 0; i < ciclo->esperados.size() && faltan < ciclo->pendientes; i++)
+		{
+			if(!(ciclo->recibidos[i / 64] & (1ULL << (i % 64))))
+			{
+				memcpy(&buffer_mensaje[tamano_frame(MENSAJE_CICLO_COMPLETO) + faltan * sizeof(clienteid_t)], &ciclo->esperados[i], sizeof(clienteid_t));
+				faltan++;
+			}
+		}
+
+		completo.numero_secuencia = ciclo->secuencia;
+		completo.esperados = ciclo->esperados.size();
+		completo.n_faltan = faltan;
+		memcpy(&buffer_mensaje[1], &completo, sizeof(completo));
+
+		struct mensaje_compartido *mensaje = mensaje_crear(buffer_mensaje.data(), buffer_mensaje.size());
+
+		if(async_write_compartido(origen, mensaje) < 0)
+		{
+			desconectar_saturado(shard, origen);
+		}
+
+		mensaje_liberar(mensaje);
+	}
+
+	ciclo_desenlazar(shard, ciclo);
+	shard->ciclos.erase(ciclo->origen);
+	delete ciclo;
+}
+
+/* Abre el ciclo de una posición recién reenviada a miembros. Si el origen tenía otro abierto, ése se
+cierra primero con los que le falten */
+void ciclo_abrir(struct reactor_shard *shard, struct epoll_data_client *data_client, const vector_cliente &miembros, uint32_t secuencia)
+{
+	mapa_ciclos::iterator anterior = shard->ciclos.find(data_client->clienteid);
+
+	if(anterior != shard->ciclos.end())
+		ciclo_cerrar(shard, anterior->second);
+
+	struct ciclo_ack *ciclo = new struct ciclo_ack;
+
+	ciclo->origen = data_client->clienteid;
+	ciclo->secuencia = secuencia;
+	ciclo->limite = reloj_ms() + CICLO_TIMEOUT_MS;
+
+	for(uint i = 0; i < miembros.size() && ciclo->esperados.size() < UINT16_MAX; i++)
+	{
+		if(miembros[i] != data_client && miembros[i]->estado == CLIENTE_CONECTADO)
+			ciclo->esperados.push_back(miembros[i]->clienteid);
+	}
+
+	sort(ciclo->esperados.begin(), ciclo->esperados.end());
+	ciclo->recibidos.assign((ciclo->esperados.size() + 63) / 64, 0);
+	ciclo->pendientes = ciclo->esperados.size();
+
+	shard->ciclos[ciclo->origen] = ciclo;
+	ciclo_enlazar(shard, ciclo);
+
+	if(ciclo->pendientes == 0)
+		ciclo_cerrar(shard, ciclo);
+}
+
+void ciclo_ack_recibido(struct reactor_shard *shard, clienteid_t origen, clienteid_t emisor, uint32_t secuencia)
+{
+	mapa_ciclos::iterator it = shard->ciclos.find(origen);
+
+	if(it == shard->ciclos.end() || it->second->secuencia != secuencia)
+		return;
+
+	struct ciclo_ack *ciclo = it->second;
+	vector<clienteid_t>::iterator pos = lower_bound(ciclo->esperados.begin(), ciclo->esperados.end(), emisor);
+
+	if(pos == ciclo->esperados.end() || *pos != emisor)
+		return;
+
+	uint indice = pos - ciclo->esperados.begin();
+	uint64_t bit = 1ULL << (indice % 64);
+
+	if(ciclo->recibidos[indice / 64] & bit)
+		return;
+
+	ciclo->recibidos[indice / 64] |= bit;
+
+	if(--ciclo->pendientes == 0)
+		ciclo_cerrar(shard, ciclo);
+}
+
+void expirar_ciclos(struct reactor_shard *shard)
+{
+	uint64_t expiraciones;
+	uint64_t ahora = reloj_ms();
+
+	if(read(shard->timerfd, &expiraciones, sizeof(expiraciones)) < 0 && errno != EAGAIN)
+	{
+		perror("expirar_ciclos->read()");
+	}
+
+	while(shard->ciclos_primero != NULL && shard->ciclos_primero->limite <= ahora)
+	{
+		ciclo_cerrar(shard, shard->ciclos_primero);
+	}
+}
+
+/* Entrega un mensaje unicast a un cliente de este shard. El ID se vuelve a comprobar aquí porque
+entre el envío de la tarea y su recogida el destino ha podido desconectarse */
+void entregar_unicast(struct reactor_shard *shard, clienteid_t destino, clienteid_t emisor, grupoid_t grupoid, struct mensaje_compartido *mensaje)
+{
+	// El reconocimiento se apunta a quien lo envió según el servidor, igual que en el propio shard
+	if(agregar_acks && mensaje->datos[0] == MENSAJE_RECONOCIMIENTO)
+	{
+		struct mensaje_reconocimiento reconocimiento;
+		memcpy(&reconocimiento, &mensaje->datos[1], sizeof(reconocimiento));
+
+		ciclo_ack_recibido(shard, destino, emisor, reconocimiento.numero_secuencia);
+		return;
+	}
+
+	struct epoll_data_client *cliente = registro_cliente(&registro, destino);
+
+	if(cliente != NULL && cliente->grupoid == grupoid && cliente->estado == CLIENTE_CONECTADO)
+	{
+		if(async_write_compartido(cliente, mensaje) < 0)
+		{
+			desconectar_saturado(shard, cliente);
+		}
+	}
+}
+
+/* Adopta un grupo que cede otro shard: lo pasa a su mapa con sus ciclos abiertos y registra a los
+miembros en su epoll. El registro con EPOLL_CTL_ADD avisa de lo que ya esté esperando en cada socket,
+y lo que quedara entero en los buffers de lectura se atiende aquí. La ubicación nueva se publica al
+dejar la tarea, así que con -r este shard ha podido unir al grupo clientes propios antes de recogerla:
+esos miembros se suman a los que llegan, con sus posiciones en la rejilla */
+void adoptar_grupo(struct reactor_shard *shard, struct migracion_grupo *migracion)
+{
+	struct grupo_key key;
+	struct grupo *grupo;
+
+	key.grupoid = migracion->grupo.grupoid;
+	grupo = &shard->clientes_grupo[key];
+
+	struct grupo local = *grupo;
+	bool habia_miembros = local.miembros != NULL && !local.miembros->empty();
+
+	*grupo = migracion->grupo;
+
+	snapshot_grupo miembros = grupo->miembros;
+
+	if(habia_miembros)
+	{
+		for(uint i = 0; i < local.miembros->size(); i++)
+		{
+			struct epoll_data_client *miembro = (*local.miembros)[i];
+
+			if(local.rejilla != NULL)
+				rejilla_quitar(local.rejilla, miembro);
+
+			miembro->grupo = grupo;
+			grupo_alta(grupo, miembro);
+
+			if(radio_interes > 0 && miembro->tiene_posicion)
+			{
+				if(grupo->rejilla == NULL)
+					grupo->rejilla = rejilla_crear(radio_interes);
+
+				rejilla_mover(grupo->rejilla, miembro, miembro->posicion.posicion_x, miembro->posicion.posicion_y);
+			}
+		}
+
+		grupo->carga += local.carga;
+		METRICA_SUMAR(metricas_hilo->grupos, -1);
+	}
+
+	rejilla_liberar(local.rejilla);
+
+	// Si el grupo local ya estaba en la lista de cambiados sigue en ella, en la misma dirección
+	if(local.cambiado)
+		grupo->cambiado = true;
+	else if(grupo->cambiado)
+		shard->grupos_cambiados.push_back(grupo);
+
+	for(uint i = 0; i < miembros->size(); i++)
+	{
+		(*miembros)[i]->grupo = grupo;
+
+		if(async_registrar((*miembros)[i], shard->epollfd, EPOLL_CTL_ADD) < 0)
+		{
+			perror("adoptar_grupo->epoll_ctl()");
+		}
+	}
+
+	for(uint i = 0; i < migracion->ciclos.size(); i++)
+	{
+		shard->ciclos[migracion->ciclos[i]->origen] = migracion->ciclos[i];
+		ciclo_insertar(shard, migracion->ciclos[i]);
+	}
+
+	METRICA_SUMAR(metricas_hilo->clientes, miembros->size());
+	METRICA_SUMAR(metricas_hilo->grupos, 1);
+
+	delete migracion;
+
+	for(uint i = 0; i < miembros->size(); i++)
+	{
+		if((*miembros)[i]->estado == CLIENTE_CONECTADO)
+			async_procesar_frames((*miembros)[i], manejar_frame, shard);
+	}
+}
+
+/* Una tarea que llega después de que este shard haya cedido el grupo al que va se pasa al shard que
+lo tiene ahora, donde queda detrás de la migración. Devuelve si la ha reenviado */
+bool reenviar_tarea(struct reactor_shard *shard, struct tarea_shard &tarea, int dueno)
+{
+	if(dueno < 0 || dueno == shard->id)
+		return false;
+
+	reactor_encolar(&shards[dueno], tarea);
+	return true;
+}
+
+void procesar_tareas(struct reactor_shard *shard)
+{
+	vector<struct tarea_shard> tareas;
+
+	reactor_recoger(shard, tareas);
+
+	for(uint i = 0; i < tareas.size(); i++)
+	{
+		switch(tareas[i].tipo)
+		{
+			case TAREA_NUEVO_CLIENTE:
+			{
+				int dueno = reactor_dueno_grupo(tareas[i].cliente->grupoid, num_shards);
+
+				if(reenviar_tarea(shard, tareas[i], dueno))
+					registro_mover(&registro, tareas[i].cliente->clienteid, dueno);
+				else
+					unir_cliente_grupo(shard, tareas[i].cliente, EPOLL_CTL_ADD);
+				break;
+			}
+			case TAREA_UNICAST:
+				if(reenviar_tarea(shard, tareas[i], registro_shard(&registro, tareas[i].destino)))
+					break;
+
+				entregar_unicast(shard, tareas[i].destino, tareas[i].emisor, tareas[i].grupoid, tareas[i].mensaje);
+				mensaje_liberar(tareas[i].mensaje);
+				break;
+			case TAREA_MIGRAR_GRUPO:
+				adoptar_grupo(shard, tareas[i].migracion);
+				break;
+		}
+	}
+
+	// El mismo eventfd avisa de las difusiones que dejan las demás particiones
+	static thread_local vector<struct difusion_particion> difusiones;
+
+	reactor_particiones_recoger(shard, difusiones);
+
+	for(uint i = 0; i < difusiones.size(); i++)
+		atender_difusion(shard, &difusiones[i]);
+}
+
+/* Cada periodo de balanceo el shard publica la carga que han dado sus grupos y la compara con la del
+shard más libre. Si la diferencia es grande elige el grupo con más carga que no pase de la mitad de la
+diferencia, para acercar los dos shards sin invertir el desequilibrio, y lo cede al final de la vuelta.
+Un grupo que por sí solo supera ese margen no se mueve: sólo cambiaría de sitio el shard cargado */
+void revisar_balanceo(struct reactor_shard *shard)
+{
+	uint64_t expiraciones, carga = 0, libre = UINT64_MAX;
+	struct grupo *elegido = NULL;
+	int destino = -1;
+
+	if(read(shard->balanceofd, &expiraciones, sizeof(expiraciones)) < 0 && errno != EAGAIN)
+	{
+		perror("revisar_balanceo->read()");
+	}
+
+	for(mapa_grupos::iterator it = shard->clientes_grupo.begin(); it != shard->clientes_grupo.end(); ++it)
+		carga += it->second.carga;
+
+	shard->carga.store(carga, memory_order_relaxed);
+
+	for(int i = 0; i < num_shards; i++)
+	{
+		uint64_t otra = shards[i].carga.load(memory_order_relaxed);
+
+		if(i != shard->id && otra < libre)
+		{
+			libre = otra;
+			destino = i;
+		}
+	}
+
+	if(destino >= 0 && carga >= BALANCEO_CARGA_MINIMA && libre < carga && carga - libre > carga / BALANCEO_DESEQUILIBRIO)
+	{
+		uint64_t margen = (carga - libre) / 2;
+
+		for(mapa_grupos::iterator it = shard->clientes_grupo.begin(); it != shard->clientes_grupo.end(); ++it)
+		{
+			struct grupo *grupo = &it->second;
+
+			if(grupo->particiones == NULL && grupo->carga > 0 && grupo->carga <= margen && (elegido == NULL || grupo->carga > elegido->carga))
+				elegido = grupo;
+		}
+	}
+
+	if(elegido != NULL)
+	{
+		shard->migrar_grupo = elegido->grupoid;
+		shard->migrar_destino = destino;
+	}
+
+	for(mapa_grupos::iterator it = shard->clientes_grupo.begin(); it != shard->clientes_grupo.end(); ++it)
+		it->second.carga = 0;
+}
+
+/* Cede el grupo elegido por el balanceo al shard migrar_destino. Se llama al final de la vuelta, con el
+lote vaciado y las bajas atendidas, así que a ningún miembro le queda nada a medias salvo su cola de
+salida, que viaja con él. Los miembros salen del epoll de este shard y no se vuelve a leer de ellos hasta
+que el otro los registre en el suyo; como cada socket conserva el orden, sus mensajes se atienden en el
+mismo orden antes y después. La ubicación del grupo y el shard de los miembros en el registro cambian
+después de dejar la tarea: lo que se envíe al otro shard por haberlos visto va detrás de ella, y lo que
+aún llegue aquí se le reenvía */
+void migrar_grupo(struct reactor_shard *shard)
+{
+	int destino = shard->migrar_destino;
+	struct grupo_key key;
+
+	shard->migrar_destino = -1;
+	key.grupoid = shard->migrar_grupo;
+
+	mapa_grupos::iterator it = shard->clientes_grupo.find(key);
+
+	if(it == shard->clientes_grupo.end() || it->second.miembros == NULL || it->second.miembros->empty())
+		return;
+
+	struct grupo *grupo = &it->second;
+	struct migracion_grupo *migracion = new struct migracion_grupo;
+	snapshot_grupo miembros = grupo->miembros;
+
+	// La rejilla de interés pasa con el grupo al otro shard, que es quien la liberará
+	migracion->grupo = *grupo;
+
+	if(grupo->cambiado)
+		shard->grupos_cambiados.erase(remove(shard->grupos_cambiados.begin(), shard->grupos_cambiados.end(), grupo), shard->grupos_cambiados.end());
+
+	for(uint i = 0; i < miembros->size(); i++)
+	{
+		struct epoll_data_client *miembro = (*miembros)[i];
+		mapa_ciclos::iterator ciclo = shard->ciclos.find(miembro->clienteid);
+
+		if(epoll_ctl(shard->epollfd, EPOLL_CTL_DEL, miembro->socketfd, NULL) < 0)
+		{
+			perror("migrar_grupo->epoll_ctl()");
+		}
+
+		miembro->epollfd = -1;
+		miembro->epollout = false;
+		miembro->grupo = &migracion->grupo;
+
+		if(ciclo != shard->ciclos.end())
+		{
+			ciclo_desenlazar(shard, ciclo->second);
+			migracion->ciclos.push_back(ciclo->second);
+			shard->ciclos.erase(ciclo);
+		}
+	}
+
+	shard->clientes_grupo.erase(it);
+
+	METRICA_SUMAR(metricas_hilo->clientes, -(int64_t) miembros->size());
+	METRICA_SUMAR(metricas_hilo->grupos, -1);
+	METRICA_SUMAR(metricas_hilo->grupos_migrados, 1);
+
+	BITACORA(BITACORA_INFO, "GrupoID %d migrado del shard %d al %d con %d miembros.", key.grupoid, shard->id, destino, (int) miembros->size());
+
+	struct tarea_shard tarea;
+	tarea.tipo = TAREA_MIGRAR_GRUPO;
+	tarea.cliente = NULL;
+	tarea.grupoid = key.grupoid;
+	tarea.mensaje = NULL;
+	tarea.migracion = migracion;
+	reactor_encolar(&shards[destino], tarea);
+
+	reactor_ubicar_grupo(key.grupoid, destino, num_shards);
+
+	for(uint i = 0; i < miembros->size(); i++)
+		registro_mover(&registro, (*miembros)[i]->clienteid, destino);
+}
+
+void handshake_pendiente(struct aceptador *aceptador, struct epoll_data_client *data)
+{
+	data->limite_handshake = reloj_ms() + HANDSHAKE_TIMEOUT_MS;
+	data->handshake_siguiente = NULL;
+	data->handshake_anterior = aceptador->ultimo;
+
+	if(aceptador->ultimo != NULL)
+		aceptador->ultimo->handshake_siguiente = data;
+	else
+		aceptador->primero = data;
+
+	aceptador->ultimo = data;
+}
+
+void handshake_terminado(struct aceptador *aceptador, struct epoll_data_client *data)
+{
+	if(data->handshake_anterior != NULL)
+		data->handshake_anterior->handshake_siguiente = data->handshake_siguiente;
+	else
+		aceptador->primero = data->handshake_siguiente;
+
+	if(data->handshake_siguiente != NULL)
+		data->handshake_siguiente->handshake_anterior = data->handshake_anterior;
+	else
+		aceptador->ultimo = data->handshake_anterior;
+
+	data->handshake_siguiente = NULL;
+	data->handshake_anterior = NULL;
+}
+
+void cerrar_handshake(struct aceptador *aceptador, struct epoll_data_client *data)
+{
+	handshake_terminado(aceptador, data);
+	close(data->socketfd);
+	free_epoll_data(data);
+}
+
+// Cierra las conexiones que no han enviado su MENSAJE_CONEXION a tiempo
+void expirar_handshakes(struct aceptador *aceptador)
+{
+	uint64_t expiraciones, ahora = reloj_ms();
+
+	if(read(aceptador->timerfd, &expiraciones, sizeof(expiraciones)) < 0 && errno != EAGAIN)
+	{
+		perror("expirar_handshakes->read()");
+	}
+
+	while(aceptador->primero != NULL && aceptador->primero->limite_handshake <= ahora)
+	{
+		BITACORA(BITACORA_DEPURACION, "Handshake caducado en socket: %d", aceptador->primero->socketfd);
+		cerrar_handshake(aceptador, aceptador->primero);
+	}
+}
+
+// Da de alta un socket recién aceptado y lo deja esperando su MENSAJE_CONEXION
+void aceptar_socket(struct aceptador *aceptador, int new_client_sd)
+{
+	epoll_data_client *data = new_epoll_data(new_client_sd);
+	BITACORA(BITACORA_DEPURACION, "Nuevo cliente en socket: %d", new_client_sd);
+
+	if(async_registrar(data, aceptador->epollfd, EPOLL_CTL_ADD) < 0)
+	{
+		perror("epoll_ctl()");
+		close(new_client_sd);
+		free_epoll_data(data);
+		return;
+	}
+
+	handshake_pendiente(aceptador, data);
+}
+
+void aceptar_clientes(struct aceptador *aceptador)
+{
+	BITACORA(BITACORA_DEPURACION, "Recibida nueva conexión.");
+	int new_client_sd;
+
+	do
+	{
+		struct sockaddr_in new_client_sockaddr;
+		socklen_t clientsize = sizeof(new_client_sockaddr);
+		new_client_sd = accept4(aceptador->listen_sd, (struct sockaddr *)&new_client_sockaddr, &clientsize, SOCK_NONBLOCK);
+		if(new_client_sd < 0)
+		{
+			if(errno != EWOULDBLOCK && errno != EAGAIN)
+			{
+				perror("accept4()");
+			}
+			break;
+		}
+
+		aceptar_socket(aceptador, new_client_sd);
+
+	} while (new_client_sd >= 0);
+}
+
+// Copia el primer frame completo, el MENSAJE_CONEXION, al buffer de procesar_handshake() y para la lectura
+int frame_handshake(struct epoll_data_client * data_client, char * frame, int longitud, void * contexto)
+{
+	memcpy(contexto, frame, longitud);
+	return 1;
+}
+
+/* El testigo sólo lo conocen el servidor y el cliente que lo recibe por su conexión TCP, así que quien
+envía un MENSAJE_ENLACE_UDP con él es ese mismo cliente */
+uint64_t generar_testigo()
+{
+	static thread_local mt19937_64 generador(random_device{}());
+	uint64_t testigo;
+
+	while((testigo = generador()) == 0);
+
+	return testigo;
+}
+
+// Indica al cliente el puerto UDP del shard de su grupo, o 0 si el servidor no tiene canal UDP
+void enviar_canal_udp(struct epoll_data_client * data_client, int shard)
+{
+	char buffer_mensaje[40];
+	struct mensaje_canal_udp canal;
+
+	canal.puerto = puerto_udp > 0 ? puerto_udp + shard : 0;
+	canal.testigo = 0;
+
+	if(puerto_udp > 0)
+	{
+		data_client->udp_testigo = generar_testigo();
+		canal.testigo = data_client->udp_testigo;
+	}
+
+	buffer_mensaje[0] = MENSAJE_CANAL_UDP;
+	memcpy(&buffer_mensaje[1], &canal, sizeof(canal));
+
+	async_write_directo(data_client, buffer_mensaje, tamano_frame(MENSAJE_CANAL_UDP));
+}
+
+/* Avanza el handshake de un cliente aceptado por aceptador. El MENSAJE_CONEXION se lee con el mismo
+entramado incremental que el resto de mensajes, así que un cliente que lo envía a trozos sólo espera
+a su siguiente evento, sin bloquear al resto. local es el shard que lo ha aceptado (NULL si es el hilo
+aceptador). Si el grupo pedido pertenece a ese mismo shard el cliente se queda en él; si no, se saca del
+epoll del aceptador y se entrega al shard dueño del grupo */
+void procesar_handshake(struct reactor_shard *local, struct aceptador *aceptador, struct epoll_data_client *data_client)
+{
+	char buffer_mensaje[40];
+	int rc = async_read_frames(data_client, frame_handshake, buffer_mensaje);
+
+	if(rc == READ_BLOCK)
+	{
+		return;
+	}
+
+	if(rc != READ_SUCCESS || buffer_mensaje[0] != MENSAJE_CONEXION)
+	{
+		cerrar_handshake(aceptador, data_client);
+		return;
+	}
+
+	struct mensaje_conexion nueva_conexion;
+	memcpy(&nueva_conexion, &buffer_mensaje[1], sizeof(struct mensaje_conexion));
+
+	int index = reactor_shard_grupo(nueva_conexion.grupo, num_shards);
+	clienteid_t clienteid = registro_alta(&registro, data_client, index);
+
+	if(clienteid == CLIENTEID_NULO)
+	{
+		BITACORA(BITACORA_AVISO, "Registro de clientes lleno, se rechaza el socket: %d", data_client->socketfd);
+		cerrar_handshake(aceptador, data_client);
+		return;
+	}
+
+	handshake_terminado(aceptador, data_client);
+
+	data_client->clienteid = clienteid;
+	data_client->grupoid = nueva_conexion.grupo;
+	data_client->capacidades = nueva_conexion.capacidades;
+
+	clientes_conectados++;
+	BITACORA(BITACORA_DEPURACION, "Recibida petición a GrupoID: %d. Socket: %d. ClienteID: %" PRIu64 ". Clientes conectados: %d",
+			 nueva_conexion.grupo, data_client->socketfd, clienteid, clientes_conectados.load());
+	mensaje_t tipo_mensaje = MENSAJE_CONEXION_SATISFACTORIA;
+	struct mensaje_conexion_satisfactoria conexion_satisfactoria;
+	conexion_satisfactoria.cliente_id = clienteid;
+
+	memcpy(buffer_mensaje, &tipo_mensaje, sizeof(mensaje_t));
+	memcpy(buffer_mensaje + sizeof(mensaje_t), &conexion_satisfactoria, sizeof(struct mensaje_conexion_satisfactoria));
+
+	/* La respuesta no espera a que el cliente la lea: se deja en el socket y lo que el cliente haya
+	enviado detrás del MENSAJE_CONEXION, esté aún en el socket o ya en su buffer de lectura, lo
+	atenderá el shard de su grupo */
+	async_write_directo(data_client, buffer_mensaje, tamano_frame(MENSAJE_CONEXION_SATISFACTORIA));
+
+	if(nueva_conexion.capacidades & CAPACIDAD_UDP)
+	{
+		enviar_canal_udp(data_client, index);
+	}
+
+	if(local != NULL && local->id == index)
+	{
+		unir_cliente_grupo(local, data_client, EPOLL_CTL_MOD);
+		return;
+	}
+
+	epoll_ctl(aceptador->epollfd, EPOLL_CTL_DEL, data_client->socketfd, NULL);
+
+	// El grupo es propiedad de su shard: es él quien lo añade a sus miembros y a su epoll
+	struct tarea_shard tarea;
+	tarea.tipo = TAREA_NUEVO_CLIENTE;
+	tarea.cliente = data_client;
+	reactor_encolar(&shards[index], tarea);
+}
+
+typedef void (*manejador_mensaje)(struct reactor_shard *shard, struct epoll_data_client *data_client, char *buffer_mensaje);
+
+/* Único camino de baja de un miembro conectado. Se cierra su conexión y deja el registro y su grupo en
+el momento, así que desde aquí nadie más le envía nada, pero el aviso al resto del grupo se deja para
+el final de la vuelta: los MENSAJE_DESCONEXION de todas las bajas de un grupo salen juntos en un solo
+mensaje compartido. La memoria del cliente no se libera hasta que ningún shard puede tener su puntero */
+void desconectar_cliente(struct reactor_shard *shard, struct epoll_data_client * data_client)
+{
+	if(data_client->estado == CLIENTE_DESCONECTADO)
+		return;
+
+	async_cerrar(data_client);
+	data_client->estado = CLIENTE_DESCONECTADO;
+	registro_baja(&registro, data_client->clienteid);
+	grupo_baja(data_client->grupo, data_client);
+	clientes_conectados--;
+
+	METRICA_SUMAR(metricas_hilo->clientes, -1);
+	METRICA_SUMAR(metricas_hilo->desconexiones, 1);
+	if(data_client->grupo->miembros->empty())
+	{
+		METRICA_SUMAR(metricas_hilo->grupos, -1);
+
+		// La rejilla se vuelve a crear con la primera posición si el grupo se llena de nuevo
+		rejilla_liberar(data_client->grupo->rejilla);
+		data_client->grupo->rejilla = NULL;
+
+		if(data_client->grupo->particiones != NULL)
+			reactor_particion_marcar(data_client->grupo->particiones, shard->id, false);
+	}
+
+	shard->desconectados.push_back(data_client);
+	BITACORA(BITACORA_DEPURACION, "Desconectado ClienteID: %" PRIu64 " del GrupoID: %d", data_client->clienteid, data_client->grupoid);
+}
+
+/* Cierra a un miembro cuya cola de salida ha rebasado el límite o al que no se ha podido enviar */
+void desconectar_saturado(struct reactor_shard *shard, struct epoll_data_client * data_client)
+{
+	BITACORA(BITACORA_AVISO, "Error enviando a ID %" PRIu64, data_client->clienteid);
+	if(data_client->estado != CLIENTE_DESCONECTADO)
+		METRICA_SUMAR(metricas_hilo->saturados, 1);
+
+	desconectar_cliente(shard, data_client);
+}
+
+// Manejador de async_lote_terminar() para los clientes cuyo socket ha fallado al vaciar el lote
+static void envio_fallido(struct epoll_data_client * data_client, void * contexto)
+{
+	desconectar_saturado((struct reactor_shard *) contexto, data_client);
+}
+
+static bool menor_grupo(const struct epoll_data_client *a, const struct epoll_data_client *b)
+{
+	return a->grupo < b->grupo;
+}
+
+/* Avisa de las bajas de esta vuelta a los miembros que quedan en cada grupo y retira a los clientes
+dados de baja. Un destinatario que se satura aquí entra en la lista y se atiende en la misma pasada */
+void atender_desconexiones(struct reactor_shard *shard)
+{
+	vector<struct epoll_data_client *> &desconectados = shard->desconectados;
+	uint procesados = 0;
+
+	while(procesados < desconectados.size())
+	{
+		sort(desconectados.begin() + procesados, desconectados.end(), menor_grupo);
+
+		uint fin = desconectados.size();
+
+		for(uint i = procesados; i < fin; )
+		{
+			struct grupo *grupo = desconectados[i]->grupo;
+			uint j = i;
+
+			while(j < fin && desconectados[j]->grupo == grupo)
+				j++;
+
+			int longitud = tamano_frame(MENSAJE_DESCONEXION);
+			vector<char> buffer_mensaje((j - i) * longitud);
+
+			for(uint k = i; k < j; k++)
+			{
+				struct mensaje_desconexion desconexion;
+				desconexion.cliente_id_origen = desconectados[k]->clienteid;
+
+				buffer_mensaje[(k - i) * longitud] = MENSAJE_DESCONEXION;
+				memcpy(&buffer_mensaje[(k - i) * longitud + 1], &desconexion, sizeof(desconexion));
+			}
+
+			struct mensaje_compartido *difusion = mensaje_crear(buffer_mensaje.data(), buffer_mensaje.size());
+			snapshot_grupo miembros = grupo->miembros;
+
+			difundir(shard, NULL, *miembros, difusion);
+
+			if(grupo->particiones != NULL)
+				difundir_particiones(shard, grupo, CLIENTEID_NULO, difusion, NULL, 0, NULL);
+
+			mensaje_liberar(difusion);
+			i = j;
+		}
+
+		procesados = fin;
+	}
+
+	for(uint i = 0; i < desconectados.size(); i++)
+		reactor_retirar(shard, desconectados[i]);
+
+	desconectados.clear();
+}
+
+/* Pasa un mensaje de un grupo particionado a las particiones de los demás shards, que lo repartirán
+entre sus miembros. Sólo va a los shards que la máscara del grupo marca con miembros; uno que se
+apunte mientras tanto se pierde lo anterior a su primer miembro, que tampoco le tocaba. Entre cada par
+de shards la cola conserva el orden, así que los mensajes de un mismo origen llegan a todos los
+miembros en el orden en que se enviaron */
+void difundir_particiones(struct reactor_shard *shard, struct grupo *grupo, clienteid_t origen, struct mensaje_compartido *mensaje,
+						  struct mensaje_compartido *delta, uint32_t difusiones, const struct mensaje_posicion *posicion)
+{
+	struct difusion_particion difusion;
+	struct particiones_grupo *particiones = grupo->particiones;
+
+	difusion.grupoid = grupo->grupoid;
+	difusion.origen = origen;
+	difusion.mensaje = mensaje;
+	difusion.delta = delta;
+	difusion.difusiones = difusiones;
+	difusion.posicion = posicion != NULL;
+	difusion.x = posicion != NULL ? posicion->posicion_x : 0;
+	difusion.y = posicion != NULL ? posicion->posicion_y : 0;
+
+	for(int palabra = 0; palabra < particiones->palabras; palabra++)
+	{
+		uint64_t shards_grupo = particiones->shards[palabra].load(memory_order_acquire);
+
+		for(; shards_grupo != 0; shards_grupo &= shards_grupo - 1)
+		{
+			int i = palabra * 64 + __builtin_ctzll(shards_grupo);
+
+			if(i == shard->id)
+				continue;
+
+			mensaje_retener(mensaje);
+			if(delta != NULL)
+				mensaje_retener(delta);
+
+			reactor_particion_enviar(shard, i, difusion);
+		}
+	}
+}
+
+// Envía difusion a los destinos salvo al propio origen
+void difundir(struct reactor_shard *shard, struct epoll_data_client * origen, const vector_cliente &destinos, struct mensaje_compartido *difusion)
+{
+	for(uint i = 0; i < destinos.size(); i++)
+	{
+		if(destinos[i] != origen && destinos[i]->estado == CLIENTE_CONECTADO)
+		{
+			if (async_write_compartido(destinos[i], difusion) < 0)
+			{
+				desconectar_saturado(shard, destinos[i]);
+			}
+		}
+	}
+}
+
+/* Reenvía el frame a todo el grupo salvo al origen. Se codifica una vez y todos los destinatarios
+comparten el mismo mensaje */
+template<mensaje_t T> void difundir_grupo(struct reactor_shard *shard, struct epoll_data_client * data_client, char * buffer_mensaje)
+{
+	static_assert(mensaje_traits<T>::ruta == RUTA_GRUPO, "El mensaje no se difunde al grupo");
+
+	snapshot_grupo miembros = data_client->grupo->miembros;
+
+	struct mensaje_compartido *difusion = mensaje_crear(buffer_mensaje, tamano_frame(T));
+
+	data_client->grupo->carga += miembros->size();
+	metricas_reenvio(miembros->size());
+	difundir(shard, data_client, *miembros, difusion);
+
+	if(data_client->grupo->particiones != NULL)
+		difundir_particiones(shard, data_client->grupo, data_client->clienteid, difusion, NULL, 0, NULL);
+
+	mensaje_liberar(difusion);
+}
+
+/* Reenvía el frame al cliente indicado en cliente_id_destino, que la tabla de descriptores sitúa
+dentro de la estructura. El registro lleva directamente al shard del destino; si es otro shard el
+mensaje le llega por su inbox. Sólo se entrega dentro del grupo del origen */
+template<mensaje_t T> void reenviar_unicast(struct reactor_shard *shard, struct epoll_data_client * data_client, char * buffer_mensaje)
+{
+	static_assert(mensaje_traits<T>::ruta == RUTA_UNICAST, "El mensaje no va a un único cliente");
+
+	clienteid_t destino;
+	memcpy(&destino, &buffer_mensaje[sizeof(mensaje_t) + descriptores_mensaje[T].offset_destino], sizeof(destino));
+
+	int shard_destino = registro_shard(&registro, destino);
+
+	if(shard_destino < 0)
+	{
+		return;
+	}
+
+	if(shard_destino == shard->id)
+	{
+		struct epoll_data_client *cliente = registro_cliente(&registro, destino);
+
+		if(cliente == NULL || cliente->grupoid != data_client->grupoid || cliente->estado != CLIENTE_CONECTADO)
+		{
+			return;
+		}
+
+		// Los reconocimientos van por el canal UDP del destino si lo tiene; los nombres, siempre por TCP
+		if(T == MENSAJE_RECONOCIMIENTO && cliente->udp_enlazado)
+		{
+			struct mensaje_compartido *mensaje = mensaje_crear(buffer_mensaje, tamano_frame(T));
+			udp_encolar(&shard->udp, &cliente->udp_direccion, mensaje);
+			mensaje_liberar(mensaje);
+		}
+		else if(async_write(cliente, buffer_mensaje, tamano_frame(T)) < 0)
+		{
+			desconectar_saturado(shard, cliente);
+		}
+		return;
+	}
+
+	struct tarea_shard tarea;
+	tarea.tipo = TAREA_UNICAST;
+	tarea.cliente = NULL;
+	tarea.destino = destino;
+	tarea.emisor = data_client->clienteid;
+	tarea.grupoid = data_client->grupoid;
+	tarea.mensaje = mensaje_crear(buffer_mensaje, tamano_frame(T));
+	reactor_encolar(&shards[shard_destino], tarea);
+}
+
+void manejar_saludo(struct reactor_shard *shard, struct epoll_data_client * data_client, char * buffer_mensaje)
+{
+	BITACORA(BITACORA_DEPURACION, "Recibido saludo de ID: %" PRIu64 ". GrupoID: %d", data_client->clienteid, data_client->grupoid);
+	difundir_grupo<MENSAJE_SALUDO>(shard, data_client, buffer_mensaje);
+}
+
+/* En modo de ticks la posición no se reenvía: se guarda como la última del cliente y el grupo se
+apunta para la siguiente instantánea. El origen lo pone el servidor, no el cliente */
+void guardar_posicion(struct reactor_shard *shard, struct epoll_data_client * data_client, char * buffer_mensaje)
+{
+	memcpy(&data_client->posicion, &buffer_mensaje[1], sizeof(struct mensaje_posicion));
+	data_client->posicion.cliente_id_origen = data_client->clienteid;
+	data_client->tiene_posicion = true;
+
+	if(!data_client->grupo->cambiado)
+	{
+		data_client->grupo->cambiado = true;
+		shard->grupos_cambiados.push_back(data_client->grupo);
+	}
+}
+
+/* Envía a todos los miembros de un grupo las últimas posiciones conocidas, en frames de hasta
+INSTANTANEA_MAX_POSICIONES. Cada frame lleva una clave de conflación propia, así que un miembro
+atrasado sólo guarda la instantánea más reciente en lugar de acumular las de todos los ticks */
+void enviar_instantanea(struct reactor_shard *shard, struct grupo *grupo)
+{
+	snapshot_grupo miembros = grupo->miembros;
+	const vector_cliente &clientes = *miembros;
+	vector<struct mensaje_posicion> posiciones;
+
+	for(uint i = 0; i < clientes.size(); i++)
+	{
+		if(clientes[i]->tiene_posicion && clientes[i]->estado == CLIENTE_CONECTADO)
+			posiciones.push_back(clientes[i]->posicion);
+	}
+
+	for(uint inicio = 0, trozo = 0; inicio < posiciones.size(); inicio += INSTANTANEA_MAX_POSICIONES, trozo++)
+	{
+		struct mensaje_instantanea instantanea;
+		int n = min((int) (posiciones.size() - inicio), INSTANTANEA_MAX_POSICIONES);
+		vector<char> buffer_mensaje(tamano_frame(MENSAJE_INSTANTANEA) + n * sizeof(struct mensaje_posicion));
+
+		instantanea.tick = shard->tick;
+		instantanea.n_posiciones = n;
+
+		buffer_mensaje[0] = MENSAJE_INSTANTANEA;
+		memcpy(&buffer_mensaje[1], &instantanea, sizeof(instantanea));
+		memcpy(&buffer_mensaje[tamano_frame(MENSAJE_INSTANTANEA)], &posiciones[inicio], n * sizeof(struct mensaje_posicion));
 
+		struct mensaje_compartido *difusion = mensaje_crear(buffer_mensaje.data(), buffer_mensaje.size());
+		difusion->clave = UINT64_MAX - trozo;
+		grupo->carga += clientes.size();
 
-using namespace std;
+		/* Un miembro atrasado al que la política descarta se queda sin esta instantánea; la del siguiente
+		tick la sustituye. Si ni así cabe en su cola, o la política es desconectar, se le da de baja */
+		for(uint i = 0; i < clientes.size(); i++)
+		{
+			if(clientes[i]->estado == CLIENTE_CONECTADO && !async_lento_descarta(clientes[i]))
+			{
+				if(async_write_compartido(clientes[i], difusion) < 0)
+				{
+					desconectar_saturado(shard, clientes[i]);
+				}
+			}
+		}
 
-struct grupo_key {
-	grupoid_t grupoid;
-};
+		mensaje_liberar(difusion);
+	}
+}
 
-struct grupo_hash {
-	size_t operator() (const grupo_key& g) const
+void enviar_instantaneas(struct reactor_shard *shard)
+{
+	uint64_t expiraciones;
+
+	if(read(shard->tickfd, &expiraciones, sizeof(expiraciones)) < 0 && errno != EAGAIN)
 	{
-		return g.grupoid;
+		perror("enviar_instantaneas->read()");
 	}
-};
 
-struct grupo_hash_equal {
-	bool operator() (const grupo_key& lkey, const grupo_key& rkey) const
+	shard->tick++;
+
+	for(uint i = 0; i < shard->grupos_cambiados.size(); i++)
+	{
+		shard->grupos_cambiados[i]->cambiado = false;
+		enviar_instantanea(shard, shard->grupos_cambiados[i]);
+	}
+
+	shard->grupos_cambiados.clear();
+}
+
+/* Entrega a los destinos salvo al origen una posición ya codificada: completa, y delta contra la
+anterior del origen si la hay (NULL si no). difusiones es la cuenta de difusiones del origen con ésta
+incluida. Cada destinatario con CAPACIDAD_POSICION_DELTA apunta en bases_delta la última que le llegó
+de cada origen. Quien recibió la anterior recibe el delta, codificado una sola vez para todos; el resto
+recibe el frame completo, que pasa a ser su base. Como TCP entrega en orden, lo último enviado es lo
+que el cliente tendrá aplicado cuando le llegue el delta. Los destinatarios con canal UDP la reciben en
+un datagrama. La usan el shard del origen y los de las demás particiones de su grupo */
+void entregar_posicion(struct reactor_shard *shard, clienteid_t origen, uint32_t difusiones, struct mensaje_compartido *completa,
+					   struct mensaje_compartido *delta, const vector_cliente &destinos)
+{
+	metricas_reenvio(destinos.size());
+
+	for(uint i = 0; i < destinos.size(); i++)
+	{
+		struct epoll_data_client *destino = destinos[i];
+		struct mensaje_compartido *mensaje = completa;
+
+		if(destino->clienteid == origen || destino->estado != CLIENTE_CONECTADO)
+			continue;
+
+		// Un destinatario atrasado al que se salta la posición conserva su base: la siguiente le llega completa
+		if(!destino->udp_enlazado && async_lento_descarta(destino))
+			continue;
+
+		// Por UDP se puede perder cualquier datagrama, así que sólo viajan posiciones completas
+		if(destino->udp_enlazado)
+		{
+			udp_encolar(&shard->udp, &destino->udp_direccion, completa);
+			continue;
+		}
+
+		if(destino->capacidades & CAPACIDAD_POSICION_DELTA)
+		{
+			if(destino->bases_delta == NULL)
+				destino->bases_delta = new unordered_map<clienteid_t, uint32_t>();
+
+			uint32_t &base = (*destino->bases_delta)[origen];
+
+			if(delta != NULL && base == difusiones - 1)
+				mensaje = delta;
+
+			base = difusiones;
+		}
+
+		if (async_write_compartido(destino, mensaje) < 0)
+		{
+			desconectar_saturado(shard, destino);
+		}
+	}
+}
+
+/* Reenvía una posición a los destinos salvo al origen, y a las demás particiones si el grupo está
+particionado. Cada origen cuenta sus difusiones y el delta se codifica contra la anterior. De las
+posiciones de un mismo origen que un destinatario tenga sin enviar sólo importa la última, así que
+ambos frames llevan su ID como clave */
+void difundir_posicion(struct reactor_shard *shard, struct epoll_data_client * origen, const vector_cliente &destinos, char * buffer_mensaje)
+{
+	struct mensaje_posicion posicion;
+	struct mensaje_compartido *delta = NULL;
+	struct mensaje_compartido *completa = mensaje_crear(buffer_mensaje, tamano_frame(MENSAJE_POSICION));
+
+	// El origen lo pone el servidor, tanto en el frame completo como en la base del delta
+	memcpy(&posicion, &buffer_mensaje[1], sizeof(posicion));
+	posicion.cliente_id_origen = origen->clienteid;
+	memcpy(&completa->datos[1], &posicion.cliente_id_origen, sizeof(posicion.cliente_id_origen));
+	completa->clave = origen->clienteid;
+
+	if(origen->tiene_posicion)
+	{
+		char buffer_delta[tamano_frame(MENSAJE_POSICION_DELTA) + DELTA_MAX_BYTES];
+		int longitud = delta_codificar(&origen->posicion, &posicion, (uint8_t *) &buffer_delta[tamano_frame(MENSAJE_POSICION_DELTA)]);
+
+		buffer_delta[0] = MENSAJE_POSICION_DELTA;
+		buffer_delta[1] = longitud;
+
+		delta = mensaje_crear(buffer_delta, tamano_frame(MENSAJE_POSICION_DELTA) + longitud);
+		delta->clave = origen->clienteid;
+		delta->alternativa = completa;
+		mensaje_retener(completa);
+	}
+
+	origen->posicion = posicion;
+	origen->tiene_posicion = true;
+	origen->difusiones++;
+
+	origen->grupo->carga += destinos.size();
+	entregar_posicion(shard, origen->clienteid, origen->difusiones, completa, delta, destinos);
+
+	if(origen->grupo->particiones != NULL)
+		difundir_particiones(shard, origen->grupo, origen->clienteid, completa, delta, origen->difusiones, &posicion);
+
+	if(delta != NULL)
+		mensaje_liberar(delta);
+
+	mensaje_liberar(completa);
+}
+
+/* Reparte entre los miembros de la partición de este shard un mensaje que llega de otra partición del
+grupo. Con radio de interés las posiciones sólo llegan a los miembros de la partición que están cerca,
+según su propia rejilla. Si el shard ya no tiene miembros del grupo no hay nada que hacer */
+void atender_difusion(struct reactor_shard *shard, struct difusion_particion *difusion)
+{
+	static thread_local vector_cliente cercanos;
+	struct grupo_key key;
+
+	key.grupoid = difusion->grupoid;
+	mapa_grupos::iterator it = shard->clientes_grupo.find(key);
+
+	if(it != shard->clientes_grupo.end() && it->second.miembros != NULL)
+	{
+		struct grupo *grupo = &it->second;
+		snapshot_grupo miembros = grupo->miembros;
+		const vector_cliente *destinos = miembros.get();
+
+		if(difusion->posicion && radio_interes > 0)
+		{
+			cercanos.clear();
+
+			if(grupo->rejilla != NULL)
+				rejilla_vecinos(grupo->rejilla, difusion->x, difusion->y, cercanos);
+
+			destinos = &cercanos;
+		}
+
+		grupo->carga += destinos->size();
+
+		if(difusion->posicion)
+		{
+			entregar_posicion(shard, difusion->origen, difusion->difusiones, difusion->mensaje, difusion->delta, *destinos);
+		}
+		else
+		{
+			metricas_reenvio(destinos->size());
+			difundir(shard, NULL, *destinos, difusion->mensaje);
+		}
+	}
+
+	mensaje_liberar(difusion->mensaje);
+
+	if(difusion->delta != NULL)
+		mensaje_liberar(difusion->delta);
+}
+
+/* Con radio de interés la posición sólo llega a los miembros del grupo que están a menos del radio en
+x/y, según la rejilla del grupo, que se actualiza con cada posición. Los miembros que aún no han
+enviado ninguna no están en la rejilla y no reciben nada. Con -a el ciclo sólo espera a quienes
+recibieron la posición, así que ambos modos se combinan sin ciclos incompletos */
+void difundir_interes(struct reactor_shard *shard, struct epoll_data_client * data_client, char * buffer_mensaje, vector_cliente &cercanos)
+{
+	struct mensaje_posicion posicion;
+	struct grupo *grupo = data_client->grupo;
+
+	memcpy(&posicion, &buffer_mensaje[1], sizeof(posicion));
+
+	if(grupo->rejilla == NULL)
+		grupo->rejilla = rejilla_crear(radio_interes);
+
+	rejilla_mover(grupo->rejilla, data_client, posicion.posicion_x, posicion.posicion_y);
+	rejilla_vecinos(grupo->rejilla, posicion.posicion_x, posicion.posicion_y, cercanos);
+
+	difundir_posicion(shard, data_client, cercanos, buffer_mensaje);
+}
+
+void manejar_posicion(struct reactor_shard *shard, struct epoll_data_client * data_client, char * buffer_mensaje)
+{
+	static thread_local vector_cliente cercanos;
+
+	if(tick_hz > 0)
 	{
-		return lkey.grupoid == rkey.grupoid;
+		guardar_posicion(shard, data_client, buffer_mensaje);
+		return;
 	}
+
+	snapshot_grupo miembros = data_client->grupo->miembros;
+	const vector_cliente *destinos = miembros.get();
+
+	if(radio_interes > 0)
+	{
+		cercanos.clear();
+		difundir_interes(shard, data_client, buffer_mensaje, cercanos);
+		destinos = &cercanos;
+	}
+	else
+	{
+		difundir_posicion(shard, data_client, *miembros, buffer_mensaje);
+	}
+
+	if(agregar_acks)
+	{
+		struct mensaje_posicion posicion;
+		memcpy(&posicion, &buffer_mensaje[1], sizeof(posicion));
+
+		ciclo_abrir(shard, data_client, *destinos, posicion.numero_secuencia);
+	}
+}
+
+/* Con la agregación activa los reconocimientos no se reenvían: se apuntan en el ciclo abierto del
+destino, que está en el shard de su grupo */
+void manejar_reconocimiento(struct reactor_shard *shard, struct epoll_data_client * data_client, char * buffer_mensaje)
+{
+	if(!agregar_acks)
+	{
+		reenviar_unicast<MENSAJE_RECONOCIMIENTO>(shard, data_client, buffer_mensaje);
+		return;
+	}
+
+	struct mensaje_reconocimiento reconocimiento;
+	memcpy(&reconocimiento, &buffer_mensaje[1], sizeof(reconocimiento));
+
+	if(registro_shard(&registro, reconocimiento.cliente_id_destino) == shard->id)
+		ciclo_ack_recibido(shard, reconocimiento.cliente_id_destino, data_client->clienteid, reconocimiento.numero_secuencia);
+	else
+		reenviar_unicast<MENSAJE_RECONOCIMIENTO>(shard, data_client, buffer_mensaje);
+}
+
+/* Manejador de cada tipo que puede mandar un cliente ya unido a su grupo. MENSAJE_CONEXION sólo
+es válido durante el handshake y los demás vacíos sólo los envía el servidor, así que se ignoran */
+static const manejador_mensaje manejadores_mensaje[MENSAJE_MAX + 1] = {
+	NULL,
+	NULL,											// MENSAJE_CONEXION
+	NULL,											// MENSAJE_CONEXION_SATISFACTORIA
+	manejar_saludo,									// MENSAJE_SALUDO
+	manejar_posicion,								// MENSAJE_POSICION
+	manejar_reconocimiento,							// MENSAJE_RECONOCIMIENTO
+	reenviar_unicast<MENSAJE_NOMBRE_REQUEST>,		// MENSAJE_NOMBRE_REQUEST
+	reenviar_unicast<MENSAJE_NOMBRE_REPLY>,			// MENSAJE_NOMBRE_REPLY
+	NULL,											// MENSAJE_DESCONEXION
+	NULL,											// MENSAJE_CICLO_COMPLETO
+	NULL,											// MENSAJE_INSTANTANEA
+	NULL,											// MENSAJE_POSICION_DELTA
+	NULL,											// MENSAJE_CANAL_UDP
+	NULL,											// MENSAJE_ENLACE_UDP
 };
 
-typedef vector<struct epoll_data_client *> vector_cliente;
-unordered_map<grupo_key, vector_cliente, grupo_hash, grupo_hash_equal> clientes_grupo;
+/* Atiende un mensaje de un cliente ya unido a su grupo. buffer_mensaje apunta al frame dentro del
+buffer de lectura del cliente: byte de tipo seguido de la estructura. El lector sólo entrega frames
+de tipos presentes en la tabla de descriptores, así que el tipo siempre indexa dentro de la tabla */
+int manejar_frame(struct epoll_data_client * data_client, char * buffer_mensaje, int longitud, void * contexto)
+{
+	manejador_mensaje manejador = manejadores_mensaje[(mensaje_t) buffer_mensaje[0]];
+
+	data_client->grupo->carga++;
 
-int clientes_conectados = 0;
+	if(manejador != NULL)
+		manejador((struct reactor_shard *) contexto, data_client, buffer_mensaje);
 
+	return 0;
+}
 
-void worker_thread(int epollfd)
+/* Atiende un datagrama del canal UDP del shard. Sólo se aceptan MENSAJE_ENLACE_UDP con el testigo
+del cliente, que asocia al cliente la dirección de origen, y posiciones y reconocimientos que llegan
+desde la dirección asociada al cliente que dicen ser. Los tres empiezan por el ID del remitente, que
+además debe ser de un grupo de este shard. Lo demás se descarta sin respuesta */
+void manejar_datagrama(char * datagrama, int longitud, struct sockaddr_in * origen, void * contexto)
 {
-	struct epoll_event event;
-   	struct epoll_event epoll_events[MAXEVENTS];
+	struct reactor_shard *shard = (struct reactor_shard *) contexto;
+	mensaje_t tipo = datagrama[0];
+	clienteid_t clienteid;
 
-   	int epoll_n;
+	if(longitud < 1 + (int) sizeof(clienteid_t) || longitud != tamano_frame(tipo))
+		return;
 
-   	do
-   {
-   		epoll_n = epoll_wait(epollfd, epoll_events, MAXEVENTS, -1);
+	if(tipo != MENSAJE_ENLACE_UDP && tipo != MENSAJE_POSICION && tipo != MENSAJE_RECONOCIMIENTO)
+		return;
 
-		for (int i = 0; i < epoll_n; i++)
+	memcpy(&clienteid, &datagrama[1], sizeof(clienteid));
+
+	if(registro_shard(&registro, clienteid) != shard->id)
+		return;
+
+	struct epoll_data_client *cliente = registro_cliente(&registro, clienteid);
+
+	if(cliente == NULL || cliente->estado != CLIENTE_CONECTADO)
+		return;
+
+	if(tipo == MENSAJE_ENLACE_UDP)
+	{
+		struct mensaje_enlace_udp enlace;
+		memcpy(&enlace, &datagrama[1], sizeof(enlace));
+
+		if(cliente->udp_testigo == 0 || enlace.testigo != cliente->udp_testigo)
+			return;
+
+		cliente->udp_direccion = *origen;
+		cliente->udp_enlazado = true;
+
+		struct mensaje_compartido *respuesta = mensaje_crear(datagrama, longitud);
+		udp_encolar(&shard->udp, origen, respuesta);
+		mensaje_liberar(respuesta);
+		return;
+	}
+
+	if(!cliente->udp_enlazado || cliente->udp_direccion.sin_addr.s_addr != origen->sin_addr.s_addr ||
+	   cliente->udp_direccion.sin_port != origen->sin_port)
+		return;
+
+	cliente->grupo->carga++;
+	manejadores_mensaje[tipo](shard, cliente, datagrama);
+}
+
+/* Una vuelta por los eventos del epoll del shard: espera como mucho timeout ms y atiende lo que haya.
+Mientras espera el shard no retiene clientes, y al despertar pasa por su punto de reposo. Devuelve el
+número de eventos atendidos */
+int atender_epoll(struct reactor_shard *shard, vector<struct epoll_event> &epoll_events, int timeout)
+{
+	if(timeout != 0)
+		reactor_reposo(shard);
+
+	int epoll_n = epoll_wait(shard->epollfd, epoll_events.data(), EVENTOS_SHARD, timeout);
+
+	METRICA_SUMAR(metricas_hilo->llamadas_espera, 1);
+
+	if(timeout != 0)
+	{
+		reactor_quiescente(shard);
+		metricas_vuelta_iniciar();
+	}
+
+	for (int i = 0; i < epoll_n; i++)
+	{
+		if (epoll_events[i].data.ptr == &shard->eventfd)
+		{
+			procesar_tareas(shard);
+			continue;
+		}
+
+		if (epoll_events[i].data.ptr == &shard->aceptador.listen_sd)
 		{
+			aceptar_clientes(&shard->aceptador);
+			continue;
+		}
+
+		if (epoll_events[i].data.ptr == &shard->aceptador.timerfd)
+		{
+			expirar_handshakes(&shard->aceptador);
+			continue;
+		}
+
+		if (epoll_events[i].data.ptr == &shard->timerfd)
+		{
+			expirar_ciclos(shard);
+			continue;
+		}
+
+		if (epoll_events[i].data.ptr == &shard->tickfd)
+		{
+			enviar_instantaneas(shard);
+			continue;
+		}
+
+		if (epoll_events[i].data.ptr == &shard->balanceofd)
+		{
+			revisar_balanceo(shard);
+			continue;
+		}
+
+		if (epoll_events[i].data.ptr == &shard->udp.socketfd)
+		{
+			udp_recibir(&shard->udp, manejar_datagrama, shard);
+			continue;
+		}
+
+		if (((struct epoll_data_client *) epoll_events[i].data.ptr)->estado == CLIENTE_HANDSHAKE)
+		{
+			struct epoll_data_client * data_client = (struct epoll_data_client *) epoll_events[i].data.ptr;
+
+			if (epoll_events[i].events & EPOLLIN)
+			{
+				procesar_handshake(shard, &shard->aceptador, data_client);
+			}
+			else
+			{
+				cerrar_handshake(&shard->aceptador, data_client);
+			}
+			continue;
+		}
+
+		if (((struct epoll_data_client *) epoll_events[i].data.ptr)->estado == CLIENTE_DESCONECTADO)
+		{
+			continue;
+		}
+
+		struct epoll_data_client * data_client = (struct epoll_data_client *) epoll_events[i].data.ptr;
+
+		if ((epoll_events[i].events & EPOLLRDHUP) || (epoll_events[i].events & EPOLLHUP) || (epoll_events[i].events & EPOLLERR))
+		{
+			desconectar_cliente(shard, data_client);
+			continue;
+		}
+
+		if (epoll_events[i].events & EPOLLOUT)
+		{
+			async_write_delay(data_client);
+		}
 
-		    //cout << "---------------------------------" << endl;
-		    if ((epoll_events[i].events & EPOLLRDHUP) || (epoll_events[i].events & EPOLLHUP) || (epoll_events[i].events & EPOLLERR))
-		    {
-		    	struct epoll_data_client * data_client = (struct epoll_data_client *) epoll_events[i].data.ptr;
-		    	close(data_client->socketfd);
-		    	cout << "Desconectado ClienteID: " << data_client->socketfd << " del GrupoID: " << data_client->grupoid << endl << flush;
-
-		    	struct grupo_key key;
-	    		struct mensaje_desconexion desconexion;
-	    		char buffer_mensaje[40];
-	    		mensaje_t tipo_mensaje = MENSAJE_DESCONEXION;
-
-	    		key.grupoid = data_client->grupoid;
-	    		vector_cliente clientes = clientes_grupo[key];
-
-	    		int erase_index;
-	    		bool erase_find = false;
-
-	    		desconexion.cliente_id_origen = data_client->socketfd;
-	    		memcpy(buffer_mensaje, &tipo_mensaje, sizeof(mensaje_t));
-	    		memcpy(&buffer_mensaje[1], &desconexion, sizeof(struct mensaje_desconexion));
-
-	    		cout << "En el grupo había " << clientes_grupo[key].size() << " clientes." << endl;
-
-	    		for(uint i = 0; i < clientes.size(); i++)
-	    		{
-	    			if(((struct epoll_data_client *) clientes[i])->socketfd != data_client->socketfd)
-	    			{
-	    				cout << "Enviando información de desconexión sobre " << data_client->socketfd << " a " << clientes[i] << endl;
-	    				async_write(clientes[i], buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_desconexion));
-	    			}
-	    			else
-	    			{
-	    				cout << "Se ha encontrado ID " << ((struct epoll_data_client *) clientes[i])->socketfd << " en el vector";
-	    				cout << " en el índice " << i + 1 << "/" << clientes.size() << endl;
-	    				erase_index = i;
-	    				erase_find = true;
-	    			}
-	    		}
+		if (epoll_events[i].events & EPOLLIN)
+		{
+			int rc = async_read_frames(data_client, manejar_frame, shard);
+
+			if(rc == READ_ERROR || rc == READ_CLOSE)
+			{
+				desconectar_cliente(shard, data_client);
+			}
+		}
+	}
+
+	return epoll_n;
+}
 
-	    		if (erase_find)
-	    		{
-	    			cout << "Borrada ID " << data_client->socketfd << " del vector de clientes de grupo." << endl;
-	    			clientes_grupo[key].erase(erase_index + clientes_grupo[key].begin());
-	    		}
+/* Espera activa: mientras lleve menos de espera_activa_us sin eventos el shard sondea su epoll sin
+bloquearse, así que lo que llega no paga el despertar del hilo. Cada sondeo vacío es un punto de reposo
+y empieza otra vuelta para las métricas. Pasado ese tiempo se bloquea como en el modo normal */
+void atender_epoll_activo(struct reactor_shard *shard, vector<struct epoll_event> &epoll_events)
+{
+	uint64_t inicio = reloj_us();
 
-	    		cout << "El GrupoID " << key.grupoid << " tiene ahora " << clientes_grupo[key].size() << endl;
+	do
+	{
+		reactor_quiescente(shard);
+		metricas_vuelta_iniciar();
 
-	    		clientes_conectados--;
+		if(atender_epoll(shard, epoll_events, 0) > 0)
+			return;
 
-	    		cout << "Hay en total " << clientes_conectados << " clientes conectados en el sistema." << endl;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	} while(reloj_us() - inicio < (uint64_t) shard->espera_activa_us);
 
-	    		continue;
-		    }
+	atender_epoll(shard, epoll_events, -1);
+}
 
-		    if (epoll_events[i].events & EPOLLOUT)
-		    {
-		    	async_write_delay((struct epoll_data_client *) epoll_events[i].data.ptr);
-		    }
+/* Bucle de un shard con io_uring. Los clientes conectados reciben y envían por el anillo; el epoll del
+shard queda como una operación más del anillo, y cuando avisa se vacía sin esperar. Como el epoll sólo
+vuelve a avisar ante eventos nuevos, tras atender alguno se mira otra vez antes de bloquearse */
+void worker_uring(struct reactor_shard *shard)
+{
+	struct anillo_uring *anillo = shard->uring;
+	vector<struct epoll_event> epoll_events(EVENTOS_SHARD);
+	bool epoll_pendiente = true;
+	uint64_t ultima_actividad = reloj_us();
 
-		    if (epoll_events[i].events & EPOLLIN)
-		    {
-		    	int rc;
+	async_uring(anillo);
+	metricas_asignar(metricas_shard(shard->id));
 
-		    	do
-		    	{
-			    	mensaje_t tipo_mensaje;
-			    	char buffer_mensaje[400];
-			    	struct epoll_data_client * data_client = (struct epoll_data_client *) epoll_events[i].data.ptr;
+	do
+	{
+		// Con espera activa, mientras no se cumpla el plazo sin actividad se sondea en lugar de esperar
+		bool activo = shard->espera_activa_us > 0 && reloj_us() - ultima_actividad < (uint64_t) shard->espera_activa_us;
 
+		if(!epoll_pendiente && !activo)
+			reactor_reposo(shard);
 
-			    	rc = async_read(data_client, buffer_mensaje, 40);
+		if(activo)
+			uring_sondear(anillo);
+		else
+			uring_enviar(anillo, epoll_pendiente ? 0 : 1);
 
-			    	if(rc == READ_ERROR || rc == READ_CLOSE)
-			    	{
-			    		printf("async_read() error\n");
-			    		struct epoll_data_client * data_client = (struct epoll_data_client *) epoll_events[i].data.ptr;
-				    	close(data_client->socketfd);
-				    	cout << "Desconectado ClienteID: " << data_client->socketfd << " del GrupoID: " << data_client->grupoid << endl << flush;
+		METRICA_SUMAR(metricas_hilo->llamadas_espera, 1);
+		reactor_quiescente(shard);
+		metricas_vuelta_iniciar();
+		async_lote_iniciar();
 
-				    	struct grupo_key key;
-			    		struct mensaje_desconexion desconexion;
-			    		char buffer_mensaje[40];
-			    		mensaje_t tipo_mensaje = MENSAJE_DESCONEXION;
+		if(epoll_pendiente)
+			epoll_pendiente = atender_epoll(shard, epoll_events, 0) > 0;
 
-			    		key.grupoid = data_client->grupoid;
-			    		vector_cliente clientes = clientes_grupo[key];
+		struct io_uring_cqe *cqe;
 
-			    		int erase_index;
-			    		bool erase_find = false;
+		bool actividad = epoll_pendiente;
 
-			    		desconexion.cliente_id_origen = data_client->socketfd;
-			    		memcpy(buffer_mensaje, &tipo_mensaje, sizeof(mensaje_t));
-			    		memcpy(&buffer_mensaje[1], &desconexion, sizeof(struct mensaje_desconexion));
+		while((cqe = uring_cqe(anillo)) != NULL)
+		{
+			actividad = true;
 
-			    		cout << "En el grupo había " << clientes_grupo[key].size() << " clientes." << endl;
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
 
-			    		for(uint i = 0; i < clientes.size(); i++)
-			    		{
-			    			if(((struct epoll_data_client *) clientes[i])->socketfd != data_client->socketfd)
-			    			{
-			    				cout << "Enviando información de desconexión sobre " << data_client->socketfd << " a " << ((struct epoll_data_client *)clientes[i])->socketfd << endl;
-			    				async_write(clientes[i], buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_desconexion));
-			    			}
-			    			else
-			    			{
-			    				cout << "Se ha encontrado ID " << ((struct epoll_data_client *) clientes[i])->socketfd << " en el vector";
-			    				cout << " en el índice " << i + 1 << "/" << clientes.size() << endl;
-			    				erase_index = i;
-			    				erase_find = true;
-			    			}
-			    		}
-
-			    		if (erase_find)
-			    		{
-			    			cout << "Borrada ClienteID: " << data_client->socketfd << " del vector de clientes de grupo." << endl;
-			    			clientes_grupo[key].erase(erase_index + clientes_grupo[key].begin());
-			    		}
-
-			    		cout << "El GrupoID " << key.grupoid << " tiene ahora " << clientes_grupo[key].size() << endl;
-
-			    		clientes_conectados--;
-
-			    		cout << "Hay en total " << clientes_conectados << " clientes conectados en el sistema." << endl;
-
-			    		break;
-
-
-				    	}
+			uring_cqe_visto(anillo);
 
-			    	if(rc == READ_BLOCK)
-			    	{
-			    		break;
-			    	}
+			switch(user_data & URING_OP_MASCARA)
+			{
+				case URING_OP_EPOLL:
+				{
+					epoll_pendiente = atender_epoll(shard, epoll_events, 0) > 0;
 
-					switch(buffer_mensaje[0])
+					if(!(flags & IORING_CQE_F_MORE))
+						reactor_uring_epoll(shard);
+					break;
+				}
+				case URING_OP_ACEPTAR:
+				{
+					if(res >= 0)
 					{
-						case MENSAJE_SALUDO:
-						{
-#ifdef _DEBUG_
-							printf("Recibido saludo de ID: %d. GrupoID: %d\n", data_client->socketfd, data_client->grupoid);
-#endif
-							struct grupo_key key;
-							key.grupoid = data_client->grupoid;
-							vector_cliente clientes = clientes_grupo[key];
-
-							for(uint i = 0; i < clientes.size(); i++)
-							{
-								if(((struct epoll_data_client *) clientes[i])->socketfd != data_client->socketfd)
-								{
-									async_write(clientes[i], buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_saludo));
-								}
-							}
-							break;
-						}
-						case MENSAJE_POSICION:
-						{
-#ifdef _DEBUG_
-							//printf("Recibida posicion de ID: %d. GrupoID: %d\n", data_client->socketfd, data_client->grupoid);
-#endif
-							struct grupo_key key;
-							key.grupoid = data_client->grupoid;
-							vector_cliente clientes = clientes_grupo[key];
-
-							struct mensaje_posicion posicion;
-							memcpy(&posicion, &buffer_mensaje[1], sizeof(posicion));
-
-							//posicion = (struct mensaje_posicion) (* (&buffer_mensaje))
-
-							assert(posicion.cliente_id_origen < 11000);
-							//cout << "Reenviando a " << clientes.size() << " clientes..." << endl;
-
-							for(uint i = 0; i < clientes.size(); i++)
-							{
-								if(((struct epoll_data_client *) clientes[i])->socketfd != data_client->socketfd)
-								{
-									//send(clientes[i]->socketfd, buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_posicion), MSG_NOSIGNAL | MSG_WAITALL);
-									if (async_write(clientes[i], buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_posicion)) < 0)
-									{
-
-										cout << "Error enviando a ID " << ((struct epoll_data_client *) clientes[i])->socketfd << endl;
-
-										struct epoll_data_client * data_client = (struct epoll_data_client *) clientes[i];
-										close(data_client->socketfd);
-										cout << "Desconectado ClienteID: " << data_client->socketfd << " del GrupoID: " << data_client->grupoid << endl << flush;
-
-										struct grupo_key key;
-										struct mensaje_desconexion desconexion;
-										char buffer_mensaje[40];
-										mensaje_t tipo_mensaje = MENSAJE_DESCONEXION;
-
-										key.grupoid = data_client->grupoid;
-										vector_cliente clientes = clientes_grupo[key];
-
-										int erase_index;
-										bool erase_find = false;
-
-										desconexion.cliente_id_origen = data_client->socketfd;
-										memcpy(buffer_mensaje, &tipo_mensaje, sizeof(mensaje_t));
-										memcpy(&buffer_mensaje[1], &desconexion, sizeof(struct mensaje_desconexion));
-
-										cout << "En el grupo había " << clientes_grupo[key].size() << " clientes." << endl;
-
-										for(uint i = 0; i < clientes.size(); i++)
-										{
-											if(((struct epoll_data_client *) clientes[i])->socketfd != data_client->socketfd)
-											{
-												cout << "Enviando información de desconexión sobre " << data_client->socketfd << " a " << clientes[i] << endl;
-												async_write(clientes[i], buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_desconexion));
-											}
-											else
-											{
-												cout << "Se ha encontrado ID " << ((struct epoll_data_client *) clientes[i])->socketfd << " en el vector";
-												cout << " en el índice " << i + 1 << "/" << clientes.size() << endl;
-												erase_index = i;
-												erase_find = true;
-											}
-										}
-
-										if (erase_find)
-										{
-											cout << "Borrada ID " << data_client->socketfd << " del vector de clientes de grupo." << endl;
-											clientes_grupo[key].erase(erase_index + clientes_grupo[key].begin());
-										}
-
-										cout << "El GrupoID " << key.grupoid << " tiene ahora " << clientes_grupo[key].size() << endl;
-
-										clientes_conectados--;
-
-										cout << "Hay en total " << clientes_conectados << " clientes conectados en el sistema." << endl;
-
-									}
-								}
-							}
-							break;
-						}
-
-						case MENSAJE_RECONOCIMIENTO:
-						{
-							struct mensaje_reconocimiento reconocimiento;
-							memcpy(&reconocimiento, &buffer_mensaje[1], sizeof(struct mensaje_reconocimiento));
-
-							//printf("Recibido reconocimiento de ID %d a ID %d. GrupoID: %d\n", data_client->socketfd, reconocimiento.cliente_id_destino, data_client->grupoid);
-
-							struct grupo_key key;
-							key.grupoid = data_client->grupoid;
-							vector_cliente clientes = clientes_grupo[key];
-
-							assert(reconocimiento.cliente_id_destino < 11000);
-
-							for(uint i = 0; i < clientes.size(); i++)
-							{
-								if(((struct epoll_data_client *) clientes[i])->socketfd == reconocimiento.cliente_id_destino)
-								{
-									async_write(clientes[i], buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_reconocimiento));
-								}
-							}
-							break;
-						}
-
-						case MENSAJE_NOMBRE_REPLY:
-						{
-							struct mensaje_nombre_reply nombre_reply;
-							memcpy(&nombre_reply, &buffer_mensaje[1], sizeof(struct mensaje_nombre_reply));
-
-							struct grupo_key key;
-							key.grupoid = data_client->grupoid;
-							vector_cliente clientes = clientes_grupo[key];
-
-							for(uint i = 0; i < clientes.size(); i++)
-							{
-								if(((struct epoll_data_client *) clientes[i])->socketfd == nombre_reply.cliente_id_destino)
-								{
-									async_write(clientes[i], buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_nombre_reply));
-								}
-							}
-							break;
-						}
-
-						case MENSAJE_NOMBRE_REQUEST:
-						{
-							struct mensaje_nombre_request nombre_request;
-							memcpy(&nombre_request, &buffer_mensaje[1], sizeof(struct mensaje_nombre_request));
-
-							struct grupo_key key;
-							key.grupoid = data_client->grupoid;
-							vector_cliente clientes = clientes_grupo[key];
-
-							for(uint i = 0; i < clientes.size(); i++)
-							{
-								if(((struct epoll_data_client *) clientes[i])->socketfd == nombre_request.cliente_id_destino)
-								{
-									async_write(clientes[i], buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_nombre_request));
-								}
-							}
-							break;
-						}
+						aceptar_socket(&shard->aceptador, res);
+					}
+					else if(res != -EAGAIN)
+					{
+						errno = -res;
+						perror("accept4()");
+					}
 
+					if(!(flags & IORING_CQE_F_MORE))
+						reactor_uring_aceptar(shard);
+					break;
+				}
+				case URING_OP_RECV:
+				{
+					struct epoll_data_client * data_client = (struct epoll_data_client *) URING_PUNTERO(user_data);
+					int rc = async_uring_recibido(data_client, res, flags, manejar_frame, shard);
+
+					if((rc == READ_ERROR || rc == READ_CLOSE) && data_client->estado != CLIENTE_DESCONECTADO)
+					{
+						desconectar_cliente(shard, data_client);
 					}
+					break;
+				}
+				case URING_OP_ENVIO:
+				{
+					struct epoll_data_client * data_client = (struct epoll_data_client *) URING_PUNTERO(user_data);
 
-				} while(rc > 0);
+					if(async_uring_enviado(data_client, res) < 0)
+					{
+						desconectar_saturado(shard, data_client);
+					}
+					break;
+				}
 			}
 		}
+
+		if(actividad && shard->espera_activa_us > 0)
+			ultima_actividad = reloj_us();
+
+		atender_desconexiones(shard);
+		reactor_particiones_vaciar(shard);
+		async_lote_terminar(envio_fallido, shard);
+
+		// Las bajas por envíos fallidos del lote se avisan ya, sin esperar a que despierte el shard
+		if(!shard->desconectados.empty())
+			atender_desconexiones(shard);
+		udp_vaciar(&shard->udp);
+		metricas_vuelta_terminar();
+	} while(TRUE);
+}
+
+void worker_thread(struct reactor_shard *shard)
+{
+	if(shard->uring != NULL)
+	{
+		worker_uring(shard);
+		return;
+	}
+
+	vector<struct epoll_event> epoll_events(EVENTOS_SHARD);
+
+	metricas_asignar(metricas_shard(shard->id));
+
+	do
+	{
+		// Lo que se escriba durante esta vuelta se envía de una vez al final, un writev() por cliente
+		async_lote_iniciar();
+
+		if(shard->espera_activa_us > 0)
+			atender_epoll_activo(shard, epoll_events);
+		else
+			atender_epoll(shard, epoll_events, -1);
+
+		atender_desconexiones(shard);
+		reactor_particiones_vaciar(shard);
+		async_lote_terminar(envio_fallido, shard);
+
+		// Las bajas por envíos fallidos del lote se avisan ya, sin esperar a que despierte el shard
+		if(!shard->desconectados.empty())
+			atender_desconexiones(shard);
+		udp_vaciar(&shard->udp);
+
+		if(shard->migrar_destino >= 0)
+			migrar_grupo(shard);
+
+		metricas_vuelta_terminar();
 	} while(TRUE);
 }
 
+// Cada shard que no consiga su anillo se queda con epoll, sin afectar a los demás
+void iniciar_uring()
+{
+	for(int i = 0; i < num_shards; i++)
+	{
+		if(!reactor_uring_iniciar(&shards[i]))
+		{
+			BITACORA(BITACORA_AVISO, "Shard %d: io_uring no disponible, se usa epoll.", i);
+		}
+	}
+}
+
+void uso(const char *programa)
+{
+	printf("Uso: %s [-t shards] [-c] [-r] [-w bytes] [-k] [-a | -T hz] [-R radio] [-C] [-u puerto] [-i] [-H] [-M ruta] [-L ruta]\n"
+	       "          [-S descartar|diezmar|desconectar] [-E ms] [-b us] [-G ms] [-P miembros]\n", programa);
+	printf("  -t shards  Número de shards (hilos con su propio epoll). Por defecto, uno por core.\n");
+	printf("  -c         Fija cada shard a un core.\n");
+	printf("  -r         Cada shard acepta conexiones en su propio socket SO_REUSEPORT.\n");
+	printf("  -w bytes   Máximo de bytes pendientes de envío por cliente. Por defecto, %d.\n", LIMITE_SALIDA_DEFECTO);
+	printf("  -k         Usa TCP_CORK al vaciar colas que no caben en un solo writev().\n");
+	printf("  -a         Agrega en el servidor los reconocimientos de cada posición y envía al origen un\n");
+	printf("             único MENSAJE_CICLO_COMPLETO, con los que falten si vence a los %d ms.\n", CICLO_TIMEOUT_MS);
+	printf("  -T hz      No reenvía cada posición: hz veces por segundo envía a cada grupo con cambios\n");
+	printf("             un MENSAJE_INSTANTANEA con la última posición de cada miembro.\n");
+	printf("  -R radio   Cada posición sólo se reenvía a los miembros a menos de radio en x/y. Conviene\n");
+	printf("             combinarlo con -a: los ciclos sólo esperan a los miembros que la reciben.\n");
+	printf("  -C         Encola todas las posiciones, sin sustituir las aún no enviadas de un mismo origen.\n");
+	printf("  -u puerto  Abre un canal UDP por shard, en puerto + número de shard, para las posiciones y\n");
+	printf("             reconocimientos de los clientes que lo piden con CAPACIDAD_UDP.\n");
+	printf("  -i         Los clientes conectados reciben y envían por io_uring en lugar de epoll. Si el\n");
+	printf("             kernel no lo admite se sigue con epoll.\n");
+	printf("  -H         Reserva la memoria de los clientes en páginas enormes (MAP_HUGETLB), si las hay.\n");
+	printf("  -M ruta    Sirve las métricas en el socket Unix ruta: cada conexión recibe un informe en\n");
+	printf("             texto, o en JSON si envía \"json\".\n");
+	printf("  -L ruta    Escribe la bitácora en binario en ruta, para leerla con bitacora-leer. Por\n");
+	printf("             defecto se escribe en texto en la salida estándar.\n");
+	printf("  -S modo    Qué hacer con un cliente atrasado, que tiene en cola algo de hace más de -E ms:\n");
+	printf("             descartar sus posiciones e instantáneas, enviarle sólo una de cada %d (diezmar)\n", LENTO_DIEZMADO);
+	printf("             o desconectarlo. Por defecto sólo se desconecta al pasar del límite de -w.\n");
+	printf("  -E ms      Retraso a partir del cual un cliente se considera atrasado. Por defecto, %d.\n", LENTO_UMBRAL_DEFECTO_MS);
+	printf("  -b us      Espera activa: cada shard sondea sin bloquearse hasta llevar us microsegundos sin\n");
+	printf("             eventos, y pide SO_BUSY_POLL en sus sockets. Implica -c; cada shard ocupa su core.\n");
+	printf("  -G ms      Cada ms cada shard mide la carga de sus grupos (mensajes y destinatarios) y, si\n");
+	printf("             está muy por encima del shard más libre, le cede un grupo con sus conexiones.\n");
+	printf("             No se combina con -u ni con -i.\n");
+	printf("  -P miembros  Un grupo que llega a ese número de miembros se particiona: sus miembros nuevos\n");
+	printf("             se reparten entre todos los shards y cada shard reenvía a los suyos, en\n");
+	printf("             paralelo, lo que se difunde al grupo. No se combina con -a ni con -T.\n");
+}
+
 int main (int argc, char *argv[])
 {
-   int    listen_sd, epoll_fd;
-   struct epoll_event event;
+   int    epoll_fd, opcion;
+   bool   fijar_cpu = false, reuseport = false, usar_uring = false;
+   const char *ruta_metricas = NULL, *ruta_bitacora = NULL;
+   int    politica_lento = LENTO_NINGUNA, umbral_lento = LENTO_UMBRAL_DEFECTO_MS, espera_activa_us = 0;
+   struct aceptador aceptador;
    struct epoll_event epoll_events[MAXEVENTS];
-   int epoll_fd_threads[THREAD_POOL];
-   thread thread_pool[THREAD_POOL];
 
-   listen_sd = aio_socket_escucha(SERVER_PORT);
-   epoll_fd = epoll_create1(0);
+   num_shards = reactor_num_cores();
 
-   event.data.fd = listen_sd;
-   event.events = EPOLLIN;
+   while((opcion = getopt(argc, argv, "t:crw:kaCT:R:u:iHM:L:S:E:b:G:P:")) != -1)
+   {
+   		switch(opcion)
+   		{
+   			case 't':
+   				num_shards = atoi(optarg);
+   				break;
+   			case 'c':
+   				fijar_cpu = true;
+   				break;
+   			case 'r':
+   				reuseport = true;
+   				break;
+   			case 'w':
+   				async_limite_salida(atoi(optarg));
+   				break;
+   			case 'k':
+   				async_cork(true);
+   				break;
+   			case 'a':
+   				agregar_acks = true;
+   				break;
+   			case 'C':
+   				async_conflacion(false);
+   				break;
+   			case 'T':
+   				tick_hz = atoi(optarg);
+   				break;
+   			case 'R':
+   				radio_interes = atoi(optarg);
+   				break;
+   			case 'u':
+   				puerto_udp = atoi(optarg);
+   				break;
+   			case 'i':
+   				usar_uring = true;
+   				break;
+   			case 'H':
+   				memoria_hugepages(true);
+   				break;
+   			case 'M':
+   				ruta_metricas = optarg;
+   				break;
+   			case 'L':
+   				ruta_bitacora = optarg;
+   				break;
+   			case 'S':
+   				if(strcmp(optarg, "descartar") == 0)
+   					politica_lento = LENTO_DESCARTAR;
+   				else if(strcmp(optarg, "diezmar") == 0)
+   					politica_lento = LENTO_DIEZMAR;
+   				else if(strcmp(optarg, "desconectar") == 0)
+   					politica_lento = LENTO_DESCONECTAR;
+   				else
+   					politica_lento = -1;
+   				break;
+   			case 'E':
+   				umbral_lento = atoi(optarg);
+   				break;
+   			case 'b':
+   				espera_activa_us = atoi(optarg);
+   				fijar_cpu = true;
+   				break;
+   			case 'G':
+   				balanceo_ms = atoi(optarg);
+   				break;
+   			case 'P':
+   				umbral_particion = atoi(optarg);
+   				break;
+   			default:
+   				uso(argv[0]);
+   				return -1;
+   		}
+   }
+
+   /* Con instantáneas no hay reenvío de posiciones y por tanto tampoco ciclos que agregar ni
+   posiciones que filtrar por distancia. El balanceo no mueve grupos entre puertos UDP ni entre
+   anillos de io_uring. Los ciclos y las instantáneas necesitan a todos los miembros en un shard, así
+   que no admiten grupos particionados */
+   if(num_shards <= 0 || tick_hz < 0 || radio_interes < 0 || puerto_udp < 0 || politica_lento < 0 || umbral_lento < 0 || espera_activa_us < 0 || balanceo_ms < 0 || umbral_particion < 0 ||
+      (tick_hz > 0 && (agregar_acks || radio_interes > 0)) || (balanceo_ms > 0 && (puerto_udp > 0 || usar_uring)) ||
+      (umbral_particion > 0 && (agregar_acks || tick_hz > 0)))
+   {
+   		uso(argv[0]);
+   		return -1;
+   }
+
+   async_politica_lento(politica_lento, umbral_lento);
+   bitacora_iniciar(ruta_bitacora);
+   registro_crear(&registro, REGISTRO_CAPACIDAD_DEFECTO);
 
+   shards = new reactor_shard[num_shards];
+   reactor_crear(shards, num_shards, fijar_cpu);
+   metricas_crear(num_shards);
 
-   for(int i=0; i < THREAD_POOL; i++)
+   for(int i = 0; i < num_shards; i++)
    {
-   		epoll_fd_threads[i] = epoll_create1(0);
-   		thread_pool[i] = thread(worker_thread, epoll_fd_threads[i]);
+   		reactor_espera_activa(&shards[i], espera_activa_us);
    }
 
-   epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sd, &event);
+   if(ruta_metricas != NULL)
+   		metricas_servir(ruta_metricas);
 
-   int epoll_n;
+   if(agregar_acks)
+   {
+   		for(int i = 0; i < num_shards; i++)
+   		{
+   			reactor_mantenimiento_iniciar(&shards[i], CICLO_REVISION_MS);
+   		}
+   }
 
-   do
+   if(tick_hz > 0)
    {
-   		epoll_n = epoll_wait(epoll_fd, epoll_events, MAXEVENTS, -1);
+   		for(int i = 0; i < num_shards; i++)
+   		{
+   			reactor_tick_iniciar(&shards[i], tick_hz);
+   		}
+   }
 
-		for (int i = 0; i < epoll_n; i++)
-		{
+   if(puerto_udp > 0)
+   {
+   		for(int i = 0; i < num_shards; i++)
+   		{
+   			reactor_udp_iniciar(&shards[i], puerto_udp + i);
+   		}
+   }
 
-		    if (epoll_events[i].events & EPOLLIN)
-		    {
+   if(balanceo_ms > 0)
+   {
+   		for(int i = 0; i < num_shards; i++)
+   		{
+   			reactor_balanceo_iniciar(&shards[i], balanceo_ms);
+   		}
+   }
 
-			    if( epoll_events[i].data.fd == listen_sd)
-			    {
-#ifdef _DEBUG_
-			    	printf("Recibida nueva conexión.\n");
-#endif
-			    	int new_client_sd;
-
-			    	do
-				    {
-				    	struct sockaddr_in new_client_sockaddr;
-		    			socklen_t clientsize = sizeof(new_client_sockaddr);
-				    	new_client_sd = accept4(listen_sd, (struct sockaddr *)&new_client_sockaddr, &clientsize, SOCK_NONBLOCK);
-				    	if(new_client_sd < 0)
-				    	{
-				    		if(errno != EWOULDBLOCK || errno != EAGAIN)
-				    		{
-				    			perror("accept4()");
-				    		}
-				    		break;
-				    	}
-
-				    	epoll_event client_event;
-				    	epoll_data_client *data = (epoll_data_client * ) malloc(sizeof(struct epoll_data_client));
-				    	init_epoll_data(new_client_sd, data);
-				    	client_event.events = /*EPOLLOUT|*/ EPOLLIN | EPOLLET| EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-				    	client_event.data.ptr = data;
-#ifdef _DEBUG_
-			    		cout << "Nuevo cliente en socket: " << new_client_sd << endl <<flush;
-#endif
-			    		int index = new_client_sd % THREAD_POOL;
-
-				    	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_client_sd, &client_event) < 0)
-				    	{
-				    		perror("epoll_ctl()");
-				    		close(new_client_sd);
-				    		continue;
-				    	}
-
-
-				    } while (new_client_sd >= 0);
-				} else {
-					mensaje_t tipo_mensaje = 0;
-					struct epoll_data_client * data_client = (struct epoll_data_client *) epoll_events[i].data.ptr;
-					read(data_client->socketfd, &tipo_mensaje, sizeof(mensaje_t));
-					if(tipo_mensaje == MENSAJE_CONEXION)
-					{
-						char buffer_mensaje[40];
-						struct mensaje_conexion nueva_conexion;
-						int rc = read(data_client->socketfd, &nueva_conexion, sizeof(struct mensaje_conexion));
-
-						struct grupo_key key;
-						key.grupoid = nueva_conexion.grupo;
-
-						clientes_conectados++;
-#ifdef _DEBUG_
-						printf("Recibida petición a GrupoID: %d. Socket: %d\n", key.grupoid, data_client->socketfd);
-						printf("Clientes conectados: %d\n", clientes_conectados);
-						printf("Grupos activos: %d\n\n", clientes_grupo.size());
-#endif
-						mensaje_t tipo_mensaje = MENSAJE_CONEXION_SATISFACTORIA;
-						struct mensaje_conexion_satisfactoria conexion_satisfactoria;
-						conexion_satisfactoria.cliente_id = data_client->socketfd;
+   BITACORA(BITACORA_INFO, "Servidor escuchando en el puerto %d con %d shards.", SERVER_PORT, num_shards);
+
+   /* En modo SO_REUSEPORT no hay hilo aceptador: cada shard acepta y atiende el handshake de sus
+   propias conexiones, y sólo las pasa a otro shard si su grupo vive allí */
+   if(reuseport)
+   {
+   		for(int i = 0; i < num_shards; i++)
+   		{
+   			reactor_escuchar(&shards[i], aio_socket_escucha(SERVER_PORT, true));
+   		}
 
-						memcpy(buffer_mensaje, &tipo_mensaje, sizeof(mensaje_t));
-						memcpy(buffer_mensaje + sizeof(mensaje_t), &conexion_satisfactoria, sizeof(struct mensaje_conexion_satisfactoria));
+   		if(usar_uring)
+   			iniciar_uring();
 
-						write(data_client->socketfd, buffer_mensaje, sizeof(mensaje_t) + sizeof(struct mensaje_conexion_satisfactoria));
+   		reactor_arrancar(shards, num_shards, worker_thread);
 
-						int index = nueva_conexion.grupo % THREAD_POOL;
-						epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data_client->socketfd, NULL);
+   		for(int i = 0; i < num_shards; i++)
+   		{
+   			shards[i].hilo.join();
+   		}
 
-						epoll_data_client *data = (epoll_data_client * ) malloc(sizeof(struct epoll_data_client));
-				    	init_epoll_data(data_client->socketfd, data);
-				    	epoll_event client_event;
-				    	client_event.events = EPOLLOUT | EPOLLIN | EPOLLET| EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-				    	client_event.data.ptr = data;
+   		return 0;
+   }
 
-				    	data->grupoid = nueva_conexion.grupo;
+   if(usar_uring)
+   		iniciar_uring();
 
-						
+   reactor_arrancar(shards, num_shards, worker_thread);
 
-						clientes_grupo[key].push_back(data);
+   epoll_fd = epoll_create1(0);
+   reactor_aceptador_iniciar(&aceptador, aio_socket_escucha(SERVER_PORT), epoll_fd);
 
+   int epoll_n;
 
-						epoll_ctl(epoll_fd_threads[index], EPOLL_CTL_ADD, data_client->socketfd, &client_event);
-					}
-				}
-		    }
+   do
+   {
+   		epoll_n = epoll_wait(epoll_fd, epoll_events, MAXEVENTS, -1);
+
+		for (int i = 0; i < epoll_n; i++)
+		{
+
+			if (epoll_events[i].data.ptr == &aceptador.listen_sd)
+			{
+				aceptar_clientes(&aceptador);
+			}
+			else if (epoll_events[i].data.ptr == &aceptador.timerfd)
+			{
+				expirar_handshakes(&aceptador);
+			}
+			else if (epoll_events[i].events & EPOLLIN)
+			{
+				procesar_handshake(NULL, &aceptador, (struct epoll_data_client *) epoll_events[i].data.ptr);
+			}
+			else
+			{
+				cerrar_handshake(&aceptador, (struct epoll_data_client *) epoll_events[i].data.ptr);
+			}
 		}
     } while (TRUE);
 
-    close(listen_sd);
+    close(aceptador.listen_sd);
 
     return 0;
 }
@@ -0,0 +1,85 @@
+#ifndef _SPSC_H_
+#define _SPSC_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <new>
+#include <atomic>
+
+using namespace std;
+
+/* Cola acotada de un solo productor y un solo consumidor, sin cerrojos. Cada lado escribe sólo su
+índice, en su propia línea de caché, y guarda una copia del índice del otro que sólo vuelve a leer
+cuando la copia dice que la cola está llena (productor) o vacía (consumidor) */
+template<typename T> struct cola_spsc {
+	alignas(64) atomic<uint64_t> 	cola;				// Lo escribe el productor
+	uint64_t 					cabeza_vista;
+	alignas(64) atomic<uint64_t> 	cabeza;				// Lo escribe el consumidor
+	uint64_t 					cola_vista;
+	alignas(64) uint64_t 		mascara;
+	T 							*elementos;
+};
+
+// capacidad ha de ser potencia de dos
+template<typename T> struct cola_spsc<T> * spsc_crear(uint32_t capacidad)
+{
+	void *memoria;
+
+	if(posix_memalign(&memoria, 64, sizeof(struct cola_spsc<T>)) != 0)
+	{
+		perror("spsc_crear->posix_memalign()");
+		exit(-1);
+	}
+
+	struct cola_spsc<T> *cola = new (memoria) struct cola_spsc<T>;
+
+	cola->cola.store(0);
+	cola->cabeza.store(0);
+	cola->cabeza_vista = 0;
+	cola->cola_vista = 0;
+	cola->mascara = capacidad - 1;
+	cola->elementos = new T[capacidad];
+
+	return cola;
+}
+
+// Sólo desde el productor. Devuelve false si la cola está llena
+template<typename T> inline bool spsc_meter(struct cola_spsc<T> *cola, const T &elemento)
+{
+	uint64_t posicion = cola->cola.load(memory_order_relaxed);
+
+	if(posicion - cola->cabeza_vista > cola->mascara)
+	{
+		cola->cabeza_vista = cola->cabeza.load(memory_order_acquire);
+
+		if(posicion - cola->cabeza_vista > cola->mascara)
+			return false;
+	}
+
+	cola->elementos[posicion & cola->mascara] = elemento;
+	cola->cola.store(posicion + 1, memory_order_release);
+
+	return true;
+}
+
+// Sólo desde el consumidor. Devuelve false si la cola está vacía
+template<typename T> inline bool spsc_sacar(struct cola_spsc<T> *cola, T *elemento)
+{
+	uint64_t posicion = cola->cabeza.load(memory_order_relaxed);
+
+	if(posicion == cola->cola_vista)
+	{
+		cola->cola_vista = cola->cola.load(memory_order_acquire);
+
+		if(posicion == cola->cola_vista)
+			return false;
+	}
+
+	*elemento = cola->elementos[posicion & cola->mascara];
+	cola->cabeza.store(posicion + 1, memory_order_release);
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+
+using namespace std;
+
+static int io_uring_setup(unsigned entradas, struct io_uring_params *parametros)
+{
+    return syscall(__NR_io_uring_setup, entradas, parametros);
+}
+
+static int io_uring_enter(int fd, unsigned enviar, unsigned esperar, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, enviar, esperar, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned operacion, void *argumento, unsigned n)
+{
+    return syscall(__NR_io_uring_register, fd, operacion, argumento, n);
+}
+
+/* Crea el anillo y proyecta sus zonas compartidas. Devuelve false, con errno, si el kernel no tiene
+io_uring o no se permite usarlo, y entonces el servidor sigue con epoll */
+bool uring_crear(struct anillo_uring *anillo, unsigned entradas)
+{
+    struct io_uring_params parametros;
+
+    memset(anillo, 0, sizeof(struct anillo_uring));
+    memset(&parametros, 0, sizeof(parametros));
+
+    // Las tareas del kernel se ejecutan al entrar en io_uring_enter(), sin interrumpir al hilo
+    parametros.flags = IORING_SETUP_COOP_TASKRUN;
+
+    if((anillo->fd = io_uring_setup(entradas, &parametros)) < 0 && errno == EINVAL)
+    {
+        memset(&parametros, 0, sizeof(parametros));
+        anillo->fd = io_uring_setup(entradas, &parametros);
+    }
+
+    if(anillo->fd < 0)
+        return false;
+
+    anillo->sq_tamano = parametros.sq_off.array + parametros.sq_entries * sizeof(unsigned);
+    anillo->cq_tamano = parametros.cq_off.cqes + parametros.cq_entries * sizeof(struct io_uring_cqe);
+    anillo->sqes_tamano = parametros.sq_entries * sizeof(struct io_uring_sqe);
+
+    if(parametros.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(anillo->cq_tamano > anillo->sq_tamano)
+            anillo->sq_tamano = anillo->cq_tamano;
+        anillo->cq_tamano = anillo->sq_tamano;
+    }
+
+    anillo->sq_mapa = mmap(NULL, anillo->sq_tamano, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, anillo->fd, IORING_OFF_SQ_RING);
+    anillo->cq_mapa = anillo->sq_mapa;
+
+    if(anillo->sq_mapa != MAP_FAILED && !(parametros.features & IORING_FEAT_SINGLE_MMAP))
+        anillo->cq_mapa = mmap(NULL, anillo->cq_tamano, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, anillo->fd, IORING_OFF_CQ_RING);
+
+    anillo->sqes = (struct io_uring_sqe *) mmap(NULL, anillo->sqes_tamano, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, anillo->fd, IORING_OFF_SQES);
+
+    if(anillo->sq_mapa == MAP_FAILED || anillo->cq_mapa == MAP_FAILED || anillo->sqes == MAP_FAILED)
+    {
+        int error = errno;
+
+        uring_liberar(anillo);
+        errno = error;
+        return false;
+    }
+
+    char *sq = (char *) anillo->sq_mapa, *cq = (char *) anillo->cq_mapa;
+
+    anillo->sq_cabeza = (unsigned *) (sq + parametros.sq_off.head);
+    anillo->sq_cola = (unsigned *) (sq + parametros.sq_off.tail);
+    anillo->sq_mascara = (unsigned *) (sq + parametros.sq_off.ring_mask);
+    anillo->cq_cabeza = (unsigned *) (cq + parametros.cq_off.head);
+    anillo->cq_cola = (unsigned *) (cq + parametros.cq_off.tail);
+    anillo->cq_mascara = (unsigned *) (cq + parametros.cq_off.ring_mask);
+    anillo->cqes = (struct io_uring_cqe *) (cq + parametros.cq_off.cqes);
+
+    // Cada hueco del anillo de envío apunta siempre a la entrada de su mismo índice
+    unsigned *indices = (unsigned *) (sq + parametros.sq_off.array);
+
+    for(unsigned i = 0; i < parametros.sq_entries; i++)
+        indices[i] = i;
+
+    anillo->sq_local = *anillo->sq_cola;
+
+    return true;
+}
+
+void uring_liberar(struct anillo_uring *anillo)
+{
+    if(anillo->buffers != NULL)
+        munmap(anillo->buffers, anillo->buffers_tamano);
+
+    if(anillo->sqes != NULL && anillo->sqes != MAP_FAILED)
+        munmap(anillo->sqes, anillo->sqes_tamano);
+
+    if(anillo->cq_mapa != NULL && anillo->cq_mapa != MAP_FAILED && anillo->cq_mapa != anillo->sq_mapa)
+        munmap(anillo->cq_mapa, anillo->cq_tamano);
+
+    if(anillo->sq_mapa != NULL && anillo->sq_mapa != MAP_FAILED)
+        munmap(anillo->sq_mapa, anillo->sq_tamano);
+
+    free(anillo->ficheros_libres);
+
+    if(anillo->fd >= 0)
+        close(anillo->fd);
+
+    anillo->fd = -1;
+}
+
+// Devuelve una entrada libre y a cero; si el anillo está lleno, antes envía las preparadas
+struct io_uring_sqe * uring_sqe(struct anillo_uring *anillo)
+{
+    while(anillo->sq_local - __atomic_load_n(anillo->sq_cabeza, __ATOMIC_ACQUIRE) > *anillo->sq_mascara)
+    {
+        if(uring_enviar(anillo, 0) < 0 && errno != EBUSY && errno != EAGAIN)
+            exit(-1);
+    }
+
+    struct io_uring_sqe *sqe = &anillo->sqes[anillo->sq_local & *anillo->sq_mascara];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    anillo->sq_local++;
+
+    return sqe;
+}
+
+/* Publica las entradas preparadas y, si esperar es mayor que 0, bloquea hasta que haya al menos esas
+completadas. Envío y espera cuestan una sola llamada al sistema */
+int uring_enviar(struct anillo_uring *anillo, unsigned esperar)
+{
+    unsigned pendientes = anillo->sq_local - *anillo->sq_cola;
+    int rc;
+
+    if(pendientes == 0 && esperar == 0)
+        return 0;
+
+    __atomic_store_n(anillo->sq_cola, anillo->sq_local, __ATOMIC_RELEASE);
+
+    do
+    {
+        rc = io_uring_enter(anillo->fd, pendientes, esperar, esperar > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while(rc < 0 && errno == EINTR);
+
+    // EBUSY indica que hay completadas sin recoger: se recogen y se reintenta en la siguiente vuelta
+    if(rc < 0 && errno != EBUSY && errno != EAGAIN)
+        perror("uring_enviar->io_uring_enter()");
+
+    return rc;
+}
+
+/* Envía lo pendiente y entra en el kernel sin esperar a ninguna completada. Con
+IORING_SETUP_COOP_TASKRUN parte del trabajo de las recepciones sólo se hace al entrar en el kernel,
+así que una espera activa que sólo mirase la cola de completadas no vería llegar nada */
+int uring_sondear(struct anillo_uring *anillo)
+{
+    unsigned pendientes = anillo->sq_local - *anillo->sq_cola;
+    int rc;
+
+    __atomic_store_n(anillo->sq_cola, anillo->sq_local, __ATOMIC_RELEASE);
+
+    do
+    {
+        rc = io_uring_enter(anillo->fd, pendientes, 0, IORING_ENTER_GETEVENTS);
+    } while(rc < 0 && errno == EINTR);
+
+    if(rc < 0 && errno != EBUSY && errno != EAGAIN)
+        perror("uring_sondear->io_uring_enter()");
+
+    return rc;
+}
+
+// Siguiente completada sin recoger, o NULL si no hay ninguna
+struct io_uring_cqe * uring_cqe(struct anillo_uring *anillo)
+{
+    unsigned cabeza = *anillo->cq_cabeza;
+
+    if(cabeza == __atomic_load_n(anillo->cq_cola, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &anillo->cqes[cabeza & *anillo->cq_mascara];
+}
+
+void uring_cqe_visto(struct anillo_uring *anillo)
+{
+    __atomic_store_n(anillo->cq_cabeza, *anillo->cq_cabeza + 1, __ATOMIC_RELEASE);
+}
+
+/* Registra una tabla de n ficheros vacía. Las operaciones sobre un fichero registrado se ahorran
+buscar y referenciar el descriptor en cada llamada */
+bool uring_ficheros_registrar(struct anillo_uring *anillo, int n)
+{
+    int *fds = (int *) malloc(n * sizeof(int));
+
+    for(int i = 0; i < n; i++)
+        fds[i] = -1;
+
+    int rc = io_uring_register(anillo->fd, IORING_REGISTER_FILES, fds, n);
+
+    free(fds);
+
+    if(rc < 0)
+        return false;
+
+    anillo->ficheros_libres = (int *) malloc(n * sizeof(int));
+    anillo->n_libres = n;
+
+    for(int i = 0; i < n; i++)
+        anillo->ficheros_libres[i] = n - 1 - i;
+
+    return true;
+}
+
+static int actualizar_fichero(struct anillo_uring *anillo, int hueco, int fd)
+{
+    struct io_uring_files_update actualizacion;
+
+    memset(&actualizacion, 0, sizeof(actualizacion));
+    actualizacion.offset = hueco;
+    actualizacion.fds = (uint64_t) (uintptr_t) &fd;
+
+    return io_uring_register(anillo->fd, IORING_REGISTER_FILES_UPDATE, &actualizacion, 1);
+}
+
+// Pone fd en un hueco libre de la tabla y devuelve el hueco, o -1 si no hay tabla o está llena
+int uring_fichero_alta(struct anillo_uring *anillo, int fd)
+{
+    if(anillo->ficheros_libres == NULL || anillo->n_libres == 0)
+        return -1;
+
+    int hueco = anillo->ficheros_libres[anillo->n_libres - 1];
+
+    if(actualizar_fichero(anillo, hueco, fd) < 0)
+    {
+        perror("uring_fichero_alta->io_uring_register()");
+        return -1;
+    }
+
+    anillo->n_libres--;
+
+    return hueco;
+}
+
+void uring_fichero_baja(struct anillo_uring *anillo, int hueco)
+{
+    if(actualizar_fichero(anillo, hueco, -1) < 0)
+    {
+        perror("uring_fichero_baja->io_uring_register()");
+        return;
+    }
+
+    anillo->ficheros_libres[anillo->n_libres++] = hueco;
+}
+
+/* Registra el anillo de buffers proporcionados del grupo URING_GRUPO_BUFFERS. Las recepciones no
+llevan buffer propio: el kernel toma uno del anillo sólo cuando llegan datos, e indica cuál en la
+completada. Así un cliente parado no retiene memoria de recepción */
+bool uring_buffers_registrar(struct anillo_uring *anillo)
+{
+    size_t anillo_tamano = URING_BUFFERS * sizeof(struct io_uring_buf);
+    struct io_uring_buf_reg registro;
+
+    anillo->buffers_tamano = anillo_tamano + (size_t) URING_BUFFERS * URING_TAMANO_BUFFER;
+
+    void *memoria = mmap(NULL, anillo->buffers_tamano, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    if(memoria == MAP_FAILED)
+        return false;
+
+    memset(&registro, 0, sizeof(registro));
+    registro.ring_addr = (uint64_t) (uintptr_t) memoria;
+    registro.ring_entries = URING_BUFFERS;
+    registro.bgid = URING_GRUPO_BUFFERS;
+
+    if(io_uring_register(anillo->fd, IORING_REGISTER_PBUF_RING, &registro, 1) < 0)
+    {
+        int error = errno;
+
+        munmap(memoria, anillo->buffers_tamano);
+        errno = error;
+        return false;
+    }
+
+    anillo->buffers = (struct io_uring_buf_ring *) memoria;
+    anillo->memoria_buffers = (char *) memoria + anillo_tamano;
+
+    for(unsigned id = 0; id < URING_BUFFERS; id++)
+        uring_buffer_devolver(anillo, id);
+
+    return true;
+}
+
+char * uring_buffer(struct anillo_uring *anillo, unsigned id)
+{
+    return anillo->memoria_buffers + (size_t) id * URING_TAMANO_BUFFER;
+}
+
+// Devuelve el buffer id al kernel. Con buffers clásicos es una operación más, sin completada que atender
+void uring_buffer_devolver(struct anillo_uring *anillo, unsigned id)
+{
+    if(anillo->buffers_clasicos)
+    {
+        struct io_uring_sqe *sqe = uring_sqe(anillo);
+
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1;
+        sqe->addr = (uint64_t) (uintptr_t) uring_buffer(anillo, id);
+        sqe->len = URING_TAMANO_BUFFER;
+        sqe->off = id;
+        sqe->buf_group = URING_GRUPO_BUFFERS;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = 0;
+        return;
+    }
+
+    unsigned short cola = anillo->buffers->tail;
+    struct io_uring_buf *buffer = &anillo->buffers->bufs[cola & (URING_BUFFERS - 1)];
+
+    buffer->addr = (uint64_t) (uintptr_t) uring_buffer(anillo, id);
+    buffer->len = URING_TAMANO_BUFFER;
+    buffer->bid = id;
+
+    __atomic_store_n(&anillo->buffers->tail, (unsigned short) (cola + 1), __ATOMIC_RELEASE);
+}
+
+/* Arma una recepción multishot sobre un par de sockets, envía un byte y la sigue hasta que termina al
+cerrar el par. Devuelve el resultado de la primera completada, que sólo vale si trae el byte en un buffer
+proporcionado y la recepción sigue armada. Las completadas que no son de la prueba se descartan */
+static int probar_recepcion(struct anillo_uring *anillo, bool *admitido)
+{
+    int par[2], primera = -EINVAL;
+    bool sigue = true, recibida = false;
+
+    *admitido = false;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, par) < 0)
+        return -errno;
+
+    struct io_uring_sqe *sqe = uring_sqe(anillo);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = par[0];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GRUPO_BUFFERS;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = 1;
+
+    if(write(par[1], "x", 1) != 1)
+        sigue = false;
+
+    while(sigue && uring_enviar(anillo, 1) >= 0)
+    {
+        struct io_uring_cqe *cqe;
+
+        while(sigue && (cqe = uring_cqe(anillo)) != NULL)
+        {
+            if(cqe->user_data == 1)
+            {
+                if(!recibida)
+                {
+                    primera = cqe->res;
+                    *admitido = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE);
+                    recibida = true;
+
+                    // Al cerrar la lectura la recepción termina con una última completada que hay que recoger
+                    shutdown(par[0], SHUT_RDWR);
+                }
+
+                if(cqe->flags & IORING_CQE_F_BUFFER)
+                    uring_buffer_devolver(anillo, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+                sigue = cqe->flags & IORING_CQE_F_MORE;
+            }
+
+            uring_cqe_visto(anillo);
+        }
+    }
+
+    close(par[0]);
+    close(par[1]);
+
+    return primera;
+}
+
+/* Comprueba que el kernel admite lo que usa el servidor: una recepción multishot con buffer
+proporcionado debe entregar los datos y seguir armada. Hay kernels que registran el anillo de buffers
+pero no entregan ninguno (-ENOBUFS); con ellos se pasa a darle los buffers con IORING_OP_PROVIDE_BUFFERS.
+Si ni así funciona, mejor epoll */
+bool uring_probar(struct anillo_uring *anillo)
+{
+    bool admitido;
+
+    if(anillo->buffers == NULL)
+        return false;
+
+    if(probar_recepcion(anillo, &admitido) != -ENOBUFS || admitido)
+        return admitido;
+
+    struct io_uring_buf_reg registro;
+
+    memset(&registro, 0, sizeof(registro));
+    registro.bgid = URING_GRUPO_BUFFERS;
+
+    if(io_uring_register(anillo->fd, IORING_UNREGISTER_PBUF_RING, &registro, 1) < 0)
+        return false;
+
+    anillo->buffers_clasicos = true;
+
+    // Todos los buffers a la vez, contiguos y con identificadores consecutivos desde 0
+    struct io_uring_sqe *sqe = uring_sqe(anillo);
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = URING_BUFFERS;
+    sqe->addr = (uint64_t) (uintptr_t) anillo->memoria_buffers;
+    sqe->len = URING_TAMANO_BUFFER;
+    sqe->off = 0;
+    sqe->buf_group = URING_GRUPO_BUFFERS;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+
+    probar_recepcion(anillo, &admitido);
+
+    return admitido;
+}
@@ -0,0 +1,72 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRADAS				4096
+#define URING_FICHEROS				4096
+#define URING_BUFFERS				1024		// Potencia de dos
+#define URING_TAMANO_BUFFER			4096
+#define URING_GRUPO_BUFFERS			0
+
+/* Etiqueta de cada operación en su user_data: el puntero al objeto al que pertenece (cliente, shard o
+aceptador), con el tipo de operación en los tres bits bajos, que la alineación deja libres */
+#define URING_OP_RECV				1
+#define URING_OP_ENVIO				2
+#define URING_OP_ESPERA				3
+#define URING_OP_EPOLL				4
+#define URING_OP_ACEPTAR			5
+#define URING_OP_MASCARA			7
+
+#define URING_DATOS(puntero, op)	((uint64_t) (uintptr_t) (puntero) | (op))
+#define URING_PUNTERO(user_data)	((void *) (uintptr_t) ((user_data) & ~(uint64_t) URING_OP_MASCARA))
+
+/* Anillo de io_uring manejado directamente con las llamadas al sistema, sin liburing. Los punteros sq_*
+y cq_* apuntan a las zonas que se comparten con el kernel; sq_local es la cola de las entradas ya
+preparadas que aún no se han publicado. ficheros_libres son los huecos libres de la tabla de ficheros
+registrados (NULL si el kernel no la admite) y buffers el anillo de buffers proporcionados del que el
+kernel toma uno para cada recepción. Si el kernel no entrega los buffers del anillo, buffers_clasicos
+indica que se le dan uno a uno con IORING_OP_PROVIDE_BUFFERS sobre la misma memoria */
+struct anillo_uring {
+	int 						fd;
+
+	unsigned 					*sq_cabeza, *sq_cola, *sq_mascara;
+	struct io_uring_sqe 		*sqes;
+	unsigned 					sq_local;
+
+	unsigned 					*cq_cabeza, *cq_cola, *cq_mascara;
+	struct io_uring_cqe 		*cqes;
+
+	void 						*sq_mapa, *cq_mapa;
+	size_t 						sq_tamano, cq_tamano, sqes_tamano;
+
+	int 						*ficheros_libres;
+	int 						n_libres;
+
+	struct io_uring_buf_ring 	*buffers;
+	char 						*memoria_buffers;
+	size_t 						buffers_tamano;
+	bool 						buffers_clasicos;
+};
+
+bool uring_crear(struct anillo_uring *anillo, unsigned entradas);
+void uring_liberar(struct anillo_uring *anillo);
+bool uring_probar(struct anillo_uring *anillo);
+
+struct io_uring_sqe * uring_sqe(struct anillo_uring *anillo);
+int uring_enviar(struct anillo_uring *anillo, unsigned esperar);
+int uring_sondear(struct anillo_uring *anillo);
+struct io_uring_cqe * uring_cqe(struct anillo_uring *anillo);
+void uring_cqe_visto(struct anillo_uring *anillo);
+
+bool uring_ficheros_registrar(struct anillo_uring *anillo, int n);
+int uring_fichero_alta(struct anillo_uring *anillo, int fd);
+void uring_fichero_baja(struct anillo_uring *anillo, int hueco);
+
+bool uring_buffers_registrar(struct anillo_uring *anillo);
+char * uring_buffer(struct anillo_uring *anillo, unsigned id);
+void uring_buffer_devolver(struct anillo_uring *anillo, unsigned id);
+
+#endif